@@ -1,5 +1,14 @@
 #include "lz4_filter.hpp"
+#include "lz4_transcode.hpp"
+#include "lz4_blocks.hpp"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
+#include <iostream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/copy.hpp>
 
@@ -9,10 +18,18 @@ namespace bio = boost::iostreams;
 namespace ext { namespace bio = ext::boost::iostreams; }
 
 int main(int argc, char** argv){
-	if( 2 != argc ){
+	const bool one_arg = 2 < argc && (0 == strcmp(argv[1], "-t") || 0 == strcmp(argv[1], "-z") || 0 == strcmp(argv[1], "-a"));
+	const bool two_args = 3 < argc && 0 == strcmp(argv[1], "-s");
+	if( 2 != argc && !(3 == argc && one_arg) && !(4 == argc && two_args) ){
 		cout << "USAGE: " << endl
 		     << "\t" << argv[0] << " -c   - compress STDIN to STDOUT" << endl
-		     << "\t" << argv[0] << " -d   - decompress STDIN to STDOUT" << endl;
+		     << "\t" << argv[0] << " -d   - decompress STDIN to STDOUT" << endl
+		     << "\t" << argv[0] << " -t [4-7]   - legacy lz4 STDIN to LZ4S frames with" << endl
+		     << "\t              64 KB .. 4 MB checksummed blocks (default 4) to STDOUT" << endl
+		     << "\t" << argv[0] << " -z [4-7]   - same for gzip'ed legacy lz4 STDIN" << endl
+		     << "\t" << argv[0] << " -v   - check the block structure of STDIN" << endl
+		     << "\t" << argv[0] << " -a FILE   - append STDIN to FILE, without recompressing" << endl
+		     << "\t" << argv[0] << " -s N FILE   - split FILE into FILE.1 .. FILE.N at block boundaries" << endl;
 		return 1;
 	}
 
@@ -32,9 +49,108 @@ int main(int argc, char** argv){
 		case 'c':
 			bifo.push( ext::bio::lz4_compressor() );
 			break;
-		case 'd':
-			bifo.push( ext::bio::lz4_decompressor() );
-			break;
+		case 'd': {
+			// reserve the whole output file at once if the stream tells its size
+			ext::bio::lz4_multichar_decompressor d;
+			std::streamsize size = d.content_size(cin);
+			struct stat st;
+			if( size > 0 && 0 == fstat(STDOUT_FILENO, &st) && S_ISREG(st.st_mode) ){
+				// from where the output goes: the end of file with O_APPEND
+				const int flags = fcntl(STDOUT_FILENO, F_GETFL);
+				const bool append = flags >= 0 && (flags & O_APPEND);
+				const off_t start = append ? st.st_size : lseek(STDOUT_FILENO, 0, SEEK_CUR);
+#ifdef FALLOC_FL_KEEP_SIZE
+				// blocks only: the file size stays, appends still go to its end
+				const int err = start < 0 || 0 == fallocate(STDOUT_FILENO, FALLOC_FL_KEEP_SIZE, start, size)
+				                ? 0 : errno;
+#else
+				const int err = start < 0 || append ? 0 : posix_fallocate(STDOUT_FILENO, start, size);
+#endif
+				// only running out of space matters; some file systems can not reserve
+				if( ENOSPC == err ){
+					cerr << "error: no space left for " << size << " bytes" << endl;
+					return 4;
+				}
+			}
+
+			bio::filtering_istream bifi;
+			bifi.push( d );
+			bifi.push( cin );
+			bifi.exceptions( std::ifstream::badbit );
+			boost::iostreams::copy(bifi, cout);
+			return 0;
+		}
+		case 't':
+		case 'z': {
+			ext::bio::lz4_transcode_params p;
+			p.output.block_size_id = 3 == argc ? atoi(argv[2]) : 4;
+			p.output.block_checksum = true;
+			p.gzip_input = 'z' == argv[1][1];
+			if( p.output.block_size_id < 4 || p.output.block_size_id > 7 ){
+				cerr << "error: invalid block size!" << endl;
+				return 3;
+			}
+			ext::bio::lz4_transcode(cin, cout, p);
+			return 0;
+		}
+		case 'v': {
+			try {
+				ext::bio::lz4_stream_info info = ext::bio::lz4_verify(cin);
+				cout << (info.format == ext::bio::lz4::frame ? "frame" : "legacy") << ": "
+				     << info.streams << " streams, " << info.blocks << " blocks, "
+				     << info.size << " bytes, decoded at most " << info.max_decoded_size << " bytes" << endl;
+			} catch( const std::exception& e ){
+				cerr << "error: " << e.what() << endl;
+				return 4;
+			}
+			return 0;
+		}
+		case 'a': {
+			// the format the file starts with is the one it ends with,
+			// as lz4_compressor writes a single format; an empty file
+			// takes STDIN as it is
+			fstream file(argv[2], ios::in | ios::out | ios::binary | ios::ate);
+			if( !file ){
+				cerr << "error: cannot open " << argv[2] << endl;
+				return 4;
+			}
+			const streamoff size = file.tellg();
+			uint32_t magic = 0;
+			file.seekg(0);
+			file.read((char*)&magic, sizeof(magic));
+			file.clear();
+			file.seekp(0, ios::end);
+			try {
+				ext::bio::lz4_append(cin, file, magic == ext::bio::lz4::legacy_magic
+				                                    ? ext::bio::lz4::legacy : ext::bio::lz4::frame);
+				file.close();
+			} catch( const std::exception& e ){
+				// leave the file as it was
+				file.close();
+				if( 0 != truncate(argv[2], size) ){
+					cerr << "error: " << argv[2] << " is left with a broken tail" << endl;
+				}
+				cerr << "error: " << e.what() << endl;
+				return 4;
+			}
+			return 0;
+		}
+		case 's': {
+			if( atoi(argv[2]) < 1 ){
+				cerr << "error: invalid number of parts!" << endl;
+				return 3;
+			}
+			try {
+				std::vector<std::string> names = ext::bio::lz4_split(argv[3], atoi(argv[2]));
+				for( size_t i = 0; i < names.size(); i++ ){
+					cout << names[i] << endl;
+				}
+			} catch( const std::exception& e ){
+				cerr << "error: " << e.what() << endl;
+				return 4;
+			}
+			return 0;
+		}
 		default:
 			cerr << "error: invalid argument!" << endl;
 			return 3;
@@ -0,0 +1,194 @@
+#ifndef LZ4_ASIO_HPP_INCLUDED
+#define LZ4_ASIO_HPP_INCLUDED
+
+// lz4 compression straight between Boost.Asio buffer sequences, with
+// the block state machine of the lz4 filters
+
+#include <boost/asio/buffer.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+//
+// Class name: lz4_asio_result
+// Description: Bytes taken from the input and given to the output
+//      sequence by one basic_lz4_asio_decompressor::decompress() call.
+//
+struct lz4_asio_result
+    {
+    std::size_t consumed;
+    std::size_t produced;
+    bool        done;       // end of input reached and everything decoded
+    };
+
+//
+// Template name: basic_lz4_asio_compressor
+// Description: Compresses a ConstBufferSequence into one complete lz4
+//      stream (header, blocks, end mark). The input buffers are compressed
+//      where they are, the stream is written in a buffer of its own whose
+//      sequence can be passed as is to a scatter-gather async_write, after
+//      a protocol header for example.
+//
+template<typename Alloc = std::allocator<char> >
+class basic_lz4_asio_compressor : private detail::lz4_compressor_impl<Alloc>
+    {
+    public:
+        explicit basic_lz4_asio_compressor(const lz4_params& params = lz4_params(lz4::frame));
+
+        // the returned buffer stays valid until the next compress() call
+        template<typename ConstBufferSequence>
+        ::boost::asio::const_buffer compress(const ConstBufferSequence& buffers);
+    private:
+        typedef detail::lz4_compressor_impl<Alloc> impl_type;
+
+        std::size_t compress_bound(std::size_t size) const;
+
+        lz4_params m_params;
+        std::vector<char, Alloc> m_out;
+    };
+
+typedef basic_lz4_asio_compressor<> lz4_asio_compressor;
+
+//
+// Template name: basic_lz4_asio_decompressor
+// Description: Decodes lz4 data received in ConstBufferSequences into
+//      MutableBufferSequences. The stream may be split anywhere between
+//      calls; the state is kept until the end of input is signalled.
+//
+template<typename Alloc = std::allocator<char>,
+         typename Format = lz4::autodetect_format,
+         typename ChecksumPolicy = lz4::skip_checksums>
+class basic_lz4_asio_decompressor : private detail::lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>
+    {
+    public:
+        // memory_budget: bytes for the block buffers, 0 = no limit
+        explicit basic_lz4_asio_decompressor(std::size_t memory_budget = 0)
+            : impl_type(memory_budget) { }
+
+        // eof: in holds the last bytes of the stream; call again with
+        // an empty input until done is set, if out got full before
+        template<typename ConstBufferSequence, typename MutableBufferSequence>
+        lz4_asio_result decompress(const ConstBufferSequence& in,
+                                   const MutableBufferSequence& out,
+                                   bool eof = false);
+
+        // ready for the next stream
+        void reset() { impl_type::close(); }
+    private:
+        typedef detail::lz4_decompressor_impl<Alloc, Format, ChecksumPolicy> impl_type;
+    };
+
+typedef basic_lz4_asio_decompressor<> lz4_asio_decompressor;
+
+//------------------Implementation of basic_lz4_asio_compressor--------------//
+
+template<typename Alloc>
+basic_lz4_asio_compressor<Alloc>::basic_lz4_asio_compressor(const lz4_params& params)
+    : impl_type(params), m_params(params)
+    {
+    }
+
+// worst case size of a block sequence holding size bytes
+template<typename Alloc>
+std::size_t basic_lz4_asio_compressor<Alloc>::compress_bound(std::size_t size) const
+    {
+    const std::size_t block_max = m_params.format == lz4::frame
+        ? lz4::lz4s_blocksize(m_params.block_size_id) : lz4::legacy_blocksize;
+    const std::size_t blocks = (size + block_max - 1) / block_max;
+    return LZ4_COMPRESSBOUND(size) + blocks * (4 + 4 + 16);
+    }
+
+template<typename Alloc>
+template<typename ConstBufferSequence>
+::boost::asio::const_buffer basic_lz4_asio_compressor<Alloc>::compress
+( const ConstBufferSequence& buffers )
+    {
+    typedef decltype(::boost::asio::buffer_sequence_begin(buffers)) iterator;
+    const iterator first = ::boost::asio::buffer_sequence_begin(buffers);
+    const iterator last  = ::boost::asio::buffer_sequence_end(buffers);
+
+    std::size_t bound = lz4::lz4s_max_header_size + 8;
+    for (iterator it = first; it != last; ++it)
+        bound += compress_bound(::boost::asio::const_buffer(*it).size());
+    if (m_params.max_buffered > 0)
+        bound += compress_bound(m_params.max_buffered);
+    m_out.resize(bound);
+
+    impl_type::close(); // a new stream per call
+    char* dst = m_out.data();
+    char* const dst_end = dst + m_out.size();
+    for (iterator it = first; it != last; ++it)
+        {
+        ::boost::asio::const_buffer buf(*it);
+        const char* src = static_cast<const char*>(buf.data());
+        const char* const src_end = src + buf.size();
+        while (src != src_end)
+            {
+            // a legacy block is made of all the input given at once
+            const char* chunk_end = src + std::min<std::size_t>(src_end - src, lz4::legacy_blocksize);
+            impl_type::filter(src, chunk_end, dst, dst_end, false);
+            }
+        }
+    const char* none = dst_end;
+    while (impl_type::filter(none, none, dst, dst_end, true))
+        ;
+    return ::boost::asio::const_buffer(m_out.data(), dst - m_out.data());
+    }
+
+//------------------Implementation of basic_lz4_asio_decompressor------------//
+
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+template<typename ConstBufferSequence, typename MutableBufferSequence>
+lz4_asio_result basic_lz4_asio_decompressor<Alloc, Format, ChecksumPolicy>::decompress
+( const ConstBufferSequence& in, const MutableBufferSequence& out, bool eof )
+    {
+    typedef decltype(::boost::asio::buffer_sequence_begin(in)) in_iterator;
+    typedef decltype(::boost::asio::buffer_sequence_begin(out)) out_iterator;
+    in_iterator in_it = ::boost::asio::buffer_sequence_begin(in);
+    const in_iterator in_last = ::boost::asio::buffer_sequence_end(in);
+    out_iterator out_it = ::boost::asio::buffer_sequence_begin(out);
+    const out_iterator out_last = ::boost::asio::buffer_sequence_end(out);
+
+    lz4_asio_result result = { 0, 0, false };
+    ::boost::asio::const_buffer src;
+    ::boost::asio::mutable_buffer dst;
+    for (;;)
+        {
+        while (src.size() == 0 && in_it != in_last)
+            src = ::boost::asio::const_buffer(*in_it++);
+        while (dst.size() == 0 && out_it != out_last)
+            dst = ::boost::asio::mutable_buffer(*out_it++);
+        if (dst.size() == 0)
+            break; // out is full
+
+        // the last input buffer is filtered with flush set
+        const bool flush = eof && in_it == in_last;
+        const char* src_begin = static_cast<const char*>(src.data());
+        char* dst_begin = static_cast<char*>(dst.data());
+        const bool again = impl_type::filter(src_begin, src_begin + src.size(),
+                                             dst_begin, dst_begin + dst.size(), flush);
+        const std::size_t consumed = src_begin - static_cast<const char*>(src.data());
+        const std::size_t produced = dst_begin - static_cast<char*>(dst.data());
+        src += consumed;
+        dst += produced;
+        result.consumed += consumed;
+        result.produced += produced;
+        if (flush && !again && src.size() == 0)
+            {
+            result.done = true;
+            break;
+            }
+        if (!consumed && !produced)
+            break; // input exhausted, wait for more
+        }
+    return result;
+    }
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_ASIO_HPP_INCLUDED
@@ -0,0 +1,220 @@
+#ifndef LZ4_AUTO_HPP_INCLUDED
+#define LZ4_AUTO_HPP_INCLUDED
+
+// one decompressor for data stored as legacy lz4, LZ4S frames, gzip or
+// as is, told apart by the first bytes of the stream:
+//
+//   lz4_auto_decompressor d;
+//   in.push(d);
+//   in.push(file);
+//   ...
+//   if (d.codec() == lz4::codec_gzip) ...   // not moved to lz4 yet
+
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+namespace lz4 {
+
+// what basic_auto_decompressor found at the start of the stream
+enum codec
+    {
+    codec_unknown = 0,      // no stream read yet
+    codec_raw,              // none of the below, passed through
+    codec_lz4_legacy,
+    codec_lz4_frame,
+    codec_gzip
+    };
+
+// codec of a stream starting with the size first bytes at data;
+// codec_unknown while size is too small to tell
+inline codec detect_codec(const char* data, std::size_t size)
+    {
+    if (size >= 2 && (unsigned char)data[0] == 0x1f && (unsigned char)data[1] == 0x8b)
+        return codec_gzip;
+    if (size < sizeof(legacy_magic))
+        return codec_unknown;
+    uint32_t magic;
+    std::memcpy(&magic, data, sizeof(magic));
+    if (magic == legacy_magic)
+        return codec_lz4_legacy;
+    if (magic == lz4s_magic)
+        return codec_lz4_frame;
+    return codec_raw;
+    }
+
+} // namespace lz4
+
+namespace detail
+{
+
+// the bytes read to detect the codec, then the rest of the source
+template<typename Source>
+struct auto_decompressor_source
+    {
+    typedef char char_type;
+    struct category : source_tag { };
+
+    auto_decompressor_source(Source& src, const char* head, std::size_t& head_pos, std::size_t head_size)
+        : src(src), head(head), head_pos(head_pos), head_size(head_size) { }
+
+    std::streamsize read(char* s, std::streamsize n)
+        {
+        if (head_pos < head_size)
+            {
+            std::streamsize amt = std::min<std::streamsize>(n, head_size - head_pos);
+            std::memcpy(s, head + head_pos, amt);
+            head_pos += amt;
+            return amt;
+            }
+        return ::boost::iostreams::read(src, s, n);
+        }
+
+    Source& src;
+    const char* head;
+    std::size_t& head_pos;
+    std::size_t head_size;
+    };
+
+} // namespace detail
+
+using namespace ::boost::iostreams;
+
+//
+// Template name: basic_auto_decompressor
+// Description: Model of InputFilter reading the first bytes of each
+//      stream to pick lz4_multichar_decompressor (legacy or LZ4S),
+//      Boost's gzip_decompressor, or no decoding at all; the stream then
+//      goes straight through the decoder picked, without another buffer.
+//      Only that decoder is created, on the first stream that needs it.
+//      codec() tells which one once the first read() returned, until
+//      the next stream is read.
+//
+template<typename Alloc = std::allocator<char> >
+class basic_auto_decompressor
+    {
+    private:
+        struct impl;
+    public:
+        typedef char char_type;
+        struct category : input, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag { };
+        std::streamsize optimal_buffer_size() const
+            {
+            // a read() of at least a block is decoded without staging
+            return lz4::legacy_blocksize;
+            }
+
+        basic_auto_decompressor();
+
+        template<typename Source>
+        std::streamsize read(Source& src, char_type* s, std::streamsize n);
+        template<typename Source>
+        void close(Source& src);
+
+        lz4::codec codec() const { return pimpl_->codec; }
+    private:
+        template<typename Source>
+        void detect(Source& src);
+
+        ::boost::shared_ptr<impl> pimpl_;
+    };
+
+typedef basic_auto_decompressor<> lz4_auto_decompressor;
+
+//------------------Implementation of basic_auto_decompressor----------------//
+
+template<typename Alloc>
+struct basic_auto_decompressor<Alloc>::impl
+    {
+    impl() : codec(lz4::codec_unknown), detected(false), head_pos(0), head_size(0) { }
+
+    lz4::codec codec;
+    bool detected;                          // codec is the current stream's
+    char head[sizeof(lz4::legacy_magic)];   // read to detect the codec
+    std::size_t head_pos, head_size;
+    std::unique_ptr<basic_lz4_multichar_decompressor<Alloc> > lz4;
+    std::unique_ptr<basic_gzip_decompressor<Alloc> > gzip;
+    };
+
+template<typename Alloc>
+basic_auto_decompressor<Alloc>::basic_auto_decompressor() :
+    pimpl_(new impl())
+    {
+    }
+
+template<typename Alloc>
+template<typename Source>
+void basic_auto_decompressor<Alloc>::detect( Source& src )
+    {
+    impl& i = *pimpl_;
+    i.codec = lz4::codec_unknown;
+    while (i.head_size < sizeof(i.head) &&
+           lz4::detect_codec(i.head, i.head_size) == lz4::codec_unknown)
+        {
+        std::streamsize amt = ::boost::iostreams::read(src, i.head + i.head_size,
+                                                       sizeof(i.head) - i.head_size);
+        if (amt < 0)
+            break;
+        if (amt == 0)
+            return; // would block, detect again on the next read()
+        i.head_size += amt;
+        }
+    i.codec = lz4::detect_codec(i.head, i.head_size);
+    if (i.codec == lz4::codec_unknown)
+        i.codec = lz4::codec_raw; // shorter than any magic
+    if (i.codec == lz4::codec_gzip && !i.gzip)
+        i.gzip.reset(new basic_gzip_decompressor<Alloc>());
+    if ((i.codec == lz4::codec_lz4_legacy || i.codec == lz4::codec_lz4_frame) && !i.lz4)
+        i.lz4.reset(new basic_lz4_multichar_decompressor<Alloc>());
+    i.detected = true;
+    }
+
+template<typename Alloc>
+template<typename Source>
+std::streamsize basic_auto_decompressor<Alloc>::read( Source& src, char_type* s, std::streamsize n )
+    {
+    impl& i = *pimpl_;
+    if (!i.detected)
+        {
+        detect(src);
+        if (!i.detected)
+            return 0;
+        }
+    detail::auto_decompressor_source<Source> in(src, i.head, i.head_pos, i.head_size);
+    switch (i.codec)
+        {
+        case lz4::codec_gzip:
+            return i.gzip->read(in, s, n);
+        case lz4::codec_lz4_legacy:
+        case lz4::codec_lz4_frame:
+            return i.lz4->read(in, s, n);
+        default:
+            return in.read(s, n);
+        }
+    }
+
+template<typename Alloc>
+template<typename Source>
+void basic_auto_decompressor<Alloc>::close( Source& src )
+    {
+    impl& i = *pimpl_;
+    detail::auto_decompressor_source<Source> in(src, i.head, i.head_pos, i.head_size);
+    if (i.detected && i.codec == lz4::codec_gzip)
+        i.gzip->close(in, BOOST_IOS::in);
+    else if (i.detected && i.codec != lz4::codec_raw)
+        i.lz4->close(in);
+    i.detected = false;
+    i.head_pos = i.head_size = 0;
+    }
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_AUTO_HPP_INCLUDED
@@ -0,0 +1,282 @@
+#include "lz4_blocks.hpp"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+namespace ext {
+namespace boost {
+namespace iostreams {
+
+namespace {
+
+// LZ4S frame descriptor flags (FLG byte)
+const uint8_t flg_dict_id          = 1 << 0;
+const uint8_t flg_content_checksum = 1 << 2;
+const uint8_t flg_content_size     = 1 << 3;
+const uint8_t flg_block_checksum   = 1 << 4;
+const uint8_t flg_independent      = 1 << 5;
+
+enum chunk_kind { chunk_header, chunk_block, chunk_end };
+
+// blocks are read over the previous ones without clearing the buffer
+typedef std::vector<char, detail::uninitialized_allocator<char> > bytes;
+
+// one piece of a stream, bytes as read
+struct chunk {
+  chunk_kind kind;
+  lz4::stream_format format;
+  bytes data;
+};
+
+// Reads the input header by header and block by block. The compressed
+// data is only copied, so the input goes by at the speed it is read.
+class block_walker {
+ public:
+  block_walker(std::istream& in, bool block_checksums)
+      : m_in(in), m_block_checksums(block_checksums), m_state(between),
+        m_flg(0), m_block_max(0), m_offset(0) {}
+
+  // the next chunk; false at the end of in, between two streams
+  bool next(chunk& c);
+  // frame flags of the last frame header
+  uint8_t flags() const { return m_flg; }
+  uint32_t block_max() const { return m_block_max; }
+  uint64_t offset() const { return m_offset; }
+
+ private:
+  enum state { between, in_legacy, in_frame };
+
+  // false if in ends before the first byte and at_end is allowed
+  bool read(bytes& v, size_t n, bool at_end);
+  void fail(const char* msg) const;
+  void frame_header(chunk& c);
+
+  std::istream& m_in;
+  bool m_block_checksums;
+  state m_state;
+  uint8_t m_flg;
+  uint32_t m_block_max;
+  uint64_t m_offset;
+};
+
+void block_walker::fail(const char* msg) const {
+  std::ostringstream s;
+  s << msg << " at offset " << m_offset;
+  throw std::runtime_error(s.str());
+}
+
+bool block_walker::read(bytes& v, size_t n, bool at_end) {
+  const size_t pos = v.size();
+  v.resize(pos + n);
+  m_in.read(&v[pos], n);
+  const size_t got = m_in.gcount();
+  if (got == 0 && at_end) {
+    v.resize(pos);
+    return false;
+  }
+  if (got != n) {
+    m_offset += got;
+    fail("lz4: truncated stream");
+  }
+  m_offset += n;
+  return true;
+}
+
+void block_walker::frame_header(chunk& c) {
+  read(c.data, 2, false);
+  m_flg = c.data[4];
+  const uint8_t bd = c.data[5];
+  const unsigned int block_size_id = (bd >> 4) & 7;
+  if ((m_flg >> 6) != 1) fail("LZ4S version not supported");
+  if ((m_flg & 2) || (bd & 0x8f)) fail("LZ4S reserved bits set");
+  if (block_size_id < 4) fail("LZ4S block size not supported");
+  if (m_flg & flg_dict_id) fail("LZ4S preset dictionary not supported");
+  read(c.data, ((m_flg & flg_content_size) ? 8 : 0) + 1, false);
+  const uint8_t check = c.data.back();
+  if (((lz4::xxh32(&c.data[4], c.data.size() - 5) >> 8) & 0xff) != check)
+    fail("LZ4S header checksum mismatch");
+  m_block_max = lz4::lz4s_blocksize(block_size_id);
+}
+
+bool block_walker::next(chunk& c) {
+  c.data.clear();
+  if (m_state == in_frame) {
+    read(c.data, 4, false);
+    uint32_t word;
+    memcpy(&word, &c.data[0], sizeof(word));
+    if (word == 0) {
+      if (m_flg & flg_content_checksum) read(c.data, 4, false);
+      c.kind = chunk_end;
+      c.format = lz4::frame;
+      m_state = between;
+      return true;
+    }
+    const uint32_t size = word & 0x7fffffff;
+    if (size > m_block_max) fail("LZ4S block size too big");
+    read(c.data, size, false);
+    if (m_flg & flg_block_checksum) {
+      read(c.data, 4, false);
+      uint32_t sum;
+      memcpy(&sum, &c.data[4 + size], sizeof(sum));
+      if (m_block_checksums && sum != lz4::xxh32(&c.data[4], size))
+        fail("LZ4S block checksum mismatch");
+    }
+    c.kind = chunk_block;
+    c.format = lz4::frame;
+    return true;
+  }
+
+  if (!read(c.data, 4, true)) return false;
+  uint32_t word;
+  memcpy(&word, &c.data[0], sizeof(word));
+  if (word == lz4::legacy_magic) {
+    c.kind = chunk_header;
+    c.format = lz4::legacy;
+    m_state = in_legacy;
+    return true;
+  }
+  if (m_state == between) {
+    if (word != lz4::lz4s_magic) fail("not a lz4 legacy or lz4s stream!");
+    frame_header(c);
+    c.kind = chunk_header;
+    c.format = lz4::frame;
+    m_state = in_frame;
+    return true;
+  }
+  // legacy block
+  if (word == 0 || word > (uint32_t)LZ4_COMPRESSBOUND(lz4::legacy_blocksize))
+    fail("lz4: invalid block size");
+  read(c.data, word, false);
+  c.kind = chunk_block;
+  c.format = lz4::legacy;
+  return true;
+}
+
+template <typename Bytes>
+void write(std::ostream& out, const Bytes& b) {
+  out.write(&b[0], b.size());
+  if (!out) throw std::runtime_error("lz4: write error");
+}
+
+// the frame header without content size and content checksum
+std::vector<char> split_header(const std::vector<char>& header) {
+  std::vector<char> h(header.begin(), header.begin() + 6);
+  h[4] &= ~(flg_content_size | flg_content_checksum);
+  h.push_back((lz4::xxh32(&h[4], 2) >> 8) & 0xff);
+  return h;
+}
+
+}  // namespace
+
+//------------------Implementation of lz4_verify-----------------------------//
+
+lz4_stream_info lz4_verify(std::istream& in, bool block_checksums) {
+  lz4_stream_info info;
+  block_walker w(in, block_checksums);
+  chunk c;
+  while (w.next(c)) {
+    if (c.kind == chunk_header) {
+      if (info.streams++ == 0) info.format = c.format;
+    } else if (c.kind == chunk_block) {
+      ++info.blocks;
+      uint32_t word;
+      memcpy(&word, &c.data[0], sizeof(word));
+      if (c.format == lz4::legacy)
+        info.max_decoded_size += lz4::legacy_blocksize;
+      else if (word & 0x80000000)
+        info.max_decoded_size += word & 0x7fffffff;  // stored as is
+      else
+        info.max_decoded_size += w.block_max();
+    }
+  }
+  info.size = w.offset();
+  return info;
+}
+
+//------------------Implementation of lz4_append-----------------------------//
+
+uint64_t lz4_append(std::istream& in, std::ostream& out,
+                    lz4::stream_format tail) {
+  uint64_t written = 0;
+  block_walker w(in, true);
+  chunk c;
+  for (bool first = true; w.next(c); first = false) {
+    if (first && c.kind == chunk_header && tail == lz4::legacy) {
+      if (c.format != lz4::legacy)
+        throw std::runtime_error("lz4: a frame cannot follow legacy blocks");
+      continue;  // more blocks of the same legacy stream
+    }
+    write(out, c.data);
+    written += c.data.size();
+  }
+  return written;
+}
+
+//------------------Implementation of lz4_split------------------------------//
+
+// Part k + 1 starts with the first block starting past k/parts of the
+// file; a part ending inside a frame gets an end mark.
+std::vector<std::string> lz4_split(const std::string& path,
+                                   unsigned int parts) {
+  if (parts == 0) throw std::runtime_error("lz4: no parts to split into");
+  std::ifstream in(path.c_str(), std::ios::binary);
+  if (!in) throw std::runtime_error("lz4: cannot open " + path);
+  in.seekg(0, std::ios::end);
+  const uint64_t size = in.tellg();
+  in.seekg(0);
+
+  std::vector<std::string> names;
+  std::ofstream out;
+  std::vector<char> header;   // of the stream the next block belongs to
+  bool pending = false;       // header not written to the current part yet
+  bool in_frame = false;
+  const std::vector<char> end_mark(4, 0);
+
+  block_walker w(in, false);
+  chunk c;
+  while (w.next(c)) {
+    if (c.kind == chunk_header) {
+      if (c.format == lz4::frame && !(w.flags() & flg_independent))
+        throw std::runtime_error("lz4: linked blocks cannot be split");
+      header.assign(c.data.begin(), c.data.end());
+      if (c.format == lz4::frame) header = split_header(header);
+      pending = true;
+      in_frame = c.format == lz4::frame;
+      continue;
+    }
+    if (c.kind == chunk_end) {
+      if (!pending) write(out, end_mark);
+      pending = true;  // empty frames are dropped
+      in_frame = false;
+      continue;
+    }
+    const uint64_t start = w.offset() - c.data.size();
+    if (names.empty() ||
+        (names.size() < parts && start >= size * names.size() / parts)) {
+      if (out.is_open()) {
+        if (in_frame && !pending) write(out, end_mark);
+        out.close();
+        if (!out) throw std::runtime_error("lz4: write error");
+      }
+      std::ostringstream name;
+      name << path << '.' << names.size() + 1;
+      names.push_back(name.str());
+      out.open(names.back().c_str(), std::ios::binary | std::ios::trunc);
+      if (!out) throw std::runtime_error("lz4: cannot create " + names.back());
+      pending = true;
+    }
+    if (pending) write(out, header);
+    pending = false;
+    write(out, c.data);
+  }
+  if (out.is_open()) {
+    out.close();
+    if (!out) throw std::runtime_error("lz4: write error");
+  }
+  return names;
+}
+
+}  // namespace iostreams
+}  // namespace boost
+}  // namespace ext
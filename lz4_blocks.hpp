@@ -0,0 +1,75 @@
+#ifndef LZ4_BLOCKS_HPP_INCLUDED
+#define LZ4_BLOCKS_HPP_INCLUDED
+
+// whole-block operations on legacy lz4 streams and LZ4S frames: the
+// block size fields are walked and the blocks copied as they are, never
+// decoded nor encoded again:
+//
+//   lz4_stream_info info = lz4_verify(in);     // structure only
+//   lz4_append(more, out, lz4::legacy);        // out opened for appending
+//   lz4_split("big.lz4", 4);                   // big.lz4.1 .. big.lz4.4
+
+#include <boost/cstdint.hpp> // uint*_t
+#include <boost/iostreams/detail/config/dyn_link.hpp>
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+//
+// Class name: lz4_stream_info.
+// Description: What lz4_verify found in a stream.
+//
+struct lz4_stream_info
+    {
+    lz4_stream_info()
+        : format(lz4::legacy), streams(0), blocks(0), size(0), max_decoded_size(0)
+        { }
+    lz4::stream_format format;      // of the first stream
+    uint64_t streams;               // legacy streams and LZ4S frames
+    uint64_t blocks;
+    uint64_t size;                  // bytes read
+    uint64_t max_decoded_size;      // decoded size is at most this
+    };
+
+//
+// Function name: lz4_verify
+// Description: Walks the headers, block size fields and end marks of
+//      the concatenated legacy streams and LZ4S frames read from in,
+//      and the LZ4S block checksums if block_checksums is set; the
+//      blocks themselves are not decoded. Throws std::runtime_error at
+//      the first bad field or if in ends inside a block or frame.
+//
+BOOST_IOSTREAMS_DECL lz4_stream_info lz4_verify( std::istream& in, bool block_checksums = true );
+
+//
+// Function name: lz4_append
+// Description: Writes the stream read from in to out so that it follows
+//      an existing stream ending with a stream of format tail (for a file
+//      written by lz4_compressor, the format of its first bytes): the
+//      legacy_magic of a legacy stream after a legacy stream is dropped,
+//      anything else is copied as it is. A frame cannot follow legacy
+//      blocks. Returns the bytes written; throws std::runtime_error on
+//      bad input, possibly after some of it was written.
+//
+BOOST_IOSTREAMS_DECL uint64_t lz4_append( std::istream& in, std::ostream& out, lz4::stream_format tail );
+
+//
+// Function name: lz4_split
+// Description: Cuts the file at path into at most parts files of about
+//      the same size, path.1, path.2 ..., at block boundaries. Each part
+//      is a stream of its own: legacy parts start with legacy_magic,
+//      frame parts with the header of the frame cut, without the content
+//      size and content checksum, which only held for the whole frame.
+//      LZ4S frames with linked blocks cannot be split. Returns the names
+//      of the parts written.
+//
+BOOST_IOSTREAMS_DECL std::vector<std::string> lz4_split( const std::string& path, unsigned int parts );
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_BLOCKS_HPP_INCLUDED
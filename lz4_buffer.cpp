@@ -0,0 +1,166 @@
+#include "lz4_buffer.hpp"
+#include <lz4.h>
+#include <algorithm>
+#include <cstring>
+#include <ostream>
+#include <stdexcept>
+
+namespace ext {
+namespace boost {
+namespace iostreams {
+
+//------------------Implementation of lz4_buffer-----------------------------//
+
+lz4_buffer::lz4_buffer(const lz4_buffer_params& params)
+    : m_params(params), m_size(0), m_arena_used(0), m_cache_clock(0) {
+  if (m_params.block_size_id < 4 || m_params.block_size_id > 7)
+    throw std::invalid_argument("lz4_buffer: block_size_id must be 4..7");
+  if (!m_params.cache_blocks)
+    throw std::invalid_argument("lz4_buffer: at least 1 cached block");
+  m_block_size = lz4::lz4s_blocksize(m_params.block_size_id);
+  m_tail.reserve(m_block_size);
+  lz4::xxh32_reset(m_content_xxh);
+}
+
+void lz4_buffer::append(const char* data, std::size_t size) {
+  lz4::xxh32_update(m_content_xxh, data, size);
+  m_size += size;
+  while (size) {
+    const std::size_t amt = std::min(size, m_block_size - m_tail.size());
+    m_tail.insert(m_tail.end(), data, data + amt);
+    data += amt;
+    size -= amt;
+    if (m_tail.size() == m_block_size) seal();
+  }
+}
+
+// blocks are kept as write() outputs them, see lz4::encode_block
+lz4_params lz4_buffer::stream_params() const {
+  lz4_params params(m_params.format, m_params.format == lz4::frame ? (std::streamsize)m_size : -1);
+  params.block_size_id = m_params.block_size_id;
+  params.block_checksum = m_params.block_checksum;
+  params.content_checksum = m_params.content_checksum;
+  return params;
+}
+
+void lz4_buffer::seal() {
+  block b;
+  char* dst = allocate(lz4::encoded_block_bound(m_tail.size()));
+  b.stored = dst;
+  b.stored_size = lz4::encode_block(stream_params(), &m_tail[0], m_tail.size(), dst);
+  m_arena_used += b.stored_size;
+  m_blocks.push_back(b);
+  m_tail.clear();
+}
+
+// chunks hold a few blocks at least
+std::size_t lz4_buffer::arena_chunk() const {
+  return std::max(m_params.arena_size, 4 * lz4::encoded_block_bound(m_block_size));
+}
+
+// room for size bytes at the end of the arena; a chunk too full for
+// them is left as it is
+char* lz4_buffer::allocate(std::size_t size) {
+  const std::size_t chunk = arena_chunk();
+  if (m_arena.empty() || chunk - m_arena_used < size) {
+    m_arena.push_back(std::unique_ptr<char[]>(new char[chunk]));
+    m_arena_used = 0;
+  }
+  return m_arena.back().get() + m_arena_used;
+}
+
+std::size_t lz4_buffer::compressed_size() const {
+  return m_arena.size() * arena_chunk() + m_blocks.capacity() * sizeof(block) + m_tail.capacity();
+}
+
+lz4_buffer::decoded_block lz4_buffer::decode(uint64_t offset, uint64_t& start) const {
+  const std::size_t index = offset / m_block_size;
+  start = (uint64_t)index * m_block_size;
+  if (index >= m_blocks.size()) {
+    if (offset >= m_size) throw std::out_of_range("lz4_buffer: read past the end");
+    return decoded_block(new std::vector<char>(m_tail));
+  }
+  std::lock_guard<std::mutex> lock(m_cache_mutex);
+  const uint64_t now = ++m_cache_clock;
+  for (cache_entry& e : m_cache) {
+    if (e.index == index) {
+      e.used = now;
+      return e.data;
+    }
+  }
+
+  const block& b = m_blocks[index];
+  uint32_t field;
+  memcpy(&field, b.stored, 4);
+  std::shared_ptr<std::vector<char> > data(new std::vector<char>(m_block_size));
+  if (field & 0x80000000) {
+    memcpy(&(*data)[0], b.stored + 4, m_block_size);
+  } else if (LZ4_decompress_safe(b.stored + 4, &(*data)[0], field, m_block_size) !=
+             (int)m_block_size) {
+    throw std::runtime_error("lz4: corrupt block in lz4_buffer");
+  }
+  cache_entry e = {index, data, now};
+  if (m_cache.size() < m_params.cache_blocks) {
+    m_cache.push_back(e);
+  } else {
+    // least recently used
+    *std::min_element(m_cache.begin(), m_cache.end(),
+                      [](const cache_entry& a, const cache_entry& b) { return a.used < b.used; }) = e;
+  }
+  return data;
+}
+
+std::size_t lz4_buffer::read(uint64_t offset, char* dst, std::size_t size) const {
+  if (offset >= m_size) return 0;
+  size = std::min<uint64_t>(size, m_size - offset);
+  std::size_t done = 0;
+  while (done < size) {
+    uint64_t start;
+    const std::size_t index = offset / m_block_size;
+    decoded_block keep;
+    const char* src;
+    std::size_t avail;
+    if (index >= m_blocks.size()) {
+      // the partial block, as it is
+      start = (uint64_t)index * m_block_size;
+      src = m_tail.data();
+      avail = m_tail.size();
+    } else {
+      keep = decode(offset, start);
+      src = keep->data();
+      avail = keep->size();
+    }
+    const std::size_t amt = std::min<uint64_t>(size - done, start + avail - offset);
+    memcpy(dst + done, src + (offset - start), amt);
+    done += amt;
+    offset += amt;
+  }
+  return done;
+}
+
+void lz4_buffer::write(std::ostream& out) const {
+  const lz4_params params = stream_params();
+  const bool lz4s = params.format == lz4::frame;
+  char header[lz4::lz4s_max_header_size];
+  out.write(header, lz4::encode_header(params, header));
+  for (const block& b : m_blocks) out.write(b.stored, b.stored_size);
+
+  if (!m_tail.empty()) {
+    // the only block encoded here
+    std::vector<char> stored(lz4::encoded_block_bound(m_tail.size()));
+    out.write(&stored[0], lz4::encode_block(params, m_tail.data(), m_tail.size(), &stored[0]));
+  }
+  if (lz4s) {
+    const uint32_t end_mark = 0;
+    out.write((const char*)&end_mark, 4);
+    if (m_params.content_checksum) {
+      const uint32_t sum = lz4::xxh32_digest(m_content_xxh);
+      out.write((const char*)&sum, 4);
+    }
+  }
+  if (!out) throw std::runtime_error("lz4: write error");
+}
+
+}  // namespace iostreams
+}  // namespace boost
+}  // namespace ext
@@ -0,0 +1,163 @@
+#ifndef LZ4_BUFFER_HPP_INCLUDED
+#define LZ4_BUFFER_HPP_INCLUDED
+
+// large payloads kept compressed in memory, decoded block by block when
+// read, and written out as an lz4 stream as they are:
+//
+//   lz4_buffer b;
+//   b.append(data, size);
+//   b.read(offset, dst, n);                         // touched blocks only
+//   std::string s(b.begin() + offset, b.end());
+//   b.write(file);                                  // no encoding again
+
+#include <boost/cstdint.hpp> // uint*_t
+#include <boost/iostreams/detail/config/dyn_link.hpp>
+#include <boost/iterator/iterator_facade.hpp>
+
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+//
+// Class name: lz4_buffer_params.
+// Description: Encapsulates the parameters passed to lz4_buffer.
+//
+struct lz4_buffer_params
+    {
+    // Non-explicit constructor.
+    lz4_buffer_params( unsigned int block_size_id = 4,
+                       unsigned int cache_blocks = 4 )
+        : format(lz4::frame), block_size_id(block_size_id),
+          block_checksum(false), content_checksum(true),
+          cache_blocks(cache_blocks), arena_size(1024*1024)
+        { }
+    lz4::stream_format format;          // written by write()
+    unsigned int       block_size_id;   // 4..7 => 64 KB .. 4 MB blocks, in either format
+    bool               block_checksum;  // LZ4S only
+    bool               content_checksum;// LZ4S only
+    unsigned int       cache_blocks;    // decoded blocks kept, >= 1
+    std::size_t        arena_size;      // compressed blocks are allocated this much at a time
+    };
+
+//
+// Class name: lz4_buffer
+// Description: Append-only byte container holding its data as lz4
+//      blocks in large arena chunks. The last, partial block stays
+//      decoded; reads decode the blocks they touch into a small cache
+//      of the cache_blocks blocks used last. write() outputs the blocks
+//      as a legacy stream or an LZ4S frame without encoding them again
+//      (only the partial block is). Reads from several threads are
+//      safe, appends are not.
+//
+class BOOST_IOSTREAMS_DECL lz4_buffer
+    {
+    private:
+        struct block;
+        typedef std::shared_ptr<const std::vector<char> > decoded_block;
+    public:
+        class const_iterator;
+
+        explicit lz4_buffer(const lz4_buffer_params& params = lz4_buffer_params());
+
+        void append(const char* data, std::size_t size);
+        // copies at most size bytes from offset on to dst; returns the
+        // bytes copied, fewer past the end
+        std::size_t read(uint64_t offset, char* dst, std::size_t size) const;
+        // the whole stream; lz4_decompressor reads it back
+        void write(std::ostream& out) const;
+
+        uint64_t size() const { return m_size; }
+        bool empty() const { return m_size == 0; }
+        // arena, block index and partial block, cache left out
+        std::size_t compressed_size() const;
+        std::size_t block_size() const { return m_block_size; }
+
+        const_iterator begin() const;
+        const_iterator end() const;
+    private:
+        lz4_buffer(const lz4_buffer&);
+        lz4_buffer& operator=(const lz4_buffer&);
+
+        struct block
+            {
+            const char* stored;         // as written: size field, data, checksum
+            uint32_t    stored_size;
+            };
+
+        // what write() outputs, for lz4::encode_header/encode_block
+        lz4_params stream_params() const;
+        void seal();
+        std::size_t arena_chunk() const;
+        char* allocate(std::size_t size);
+        // the decoded block holding offset, and where it starts
+        decoded_block decode(uint64_t offset, uint64_t& start) const;
+
+        lz4_buffer_params m_params;
+        std::size_t m_block_size;
+        uint64_t m_size;
+        std::vector<block> m_blocks;
+        std::vector<std::unique_ptr<char[]> > m_arena;
+        std::size_t m_arena_used;       // in m_arena.back()
+        std::vector<char> m_tail;       // the partial block
+        lz4::xxh32_state m_content_xxh;
+
+        struct cache_entry
+            {
+            std::size_t   index;
+            decoded_block data;
+            uint64_t      used;
+            };
+        mutable std::mutex m_cache_mutex;
+        mutable std::vector<cache_entry> m_cache;
+        mutable uint64_t m_cache_clock;
+    };
+
+//
+// Class name: lz4_buffer::const_iterator
+// Description: Random access over the decoded bytes; it keeps the block
+//      it points into, whatever the cache does, and decodes (or finds
+//      in the cache) the next one when moving out of it.
+//
+class lz4_buffer::const_iterator
+    : public ::boost::iterator_facade<const_iterator, char,
+                                      ::boost::random_access_traversal_tag, char>
+    {
+    public:
+        const_iterator() : m_buffer(0), m_pos(0), m_start(0) { }
+    private:
+        friend class lz4_buffer;
+        friend class ::boost::iterator_core_access;
+
+        const_iterator(const lz4_buffer* buffer, uint64_t pos)
+            : m_buffer(buffer), m_pos(pos), m_start(0) { }
+
+        char dereference() const
+            {
+            if (!m_block || m_pos < m_start || m_pos >= m_start + m_block->size())
+                m_block = m_buffer->decode(m_pos, m_start);
+            return (*m_block)[m_pos - m_start];
+            }
+        bool equal(const const_iterator& other) const { return m_pos == other.m_pos; }
+        void increment() { ++m_pos; }
+        void decrement() { --m_pos; }
+        void advance(std::ptrdiff_t n) { m_pos += n; }
+        std::ptrdiff_t distance_to(const const_iterator& other) const
+            { return (std::ptrdiff_t)(other.m_pos - m_pos); }
+
+        const lz4_buffer* m_buffer;
+        uint64_t m_pos;
+        mutable uint64_t m_start;
+        mutable decoded_block m_block;
+    };
+
+inline lz4_buffer::const_iterator lz4_buffer::begin() const { return const_iterator(this, 0); }
+inline lz4_buffer::const_iterator lz4_buffer::end() const { return const_iterator(this, m_size); }
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_BUFFER_HPP_INCLUDED
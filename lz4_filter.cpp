@@ -5,13 +5,61 @@
 
 #include "lz4_filter.hpp"
 #include <lz4.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 // do not unpack more data if already have this amount of unpacked data buffered
-// highly affects performance!
+// highly affects performance! (without a memory budget, which sets its own)
 #define MAX_OUT_BUF (1024 * 1024)
 
 //#define LZ4_FILTER_DEBUG
 
+// USDT (systemtap/dtrace) static probes of provider lz4_filter, nops
+// until a tracer attaches, e.g.
+//   bpftrace -e 'usdt:./lz4fcli:lz4_filter:block_end { @[arg1] = hist(arg3); }'
+//
+//   header(stream, lz4s, content_size)
+//   stage(stream, bytes, bytes_needed)   partial block gathered in m_in_buf
+//   block_start(stream, path, size)
+//   block_end(stream, path, in_size, out_size)   out_size 0: the block did
+//                                        not fit the output, it is staged
+//   fail(stream, message)
+//
+// path: see enum block_path. Build with -DLZ4_FILTER_NO_USDT to leave
+// them out even if <sys/sdt.h> is there.
+#if !defined(LZ4_FILTER_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LZ4_FILTER_USDT 1
+#endif
+#endif
+
+#ifdef LZ4_FILTER_USDT
+#define LZ4_PROBE(name, ...) STAP_PROBEV(lz4_filter, name, __VA_ARGS__)
+#else
+// never evaluated, only keeps the arguments used: block_start/block_done
+// would otherwise warn about parameters that exist for the probes
+template <typename... Args>
+char lz4_probe_args(const Args&...);
+#define LZ4_PROBE(name, ...) ((void)sizeof(lz4_probe_args(__VA_ARGS__)))
+#endif
+
+// which way a block went, as reported by the block probes
+enum block_path {
+  path_direct = 0,    // decoded from the caller's input to its output
+  path_gathered = 1,  // decoded from m_in_buf to the caller's output
+  path_staged = 2,    // decoded into m_out_buf
+  path_compress = 3   // encoded
+};
+
 #define COLOR_RED "\x1b[31m"
 #define COLOR_YELLOW "\x1b[33m"
 #define COLOR_BLUE "\x1b[34m"
@@ -23,6 +71,7 @@
 #define FAIL(msg)                                                   \
   {                                                                 \
     m_fail = true;                                                  \
+    LZ4_PROBE(fail, this, msg);                                     \
     printf("%s[!] exception: %s%s\n", COLOR_RED, msg, COLOR_RESET); \
     throw std::runtime_error(msg);                                  \
   }
@@ -30,6 +79,7 @@
 #define FAIL(msg)                  \
   {                                \
     m_fail = true;                 \
+    LZ4_PROBE(fail, this, msg);    \
     throw std::runtime_error(msg); \
   }
 #endif
@@ -38,11 +88,168 @@ namespace ext {
 namespace boost {
 namespace iostreams {
 
+//------------------Implementation of xxh32----------------------------------//
+
+namespace lz4 {
+
+static const uint32_t XXH_PRIME32_1 = 0x9E3779B1U;
+static const uint32_t XXH_PRIME32_2 = 0x85EBCA77U;
+static const uint32_t XXH_PRIME32_3 = 0xC2B2AE3DU;
+static const uint32_t XXH_PRIME32_4 = 0x27D4EB2FU;
+static const uint32_t XXH_PRIME32_5 = 0x165667B1U;
+
+static inline uint32_t xxh_rotl(uint32_t x, int r) { return (x << r) | (x >> (32 - r)); }
+
+static inline uint32_t xxh_read32(const void* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;  // little endian host assumed, as everywhere in this filter
+}
+
+static inline uint32_t xxh_round(uint32_t acc, uint32_t input) {
+  acc += input * XXH_PRIME32_2;
+  acc = xxh_rotl(acc, 13);
+  return acc * XXH_PRIME32_1;
+}
+
+void xxh32_reset(xxh32_state& state, uint32_t seed) {
+  memset(&state, 0, sizeof(state));
+  state.seed = seed;
+  state.v[0] = seed + XXH_PRIME32_1 + XXH_PRIME32_2;
+  state.v[1] = seed + XXH_PRIME32_2;
+  state.v[2] = seed;
+  state.v[3] = seed - XXH_PRIME32_1;
+}
+
+void xxh32_update(xxh32_state& state, const void* data, size_t size) {
+  const uint8_t* p = (const uint8_t*)data;
+  const uint8_t* const end = p + size;
+  state.total_len += size;
+
+  if (state.memsize + size < 16) {
+    // not enough for a stripe, keep for later
+    memcpy((uint8_t*)state.mem + state.memsize, p, size);
+    state.memsize += size;
+    return;
+  }
+  if (state.memsize) {
+    // complete the pending stripe
+    memcpy((uint8_t*)state.mem + state.memsize, p, 16 - state.memsize);
+    p += 16 - state.memsize;
+    for (int i = 0; i < 4; i++) state.v[i] = xxh_round(state.v[i], state.mem[i]);
+    state.memsize = 0;
+  }
+  uint32_t v1 = state.v[0], v2 = state.v[1], v3 = state.v[2], v4 = state.v[3];
+  for (; p + 16 <= end; p += 16) {
+    v1 = xxh_round(v1, xxh_read32(p));
+    v2 = xxh_round(v2, xxh_read32(p + 4));
+    v3 = xxh_round(v3, xxh_read32(p + 8));
+    v4 = xxh_round(v4, xxh_read32(p + 12));
+  }
+  state.v[0] = v1; state.v[1] = v2; state.v[2] = v3; state.v[3] = v4;
+  if (p < end) {
+    memcpy(state.mem, p, end - p);
+    state.memsize = end - p;
+  }
+}
+
+uint32_t xxh32_digest(const xxh32_state& state) {
+  uint32_t h;
+  if (state.total_len >= 16) {
+    h = xxh_rotl(state.v[0], 1) + xxh_rotl(state.v[1], 7) +
+        xxh_rotl(state.v[2], 12) + xxh_rotl(state.v[3], 18);
+  } else {
+    h = state.seed + XXH_PRIME32_5;
+  }
+  h += (uint32_t)state.total_len;
+
+  const uint8_t* p = (const uint8_t*)state.mem;
+  const uint8_t* const end = p + state.memsize;
+  for (; p + 4 <= end; p += 4) {
+    h += xxh_read32(p) * XXH_PRIME32_3;
+    h = xxh_rotl(h, 17) * XXH_PRIME32_4;
+  }
+  for (; p < end; p++) {
+    h += (*p) * XXH_PRIME32_5;
+    h = xxh_rotl(h, 11) * XXH_PRIME32_1;
+  }
+  h ^= h >> 15;
+  h *= XXH_PRIME32_2;
+  h ^= h >> 13;
+  h *= XXH_PRIME32_3;
+  h ^= h >> 16;
+  return h;
+}
+
+uint32_t xxh32(const void* data, size_t size, uint32_t seed) {
+  xxh32_state state;
+  xxh32_reset(state, seed);
+  xxh32_update(state, data, size);
+  return xxh32_digest(state);
+}
+
+//------------------Implementation of latency_histogram----------------------//
+
+// values below sub_buckets have a bucket each, then every power of two
+// is split into sub_buckets linear ones
+void latency_histogram::record(uint64_t ns) {
+  unsigned index = ns;
+  if (ns >= sub_buckets) {
+    const unsigned exponent = 63 - __builtin_clzll(ns);  // >= 4
+    index = (exponent - 3) * sub_buckets + ((ns >> (exponent - 4)) & (sub_buckets - 1));
+  }
+  ++m_counts[index];
+  ++m_count;
+  m_max = std::max(m_max, ns);
+}
+
+void latency_histogram::reset() {
+  memset(m_counts, 0, sizeof(m_counts));
+  m_count = m_max = 0;
+}
+
+uint64_t latency_histogram::percentile(double p) const {
+  if (!m_count) return 0;
+  const uint64_t rank = std::max<uint64_t>(1, (uint64_t)(p / 100 * m_count + 0.5));
+  uint64_t seen = 0;
+  for (unsigned index = 0; index < 64 * sub_buckets; ++index) {
+    seen += m_counts[index];
+    if (seen < rank) continue;
+    if (index < sub_buckets) return index;
+    const unsigned exponent = index / sub_buckets + 3;
+    const uint64_t lower = (uint64_t)(sub_buckets + index % sub_buckets) << (exponent - 4);
+    return std::min(m_max, lower + ((uint64_t)1 << (exponent - 4)) - 1);
+  }
+  return m_max;
+}
+
+size_t decompress_in_place(char* buffer, size_t buffer_size, size_t compressed_size,
+                           size_t max_decoded_size) {
+  if (compressed_size > buffer_size ||
+      buffer_size < in_place_buffer_size(max_decoded_size, compressed_size))
+    throw std::runtime_error("lz4: buffer too small to decode in place");
+  const int raw_size = LZ4_decompress_safe(buffer + buffer_size - compressed_size, buffer,
+                                           (int)compressed_size, (int)max_decoded_size);
+  if (raw_size < 0) throw std::runtime_error("lz4: decoded_size <= 0");
+  return raw_size;
+}
+
+}  // namespace lz4
+
 //------------------Implementation of lz4_base-------------------------------//
 
 namespace detail {
 
-lz4_base::lz4_base() : m_was_header(false), m_fail(false), m_bytes_needed(0) {}
+lz4_base::lz4_base(const lz4_params& params, std::size_t memory_budget)
+    : m_params(params), m_was_header(false), m_fail(false), m_bytes_needed(0),
+      m_content_size(-1), m_total(0), m_latency(0), m_in_place(false),
+      m_staging_in_place(false), m_stage_pos(0), m_memory_budget(memory_budget),
+      m_out_limit(MAX_OUT_BUF), m_memory_peak(0),
+      m_direct_min(lz4::direct_min_size), m_direct_missed(false),
+      m_last_in(0), m_last_out(0), m_linked(false), m_in_offset(0), m_decoded_base(0),
+      m_pool(0), m_auto_trim(false), m_trimmed(false), m_in_capacity(0), m_out_capacity(0),
+      m_chunk_min(0), m_chunk_avg(0), m_chunk_max(0), m_chunk_mask_small(0),
+      m_chunk_mask_large(0), m_chunk_hash(0), m_chunk_size(0), m_chunk_done(false) {}
 
 lz4_base::~lz4_base() {
 #ifdef LZ4_FILTER_DEBUG
@@ -50,53 +257,226 @@ lz4_base::~lz4_base() {
 #endif
 }
 
-void lz4_base::init(bool /*compress*/) {
+void lz4_base::init(bool compress) {
+  m_blocks.clear();  // blocks still queued own their buffers
   m_in_buf.clear();
   m_out_buf.clear();
+  m_staging_in_place = false;
   m_was_header = false;
   m_fail = false;
   m_bytes_needed = 0;
+  m_frame_end = false;
+  m_total = 0;
+  m_sync_flush = false;
+  m_direct_missed = false;
+  m_last_in = m_last_out = 0;
+  m_linked = false;
+  m_dict.clear();
+  m_in_offset = m_decoded_base = 0;
+  m_header.clear();
+  m_staged_states.clear();
+  m_chunk_max = 0;
+  m_chunk_hash = 0;
+  m_chunk_size = 0;
+  m_chunk_done = false;
+  lz4::xxh32_reset(m_content_xxh);
+  if (compress) {
+    m_lz4s = m_params.format == lz4::frame;
+    m_linked = m_lz4s && m_params.linked_blocks;
+    m_content_size = m_params.content_size;
+    if (m_lz4s && (m_params.block_size_id < 4 || m_params.block_size_id > 7))
+      FAIL("lz4: block_size_id must be 4..7");
+    if (!m_lz4s && m_content_size >= 0)
+      FAIL("lz4: content size needs the LZ4S format");
+    if (!m_lz4s && m_params.linked_blocks)
+      FAIL("lz4: linked blocks need the LZ4S format");
+    if (m_params.max_buffered > (std::streamsize)lz4::legacy_blocksize)
+      FAIL("lz4: max_buffered must not exceed legacy_blocksize");
+    m_block_uncompressed_max = m_lz4s ? lz4::lz4s_blocksize(m_params.block_size_id)
+                                      : lz4::legacy_blocksize;
+    if (m_params.chunk_avg_size) {
+      if (streaming()) FAIL("lz4: content-defined blocks do not go with streaming mode");
+      if (m_params.chunk_avg_size < 64) FAIL("lz4: chunk_avg_size must be at least 64");
+      unsigned bits = 0;
+      while ((std::size_t)2 << bits <= m_params.chunk_avg_size) ++bits;
+      m_chunk_avg = (std::size_t)1 << bits;
+      m_chunk_min = m_params.chunk_min_size ? m_params.chunk_min_size : m_chunk_avg / 4;
+      m_chunk_max = m_params.chunk_max_size
+                        ? m_params.chunk_max_size
+                        : std::min<std::size_t>(4 * m_chunk_avg, m_block_uncompressed_max);
+      if (m_chunk_min > m_chunk_avg || m_chunk_avg > m_chunk_max ||
+          m_chunk_max > m_block_uncompressed_max)
+        FAIL("lz4: chunk sizes must be min <= avg <= max <= the block size");
+      // the top bits of the hash depend on the most input bytes
+      m_chunk_mask_small = ~(uint64_t)0 << (64 - (bits + 2));
+      m_chunk_mask_large = ~(uint64_t)0 << (64 - (bits - 2));
+    }
+  } else {
+    m_content_size = -1;
+  }
 }
 
 void lz4_base::reset(bool compress, bool /*realloc*/) { init(compress); }
 
-bool lz4_base::compress_filter(const char*& src_begin, const char* src_end,
-                               char*& dst_begin, char* dst_end,
+// probes and latency around each block, the clock is read only when
+// a histogram is attached
+std::chrono::steady_clock::time_point lz4_base::block_start(int path, std::size_t size) {
+  LZ4_PROBE(block_start, this, path, size);
+  return m_latency ? std::chrono::steady_clock::now()
+                   : std::chrono::steady_clock::time_point();
+}
+
+void lz4_base::block_done(std::chrono::steady_clock::time_point start, int path,
+                          std::size_t in_size, std::size_t out_size) {
+  LZ4_PROBE(block_end, this, path, in_size, out_size);
+  if (m_latency)
+    m_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                          std::chrono::steady_clock::now() - start).count());
+}
+
+// the last lz4::dict_size bytes of the data so far, size more bytes of
+// it given; m_dict never grows past that
+void lz4_base::keep_dict(const char* data, std::size_t size) {
+  m_dict.reserve(lz4::dict_size);
+  if (size >= lz4::dict_size) {
+    m_dict.assign(data + size - lz4::dict_size, data + size);
+    return;
+  }
+  if (m_dict.size() + size > lz4::dict_size)
+    m_dict.erase(m_dict.begin(), m_dict.begin() + (m_dict.size() + size - lz4::dict_size));
+  m_dict.insert(m_dict.end(), data, data + size);
+}
+
+bool lz4_base::compress_filter_header(char*& dst_begin, char* dst_end) {
+  const int header_max = m_lz4s ? lz4::lz4s_max_header_size : sizeof(lz4::legacy_magic);
+  if ((dst_end - dst_begin) < header_max)
+    FAIL(m_lz4s ? "no space to write lz4s header!" : "no space to write lz4 header!");
+  dst_begin += lz4::encode_header(m_params, dst_begin);
 #ifdef LZ4_FILTER_DEBUG
-                               bool flush
-#else
-                               bool  // suppress 'unused parameter' warning
+  if (!m_lz4s) printf("[d] hdr written, sizeof(hdr) = %ld\n", sizeof(lz4::legacy_magic));
 #endif
-                               ) {
-#ifdef LZ4_FILTER_DEBUG
-  printf(
-      "\n%s[d] lz4::comp_filter: src_size = %7ld, dst_size = %7ld, flush = %d, "
-      "data = %02x %02x %02x%s\n",
-      COLOR_MAGENTA, src_end - src_begin, dst_end - dst_begin, flush,
-      src_begin[0] & 0xff, src_begin[1] & 0xff, src_begin[2] & 0xff,
-      COLOR_RESET);
-#endif
-  if (!m_was_header) {
-    m_was_header = true;
-    if ((dst_end - dst_begin) < (int)sizeof(lz4::legacy_magic))
-      FAIL("no space to write lz4 header!");
-    memcpy(dst_begin, &lz4::legacy_magic, sizeof(lz4::legacy_magic));
-    dst_begin += sizeof(lz4::legacy_magic);
-#ifdef LZ4_FILTER_DEBUG
-    printf("[d] hdr written, sizeof(hdr) = %ld\n", sizeof(lz4::legacy_magic));
+  LZ4_PROBE(header, this, m_lz4s, m_content_size);
+  return true;
+}
+
+//------------------Zero blocks---------------------------------------------//
+
+// 64 bytes per round ORed together, which compilers turn into vector code
+static bool all_zero(const char* p, size_t size) {
+  const char* const end = p + size;
+  for (; end - p >= 64; p += 64) {
+    uint64_t w[8];
+    memcpy(w, p, sizeof(w));
+    if (w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) return false;
+  }
+  for (; p != end; ++p)
+    if (*p) return false;
+  return true;
+}
+
+// shortest zero blocks written in the canonical form below
+static const int zero_block_min = 32;
+
+// canonical encoding of size zero bytes: a zero literal, one match at
+// offset 1 up to the 5 last bytes, then those 5 as literals. Written
+// without running LZ4 over the data; about size / 255 bytes.
+static int encode_zero_block(int size, char* dst) {
+  char* p = dst;
+  int match_ext = size - 1 - 5 - 4 - 15;  // match length beyond the token
+  *p++ = (char)(0x1F);
+  *p++ = 0;
+  *p++ = 1;  // offset, little endian
+  *p++ = 0;
+  for (; match_ext >= 255; match_ext -= 255) *p++ = (char)255;
+  *p++ = (char)match_ext;
+  *p++ = (char)0x50;
+  memset(p, 0, 5);
+  return p + 5 - dst;
+}
+
+// decoded size of a block in the canonical zero form, -1 for other blocks
+static int zero_block_size(const char* src, int size) {
+  const uint8_t* p = (const uint8_t*)src;
+  const uint8_t* const end = p + size;
+  if (size < 4 + 1 + 6 || p[0] != 0x1F || p[1] != 0 || p[2] != 1 || p[3] != 0) return -1;
+  long match = 4 + 15;
+  for (p += 4; p < end - 6 && *p == 255; ++p) match += 255;
+  if (end - p != 7) return -1;
+  match += *p++;
+  if (p[0] != 0x50 || p[1] | p[2] | p[3] | p[4] | p[5]) return -1;
+  return 1 + match + 5 > 0x7FFFFFFF ? -1 : (int)(1 + match + 5);
+}
+
+// the stream linked blocks are compressed with, one per thread (callers
+// and executor workers): 16 KB, too much for each block to put on the stack
+static LZ4_stream_t* dict_stream() {
+  static thread_local std::unique_ptr<LZ4_stream_t, int (*)(LZ4_stream_t*)> stream(
+      LZ4_createStream(), LZ4_freeStream);
+  if (!stream) throw std::bad_alloc();
+  return stream.get();
+}
+
+// one block (no size field) of src_size bytes to dst, 0 if it does not fit;
+// matches may reach into the dict_size bytes of dict, the data before src
+// in a frame of linked blocks
+static int compress_block(const char* src, int src_size, char* dst, int dst_capacity,
+                          const char* dict = 0, int dict_size = 0) {
+  if (src_size >= zero_block_min && all_zero(src, src_size) &&
+      dst_capacity >= 4 + 1 + src_size / 255 + 1 + 6)
+    return encode_zero_block(src_size, dst);
+  if (!dict_size) return LZ4_compress_default(src, dst, src_size, dst_capacity);
+  LZ4_stream_t* stream = dict_stream();
+  // before 1.9, LZ4_loadDict reads the stream state it then resets
+#if LZ4_VERSION_NUMBER >= 10900
+  LZ4_initStream(stream, sizeof(*stream));
+#else
+  LZ4_resetStream(stream);
 #endif
+  LZ4_loadDict(stream, dict, dict_size);
+  return LZ4_compress_fast_continue(stream, src, dst, src_size, dst_capacity, 1);
+}
+
+// one LZ4S block per round, as long as the worst case fits into dst
+bool lz4_base::compress_filter_lz4s(const char*& src_begin, const char* src_end,
+                                    char*& dst_begin, char* dst_end) {
+  const int checksum_size = m_params.block_checksum ? 4 : 0;
+  while (src_begin != src_end) {
+    int src_size = std::min<std::ptrdiff_t>(src_end - src_begin, m_block_uncompressed_max);
+    if (dst_end - dst_begin < 4 + LZ4_COMPRESSBOUND(src_size) + checksum_size) {
+      // let boost flush dst first
+      return false;
+    }
+    const std::chrono::steady_clock::time_point start = block_start(path_compress, src_size);
+    const int size = lz4::encode_block(m_params, src_begin, src_size, dst_begin,
+                                       m_dict.data(), m_dict.size());
+    if (m_linked) keep_dict(src_begin, src_size);
+    if (m_params.content_checksum)
+      lz4::xxh32_update(m_content_xxh, src_begin, src_size);
+    block_done(start, path_compress, src_size, size);
+    dst_begin += size;
+    src_begin += src_size;
+    m_total += src_size;
   }
+  return true;
+}
+
+// the whole input as one legacy block
+bool lz4_base::compress_filter_legacy(const char*& src_begin, const char* src_end,
+                                      char*& dst_begin, char* dst_end) {
   if (src_begin == src_end) {
     // nothing to compress => EOF
-    return false;
+    return true;
   }
   if (dst_end - dst_begin < 4) FAIL("it does not fit! (1)");
-  int32_t comp_size = LZ4_compress_limitedOutput(
-      src_begin, dst_begin + 4, src_end - src_begin, dst_end - dst_begin - 4);
+  const std::chrono::steady_clock::time_point start =
+      block_start(path_compress, src_end - src_begin);
+  int32_t comp_size = compress_block(
+      src_begin, src_end - src_begin, dst_begin + 4, dst_end - dst_begin - 4);
 #ifdef LZ4_FILTER_DEBUG
   printf("[d] comp_size => %7d\n", comp_size);
 #endif
   if (comp_size > 0) {
+    block_done(start, path_compress, src_end - src_begin, comp_size + 4);
     *(int32_t*)dst_begin = comp_size;  // write compressed chunk size
     dst_begin +=
         comp_size + 4;    // set number of significant bytes in output buffer
@@ -104,6 +484,318 @@ bool lz4_base::compress_filter(const char*& src_begin, const char* src_end,
   } else {
     FAIL("it does not fit! (2)");
   }
+  return true;
+}
+
+// LZ4S end mark and content checksum, false if dst has no room for them
+bool lz4_base::compress_filter_end(char*& dst_begin, char* dst_end) {
+  if (!m_lz4s || m_frame_end) return true;
+  if (dst_end - dst_begin < 8) return false;
+  if (m_content_size >= 0 && (uint64_t)m_content_size != m_total)
+    FAIL("lz4: content size mismatch");
+  memset(dst_begin, 0, 4);
+  dst_begin += 4;
+  if (m_params.content_checksum) {
+    uint32_t checksum = lz4::xxh32_digest(m_content_xxh);
+    memcpy(dst_begin, &checksum, 4);
+    dst_begin += 4;
+  }
+  m_frame_end = true;
+  return true;
+}
+
+// compress everything buffered in m_in_buf,
+// false if dst has no room for the worst case
+bool lz4_base::compress_buffered(char*& dst_begin, char* dst_end) {
+  if (m_in_buf.empty()) return true;
+  if (dst_end - dst_begin < 4 + LZ4_COMPRESSBOUND((std::ptrdiff_t)m_in_buf.size()) + 4) return false;
+  const char* begin = m_in_buf.data();
+  if (m_lz4s)
+    compress_filter_lz4s(begin, begin + m_in_buf.size(), dst_begin, dst_end);
+  else
+    compress_filter_legacy(begin, begin + m_in_buf.size(), dst_begin, dst_end);
+  m_in_buf.clear();
+  return true;
+}
+
+// streaming mode: buffer input in m_in_buf, emit it when a limit is hit
+bool lz4_base::compress_filter_stream(const char*& src_begin, const char* src_end,
+                                      char*& dst_begin, char* dst_end, bool flush) {
+  const size_t max_buffered = m_params.max_buffered;
+  const std::chrono::milliseconds max_age(m_params.max_age_ms);
+  for (;;) {
+    if (!m_in_buf.empty() &&
+        (m_in_buf.size() >= max_buffered || flush ||
+         (max_age.count() &&
+          std::chrono::steady_clock::now() - m_buffered_since >= max_age))) {
+      if (!compress_buffered(dst_begin, dst_end))
+        return flush;  // no room => let boost flush dst and call again
+    }
+    if (src_begin == src_end) break;
+    size_t amt = std::min<size_t>(src_end - src_begin, max_buffered - m_in_buf.size());
+    if (m_in_buf.empty()) m_buffered_since = std::chrono::steady_clock::now();
+    LZ4_PROBE(stage, this, amt, max_buffered - m_in_buf.size());
+    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+    src_begin += amt;
+  }
+  if (flush && !compress_filter_end(dst_begin, dst_end)) return true;
+  return false;
+}
+
+//------------------Content-defined blocks-----------------------------------//
+
+// random values of the bytes for the Gear hash, from splitmix64.
+// Do not change this: blocks of the same data would end elsewhere.
+static const uint64_t* gear_table() {
+  static uint64_t table[256];
+  static bool init = [] {
+    uint64_t x = 0x4c5a3446;
+    for (int i = 0; i < 256; ++i) {
+      uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+      z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+      z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+      table[i] = z ^ (z >> 31);
+    }
+    return true;
+  }();
+  (void)init;
+  return table;
+}
+
+// Gear hash (FastCDC): each byte shifts the hash left by one and adds the
+// value of the byte, so the hash is that of the last 64 bytes alone. A
+// chunk ends where the hash has zeros under the mask, which has more bits
+// before the average size than after it to keep sizes near the average,
+// or at the largest size. Bytes more than 64 before the smallest size are
+// not hashed. True with amt bytes of src ending the chunk, otherwise all
+// of src belongs to it.
+bool lz4_base::chunk_boundary(const char* src, std::size_t size, std::size_t& amt) {
+  const uint64_t* const gear = gear_table();
+  const uint8_t* const p = (const uint8_t*)src;
+  const std::size_t base = m_chunk_size;  // chunk bytes before src
+  uint64_t h = m_chunk_hash;
+  std::size_t i = 0;
+  if (base + 64 < m_chunk_min) i = std::min(size, m_chunk_min - 64 - base);
+  std::size_t end = std::min(size, m_chunk_min > base ? m_chunk_min - base : 0);
+  for (; i < end; ++i) h = (h << 1) + gear[p[i]];
+  bool found = false;
+  end = std::min(size, m_chunk_avg > base ? m_chunk_avg - base : 0);
+  for (; i < end && !found; ++i) {
+    h = (h << 1) + gear[p[i]];
+    found = !(h & m_chunk_mask_small);
+  }
+  end = std::min(size, m_chunk_max - base);
+  for (; i < end && !found; ++i) {
+    h = (h << 1) + gear[p[i]];
+    found = !(h & m_chunk_mask_large);
+  }
+  if (found || base + i == m_chunk_max) {
+    amt = i;
+    m_chunk_hash = 0;
+    m_chunk_size = 0;
+    return true;
+  }
+  amt = size;
+  m_chunk_hash = h;
+  m_chunk_size = base + size;
+  return false;
+}
+
+// one block per chunk: straight from src when it holds a whole chunk and
+// dst has room, otherwise gathered in m_in_buf
+bool lz4_base::compress_filter_chunked(const char*& src_begin, const char* src_end,
+                                       char*& dst_begin, char* dst_end, bool flush) {
+  for (;;) {
+    if (m_chunk_done) {
+      if (!compress_buffered(dst_begin, dst_end)) return flush;  // let boost flush dst
+      m_chunk_done = false;
+    }
+    if (src_begin == src_end) break;
+    std::size_t amt;
+    const bool found = chunk_boundary(src_begin, src_end - src_begin, amt);
+    if (found && m_in_buf.empty() &&
+        dst_end - dst_begin >= 4 + LZ4_COMPRESSBOUND((std::ptrdiff_t)amt) + 4) {
+      const char* const chunk_end = src_begin + amt;
+      if (m_lz4s)
+        compress_filter_lz4s(src_begin, chunk_end, dst_begin, dst_end);
+      else
+        compress_filter_legacy(src_begin, chunk_end, dst_begin, dst_end);
+      continue;
+    }
+    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+    src_begin += amt;
+    m_chunk_done = found;
+  }
+  if (!flush) return false;
+  // the last chunk is cut by the end of input
+  if (!compress_buffered(dst_begin, dst_end)) return true;
+  return !compress_filter_end(dst_begin, dst_end);
+}
+
+// stream flush point in streaming mode
+bool lz4_base::compress_sync(char*& dst_begin, char* dst_end) {
+  if (!m_was_header) {
+    m_was_header = compress_filter_header(dst_begin, dst_end);
+  }
+  if (m_in_buf.empty()) {
+    m_sync_flush = false;
+    return false;
+  }
+  if (!m_sync_flush && (std::streamsize)m_in_buf.size() < m_params.min_block_size &&
+      !(m_params.max_age_ms &&
+        std::chrono::steady_clock::now() - m_buffered_since >=
+            std::chrono::milliseconds(m_params.max_age_ms))) {
+    // too small to make a good block, and not too old yet
+    return false;
+  }
+  if (!compress_buffered(dst_begin, dst_end)) return true;
+  m_sync_flush = false;
+  return false;
+}
+
+// a block compressed by an executor thread
+struct lz4_base::parallel_block {
+  lz4_buffer_pool::buffer in;
+  std::vector<char> out;
+  std::vector<char> dict;  // linked blocks: the input before in
+  size_t emitted;         // bytes of out already given to dst
+  std::chrono::steady_clock::duration elapsed;
+  std::exception_ptr error;
+  std::mutex mutex;
+  std::condition_variable cv;
+  bool done;
+  parallel_block() : emitted(0), done(false) {}
+};
+
+// hand the staged input to the executor; linked blocks take the end of
+// the input before them along, so they do not wait for the block before
+void lz4_base::submit_block() {
+  std::shared_ptr<parallel_block> block = std::make_shared<parallel_block>();
+  block->in.swap(m_in_buf);
+  if (m_linked) {
+    block->dict = m_dict;
+    keep_dict(block->in.data(), block->in.size());
+  }
+  m_blocks.push_back(block);
+  const lz4_params params = m_params;
+  const void* stream = this;
+  m_stream->submit([block, params, stream]() {
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const int src_size = block->in.size();
+    LZ4_PROBE(block_start, stream, path_compress, src_size);
+    try {
+      block->out.resize(lz4::encoded_block_bound(src_size));
+      const int size = lz4::encode_block(params, block->in.data(), src_size, block->out.data(),
+                                         block->dict.data(), block->dict.size());
+      block->out.resize(size);
+      LZ4_PROBE(block_end, stream, path_compress, src_size, size);
+    } catch (...) {
+      block->error = std::current_exception();
+    }
+    lz4_buffer_pool::buffer().swap(block->in);
+    std::vector<char>().swap(block->dict);
+    std::lock_guard<std::mutex> lock(block->mutex);
+    block->elapsed = std::chrono::steady_clock::now() - start;
+    block->done = true;
+    block->cv.notify_all();
+  });
+  m_in_buf.reserve(m_block_uncompressed_max);
+}
+
+// copy compressed blocks to dst in input order, as long as they are done
+// and dst has room; wait: wait for the oldest one to be done.
+// false if dst is full
+bool lz4_base::emit_blocks(char*& dst_begin, char* dst_end, bool wait) {
+  for (; !m_blocks.empty(); wait = false) {
+    parallel_block& block = *m_blocks.front();
+    {
+      std::unique_lock<std::mutex> lock(block.mutex);
+      if (!block.done && !wait) return true;
+      block.cv.wait(lock, [&block] { return block.done; });
+    }
+    if (block.error) {
+      m_fail = true;
+      std::rethrow_exception(block.error);
+    }
+    if (block.emitted == 0 && m_latency)
+      m_latency->record(std::chrono::duration_cast<std::chrono::nanoseconds>(block.elapsed).count());
+    size_t amt = std::min<size_t>(block.out.size() - block.emitted, dst_end - dst_begin);
+    memcpy(dst_begin, block.out.data() + block.emitted, amt);
+    dst_begin += amt;
+    block.emitted += amt;
+    if (block.emitted != block.out.size()) return false;
+    m_blocks.pop_front();
+  }
+  return true;
+}
+
+// blocks go to the executor as soon as they are full, at most
+// max_in_flight of them at a time
+bool lz4_base::compress_filter_parallel(const char*& src_begin, const char* src_end,
+                                        char*& dst_begin, char* dst_end, bool flush) {
+  if (!m_stream)
+    m_stream = std::make_shared<lz4::executor::stream>(*m_params.executor,
+                                                       std::max(1u, m_params.max_in_flight));
+  for (;;) {
+    if (!emit_blocks(dst_begin, dst_end, false)) return flush;  // let boost flush dst
+    if (src_begin != src_end && !m_chunk_done) {
+      size_t amt = std::min<size_t>(src_end - src_begin, m_block_uncompressed_max - m_in_buf.size());
+      if (m_chunk_max) m_chunk_done = chunk_boundary(src_begin, src_end - src_begin, amt);
+      if (m_lz4s && m_params.content_checksum)
+        lz4::xxh32_update(m_content_xxh, src_begin, amt);
+      m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+      src_begin += amt;
+      m_total += amt;
+    }
+    if (m_in_buf.size() == m_block_uncompressed_max || m_chunk_done ||
+        (flush && src_begin == src_end && !m_in_buf.empty())) {
+      if (m_blocks.size() >= std::max(1u, m_params.max_in_flight)) {
+        // backpressure: the oldest block has to be written out first
+        if (!emit_blocks(dst_begin, dst_end, true)) return flush;
+        continue;
+      }
+      submit_block();
+      m_chunk_done = false;
+      continue;
+    }
+    if (src_begin == src_end) break;
+  }
+  if (!flush) return false;
+  while (!m_blocks.empty())
+    if (!emit_blocks(dst_begin, dst_end, true)) return true;
+  return !compress_filter_end(dst_begin, dst_end);
+}
+
+bool lz4_base::compress_filter(const char*& src_begin, const char* src_end,
+                               char*& dst_begin, char* dst_end, bool flush) {
+#ifdef LZ4_FILTER_DEBUG
+  printf(
+      "\n%s[d] lz4::comp_filter: src_size = %7ld, dst_size = %7ld, flush = %d, "
+      "data = %02x %02x %02x%s\n",
+      COLOR_MAGENTA, src_end - src_begin, dst_end - dst_begin, flush,
+      src_begin[0] & 0xff, src_begin[1] & 0xff, src_begin[2] & 0xff,
+      COLOR_RESET);
+#endif
+  if (!m_was_header) {
+    m_was_header = compress_filter_header(dst_begin, dst_end);
+  }
+  if (streaming()) {
+    return compress_filter_stream(src_begin, src_end, dst_begin, dst_end, flush);
+  }
+  if (m_params.executor) {
+    return compress_filter_parallel(src_begin, src_end, dst_begin, dst_end, flush);
+  }
+  if (m_chunk_max) {
+    return compress_filter_chunked(src_begin, src_end, dst_begin, dst_end, flush);
+  }
+  if (m_lz4s) {
+    if (!compress_filter_lz4s(src_begin, src_end, dst_begin, dst_end))
+      return false;
+    if (flush && !compress_filter_end(dst_begin, dst_end))
+      return true;  // call again after flush
+    return false;
+  }
+  compress_filter_legacy(src_begin, src_end, dst_begin, dst_end);
   // returning FALSE will instruct boost to FLUSH dest buffer to next stream in
   // filter chain
   // thus clearing dest buffer
@@ -116,30 +808,36 @@ bool lz4_base::decompress_filter_input_legacy(const char*& src_begin, const char
     unsigned int src_size = src_end - src_begin;
     assert(src_size >= m_bytes_needed);
 
-    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + m_bytes_needed);
+    stage_input(src_begin, m_bytes_needed);
     src_begin += m_bytes_needed;  // consume part of input
 
 
     if (m_waitblockstart) 
     {
       // just readed the block size
-      m_waitblockstart = false;
       m_bytes_needed = *(int32_t*)&m_in_buf[0];
+      if (m_bytes_needed == lz4::legacy_magic) {
+        // concatenated legacy streams, as lz4c reads them
+        m_in_buf.clear();
+        m_in_offset += 4;
+        m_bytes_needed = 4;
+        return true;
+      }
+      m_waitblockstart = false;
+      m_direct_missed = false;
       if (m_bytes_needed == 0 ||
           m_bytes_needed > LZ4_COMPRESSBOUND(lz4::legacy_blocksize))
         FAIL("invalid lz4 block size!");
 
       if ((src_end - src_begin) >= m_bytes_needed &&
-          (dst_end - dst_begin) >= lz4::legacy_blocksize &&
-          m_out_buf.empty()) {
+          m_out_buf.empty() &&
+          decode_direct<lz4::skip_checksums>(src_begin, m_bytes_needed, dst_begin, dst_end, path_direct)) {
         #ifdef LZ4_FILTER_DEBUG
                     printf("[*] ultra fast path!\n");
         #endif
-        // ULTRA-FAST PATH: decompress from src to dst
-        uint32_t block_size = m_bytes_needed;
-        int raw_size = lz4_decompress(src_begin, dst_begin, block_size);
-        dst_begin += raw_size;
-        src_begin += block_size;
+        // ULTRA-FAST PATH: decompressed from src to dst
+        src_begin += m_bytes_needed;
+        m_in_offset += 4 + m_bytes_needed;
         m_in_buf.clear();
         m_bytes_needed = 4;  // ready to read next block size
         m_waitblockstart = true;
@@ -149,45 +847,90 @@ bool lz4_base::decompress_filter_input_legacy(const char*& src_begin, const char
         // next iteration
         return true;
       }
+      if (m_in_place)
+        stage_in_place(m_bytes_needed);
     } 
     else 
     {
       // now have the whole block
       // m_in_buf now contains 4 bytes of block size,
       // followed by block compressed data of that size
+      // (or m_out_buf ends with it, when read in place)
       uint32_t block_size = *(uint32_t*)&m_in_buf[0];
-      if (block_size != m_in_buf.size() - 4)
+      const bool in_place = m_staging_in_place;
+      if (in_place ? m_stage_pos != m_out_buf.size() : block_size != m_in_buf.size() - 4)
         FAIL("block_size != m_in_buf.size() - 4");
+      const char* block = in_place ? &m_out_buf[m_out_buf.size() - block_size] : &m_in_buf[4];
+      m_staging_in_place = false;
 
-      if (m_out_buf.empty() &&
-          (dst_end - dst_begin) >= lz4::legacy_blocksize) {
+      if ((in_place || m_out_buf.empty()) &&
+          decode_direct<lz4::skip_checksums>(block, block_size, dst_begin, dst_end, path_gathered)) {
         #ifdef LZ4_FILTER_DEBUG
                     printf("[*] fast path!\n");
         #endif
-        // FAST-PATH: decompress directly to dst
-        int raw_size = lz4_decompress(&m_in_buf[4], dst_begin, block_size);
-        dst_begin += raw_size;
+        // FAST-PATH: decompressed directly to dst
+        m_out_buf.clear();
+      } else if (in_place) {
+        // decompress the end of m_out_buf to its start
+        stage_state(true);
+        const std::chrono::steady_clock::time_point start = block_start(path_staged, block_size);
+        int raw_size = lz4_decompress(block, &m_out_buf[0], block_size);
+        block_done(start, path_staged, block_size, raw_size);
+        m_out_buf.resize(raw_size);
       } else {
         // decompress m_in_buf and APPEND decompressed data to m_out_buf
-        std::vector<char>::size_type prev_size = m_out_buf.size();
+        std::size_t prev_size = m_out_buf.size();
+        stage_state(prev_size == 0);
         m_out_buf.resize(prev_size +
                          lz4::legacy_blocksize);  // pessimistic resize
+        track_memory();
+        const std::chrono::steady_clock::time_point start = block_start(path_staged, block_size);
         int raw_size =
             lz4_decompress(&m_in_buf[4], &m_out_buf[prev_size], block_size);
+        block_done(start, path_staged, block_size, raw_size);
         m_out_buf.resize(prev_size +
                          raw_size);  // resize to actual data written
       }
 
+      m_in_offset += 4 + block_size;
       m_in_buf.clear();
       m_waitblockstart = true;
       m_bytes_needed = 4;  // ready to read next block size
     }
     return true;
 }
+// block bytes (or block size) taken from the input
+void lz4_base::stage_input(const char* src, uint32_t size)
+{
+    if (m_staging_in_place)
+    {
+        memcpy(&m_out_buf[m_stage_pos], src, size);
+        m_stage_pos += size;
+    }
+    else
+    {
+        m_in_buf.insert(m_in_buf.end(), src, src + size);
+    }
+    track_memory();
+}
+
+// the next size bytes of block, then checksum_size bytes, go to the end
+// of m_out_buf, which is empty: the block is decoded from there to its
+// start. The block alone ends where the in-place margin asks for, the
+// checksum (verified before decoding) lies past it.
+void lz4_base::stage_in_place(uint32_t size, uint32_t checksum_size)
+{
+    assert(m_out_buf.empty());
+    m_out_buf.resize(lz4::in_place_buffer_size(m_block_uncompressed_max, size) + checksum_size);
+    m_stage_pos = m_out_buf.size() - size - checksum_size;
+    m_staging_in_place = true;
+    track_memory();
+}
+
 bool lz4_base::decompress_filter_output(char*& dst_begin, char* dst_end)
 {
     int dst_size = dst_end - dst_begin;
-    if (!dst_size || m_out_buf.empty())
+    if (!dst_size || m_out_buf.empty() || m_staging_in_place)
     {
         return false; // nothing done
     }
@@ -212,6 +955,17 @@ bool lz4_base::decompress_filter_output(char*& dst_begin, char* dst_end)
     return true;
 }
 
+// size of the stream header, as far as it can be told from its first bytes
+template <typename Buffer>
+static size_t lz4_header_size(const Buffer& hdr) {
+  if (hdr.size() < sizeof(lz4::legacy_magic)) return sizeof(lz4::legacy_magic);
+  if (*(uint32_t*)&hdr[0] != lz4::lz4s_magic) return sizeof(lz4::legacy_magic);
+  if (hdr.size() < sizeof(lz4::lz4s_magic) + 1) return sizeof(lz4::lz4s_magic) + 1;
+  const uint8_t flg = hdr[sizeof(lz4::lz4s_magic)];
+  return sizeof(lz4::lz4s_file_header) + ((flg & (1 << 3)) ? 8 : 0) +
+         ((flg & (1 << 0)) ? 4 : 0);
+}
+
 bool lz4_base::decompress_filter_header(const char*& src_begin, const char* src_end, bool flush)
 {
     if (src_end == src_begin && flush && m_in_buf.empty()) {
@@ -219,20 +973,28 @@ bool lz4_base::decompress_filter_header(const char*& src_begin, const char* src_
       // absolutely nothing)
       return false;
     }
-    if ((src_end - src_begin) < (int)sizeof(lz4::legacy_magic)) {
-      // only will happen when total input data is less than 4 bytes
-      // because if it is greater than 4 bytes => boost should try to feed us
-      // with blocks of 8 MB each
-      FAIL("lz4: too small header!");
+    // header may come split between calls => gather it in m_in_buf
+    for (size_t need; (need = lz4_header_size(m_in_buf)) > m_in_buf.size(); )
+    {
+        size_t amt = std::min<size_t>(need - m_in_buf.size(), src_end - src_begin);
+        if (!amt)
+        {
+            if (!flush) return false; // wait for more data
+            if (m_in_buf.size() < sizeof(lz4::legacy_magic))
+                FAIL("lz4: too small header!");
+            FAIL("lz4: too small header for lz4s");
+        }
+        m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+        src_begin += amt;
     }
-    uint32_t magic = *(uint32_t*)src_begin;
+    // decoded offsets go on across streams
+    m_decoded_base += m_total;
+    m_total = 0;
+    uint32_t magic = *(uint32_t*)&m_in_buf[0];
     if (magic != lz4::legacy_magic) {
       if (magic != lz4::lz4s_magic) {
         FAIL("not a lz4 legacy or lz4s stream!");
       } else {
-        if ((src_end - src_begin) < (int)sizeof(lz4::lz4s_file_header)) {
-          FAIL("lz4: too small header for lz4s");
-        }
         m_lz4s = true;
       }
     } else
@@ -241,13 +1003,14 @@ bool lz4_base::decompress_filter_header(const char*& src_begin, const char* src_
 #ifdef LZ4_FILTER_DEBUG
     printf("[d] hdr OK!\n");
 #endif
+    m_content_size = -1;
     if (m_lz4s) {
-      m_lz4s_header = *(lz4::lz4s_file_header*)(src_begin);
-      src_begin += sizeof(lz4::lz4s_file_header);
-      m_block_uncompressed_max = (1 << (8 + (2 * m_lz4s_header.blockSizeId)));
+      memcpy(&m_lz4s_header, &m_in_buf[0], sizeof(lz4::lz4s_file_header) - 1);
+      m_lz4s_header.checkBits = m_in_buf.back();
+      m_block_uncompressed_max = lz4::lz4s_blocksize(m_lz4s_header.blockSizeId);
 
 #ifdef LZ4_FILTER_DEBUG
-      std::cerr << "supportedheadersize:" << sizeof(lz4::lz4s_file_header) << std::endl;
+      std::cerr << "supportedheadersize:" << m_in_buf.size() << std::endl;
       std::cerr << "version:" << m_lz4s_header.version << std::endl;
       std::cerr << "blockSizeId:" << m_lz4s_header.blockSizeId << " ==> bufferSize:" << m_block_uncompressed_max << std::endl;
       std::cerr << "streamChecksumFlag:" << m_lz4s_header.streamChecksumFlag
@@ -263,142 +1026,478 @@ bool lz4_base::decompress_filter_header(const char*& src_begin, const char* src_
       // version == 1
       // reserved* == 0
       // blockSizeId >= 4 && <= 7
-      // stream_size_flag = 0
       // preset_dictionary_flag = 0
-      // block_independence_flag = 1
-      // block_checksum_flag != 0
-      // stream_checksum_flag != 0
-      // TBD checksum
+      // header checksum
+      // TBD block & stream checksums
 
-      if(m_lz4s_header.streamSize != 0)
-      {
-        FAIL("LZ4S stream size not supported");
-      }
       if(m_lz4s_header.version != 1)
       {
         FAIL("LZ4S version not supported");
       }
-      if(m_lz4s_header.blockIndependenceFlag == 0)
+      if(m_lz4s_header.blockSizeId < 4)
+      {
+        FAIL("LZ4S block size not supported");
+      }
+      if(m_lz4s_header.dictionary != 0)
+      {
+        FAIL("LZ4S preset dictionary not supported");
+      }
+      const char* descriptor = &m_in_buf[sizeof(lz4::lz4s_magic)];
+      const size_t descriptor_size = m_in_buf.size() - sizeof(lz4::lz4s_magic) - 1;
+      if(((lz4::xxh32(descriptor, descriptor_size) >> 8) & 0xff) != m_lz4s_header.checkBits)
       {
-        FAIL("LZ4S block dependence not supported");
+        FAIL("LZ4S header checksum mismatch");
       }
+      if(m_lz4s_header.streamSize)
+      {
+        uint64_t content_size;
+        memcpy(&content_size, descriptor + 2, sizeof(content_size));
+        if((int64_t)content_size < 0)
+        {
+          FAIL("LZ4S stream size too big");
+        }
+        m_content_size = content_size;
+      }
+      m_total = 0;
+      lz4::xxh32_reset(m_content_xxh);
+      m_linked = m_lz4s_header.blockIndependenceFlag == 0;
     } 
     else
     {
-      src_begin += sizeof(lz4::legacy_magic);
       m_block_uncompressed_max = lz4::legacy_blocksize;        
+      m_linked = false;
     }
+    m_dict.clear();
+    m_header.assign(m_in_buf.begin(), m_in_buf.end());
+    m_in_offset += m_in_buf.size();
 
+    m_in_buf.clear();
     m_was_header = true;
     m_waitblockstart = true;
+    m_frame_end = false;
     m_bytes_needed = 4;  // ready to read 1st block size
+    plan_memory();
+    LZ4_PROBE(header, this, m_lz4s, m_content_size);
   
   return true;
 }
 
+// block size known: fit the block buffers in the memory budget, if any.
+// Reading the next block waits until the decoded bytes kept are below
+// m_out_limit, so m_in_buf and m_out_buf never grow past what is
+// reserved here.
+void lz4_base::plan_memory()
+{
+    m_out_limit = MAX_OUT_BUF;
+    if (!m_memory_budget)
+        return;
+    // linked blocks: the window of decoded data kept for the next block
+    const std::size_t dict_size = m_linked ? lz4::dict_size : 0;
+    const std::size_t budget = m_memory_budget > dict_size ? m_memory_budget - dict_size : 0;
+    // whole block and size (and checksum), decoded block
+    const std::size_t in_size = m_lz4s ? 4 + m_block_uncompressed_max + 4
+                                       : 4 + LZ4_COMPRESSBOUND(m_block_uncompressed_max);
+    const std::size_t out_size = m_block_uncompressed_max;
+    const std::size_t in_place_size = lz4::lz4s_max_header_size +
+        lz4::in_place_buffer_size(m_block_uncompressed_max, in_size);
+    if (!m_in_place && budget >= in_size + out_size)
+    {
+        m_out_limit = std::min<std::size_t>(MAX_OUT_BUF, budget - in_size - out_size + 1);
+        m_in_buf.reserve(in_size);
+        m_out_buf.reserve(m_out_limit - 1 + out_size);
+    }
+    else if (budget >= in_place_size)
+    {
+        m_in_place = true;  // the only way to fit
+        m_in_buf.reserve(lz4::lz4s_max_header_size);
+        m_out_buf.reserve(in_place_size - lz4::lz4s_max_header_size);
+    }
+    else
+    {
+        FAIL("lz4: memory budget is too small for the stream blocks");
+    }
+}
+
+bool lz4_base::trim()
+{
+    if (m_trimmed)
+        return true;
+    if (!m_in_buf.empty() || !m_out_buf.empty() || m_staging_in_place || !m_blocks.empty() ||
+        (m_was_header && !m_waitblockstart))
+        return false;
+    m_in_capacity = m_in_buf.capacity();
+    m_out_capacity = m_out_buf.capacity();
+    if (m_pool)
+    {
+        m_pool->give(m_in_buf);
+        m_pool->give(m_out_buf);
+    }
+    else
+    {
+        lz4_buffer_pool::buffer().swap(m_in_buf);
+        lz4_buffer_pool::buffer().swap(m_out_buf);
+    }
+    m_trimmed = true;
+    return true;
+}
+
+// the block buffers as large as before trim(), for plan_memory() sized
+// them; a buffer filled since (by restore()) only grows
+static void refill(lz4_buffer_pool* pool, lz4_buffer_pool::buffer& b, std::size_t capacity)
+{
+    if (b.capacity() >= capacity)
+        return;
+    if (pool && b.empty())
+        pool->take(capacity).swap(b);
+    else
+        b.reserve(capacity);
+}
+
+void lz4_base::wake()
+{
+    refill(m_pool, m_in_buf, m_in_capacity);
+    refill(m_pool, m_out_buf, m_out_capacity);
+    m_trimmed = false;
+}
+
+// bytes in use in the block buffers
+void lz4_base::track_memory()
+{
+    m_memory_peak = std::max(m_memory_peak, m_in_buf.size() + m_out_buf.size() + m_dict.size());
+}
+
+// decode one LZ4S block (followed by its checksum if any) from src to dst
+template<typename Checksum>
+int lz4_base::lz4s_decode_block(const char* src, char* dst, int dst_capacity, bool may_overflow)
+{
+    if (Checksum::verify && m_lz4s_header.blockChecksumFlag)
+    {
+        uint32_t checksum;
+        memcpy(&checksum, src + m_block_size, sizeof(checksum));
+        if (lz4::xxh32(src, m_block_size) != checksum)
+            FAIL("LZ4S block checksum mismatch");
+    }
+    int raw_size;
+    if (m_block_uncompressed)
+    {
+        if ((int)m_block_size > dst_capacity)
+        {
+            if (may_overflow)
+                return -1;
+            FAIL("lz4: uncompressed block does not fit");
+        }
+        memmove(dst, src, m_block_size);  // may overlap when decoded in place
+        m_total += m_block_size;
+        raw_size = m_block_size;
+    }
+    else
+    {
+        raw_size = lz4_decompress(src, dst, m_block_size, dst_capacity, may_overflow);
+        if (raw_size < 0)
+            return -1;
+    }
+    if (Checksum::verify && m_lz4s_header.streamChecksumFlag)
+        lz4::xxh32_update(m_content_xxh, dst, raw_size);
+    if (m_linked)
+        keep_dict(dst, raw_size);
+    return raw_size;
+}
+
+// Blocks go straight to the caller's output when it has room for a whole
+// block, or when it is at least m_direct_min bytes and the decoded size
+// is expected to fit: exactly so for stored LZ4S blocks and at the end
+// of a stream of known size, from the previous block's ratio otherwise.
+// A wrong guess costs a partial decode, and no more guesses for the
+// block.
+bool lz4_base::direct_likely(uint32_t size, std::ptrdiff_t capacity) const
+{
+    if (m_direct_missed || capacity < (std::ptrdiff_t)m_direct_min)
+        return false;
+    if (m_lz4s && m_block_uncompressed)
+        return size <= capacity;
+    if (m_content_size >= 0 && m_content_size - (std::streamsize)m_total <= capacity)
+        return true;
+    const uint64_t expected = m_last_in ? (uint64_t)size * m_last_out / m_last_in : size;
+    return expected <= (uint64_t)capacity;
+}
+
+template<typename Checksum>
+bool lz4_base::decode_direct(const char* block, uint32_t size,
+                             char*& dst_begin, char* dst_end, int path)
+{
+    const std::ptrdiff_t capacity = dst_end - dst_begin;
+    const bool fits = capacity >= (std::ptrdiff_t)m_block_uncompressed_max;
+    if (!fits && !direct_likely(size, capacity))
+        return false;
+    const std::chrono::steady_clock::time_point start = block_start(path, size);
+    int raw_size = m_lz4s ? lz4s_decode_block<Checksum>(block, dst_begin, capacity, !fits)
+                          : lz4_decompress(block, dst_begin, size, capacity, !fits);
+    if (raw_size < 0)
+    {
+        block_done(start, path, size, 0);
+        m_direct_missed = true;
+        return false;
+    }
+    block_done(start, path, size, raw_size);
+    dst_begin += raw_size;
+    return true;
+}
+
+// end mark (and content checksum) consumed => another frame may follow
+void lz4_base::lz4s_end_of_frame()
+{
+    if (m_content_size >= 0 && (uint64_t)m_content_size != m_total)
+        FAIL("lz4: content size mismatch");
+    m_in_offset += m_lz4s_header.streamChecksumFlag ? 8 : 4;
+    m_in_buf.clear();
+    m_header.clear();
+    m_was_header = false;
+    m_frame_end = false;
+    m_bytes_needed = 0;
+}
+
 // See Also static unsigned long long LZ4IO_decompressLZ4F(dRess_t ress, FILE* srcFile, FILE* dstFile)
 // https://github.com/lz4/lz4/blob/dev/programs/lz4io.c
+template<typename Checksum>
 bool lz4_base::decompress_filter_input_lz4s(const char*& src_begin, const char* src_end,
                          char*& dst_begin, char* dst_end)
 {
     unsigned int src_size = src_end - src_begin;
     assert(src_size >= m_bytes_needed);
 
-    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + m_bytes_needed);
+    stage_input(src_begin, m_bytes_needed);
     src_begin += m_bytes_needed;  // consume part of input
 
+    if(m_frame_end)
+    {
+        // m_in_buf contains the content checksum
+        if (Checksum::verify &&
+            *(uint32_t*)&m_in_buf[0] != lz4::xxh32_digest(m_content_xxh))
+        {
+            FAIL("LZ4S content checksum mismatch");
+        }
+        lz4s_end_of_frame();
+        return true;
+    }
+
     if(m_waitblockstart)
     {
         m_waitblockstart = false;
+        m_direct_missed = false;
         uint32_t block_size = *(uint32_t*)&m_in_buf[0];
+        m_in_buf.clear();
         m_block_uncompressed = (block_size & 0x80000000) != 0;
         m_block_size = block_size & 0x7FFFFFFF;
         if(m_block_size == 0)
         {
-            if(m_lz4s_header.streamChecksumFlag && src_end-src_begin >= 4)
+            // end mark
+            if(m_lz4s_header.streamChecksumFlag)
             {
-                src_begin += 4;
+                m_frame_end = true;
+                m_bytes_needed = 4;
+            }
+            else
+            {
+                lz4s_end_of_frame();
             }
-            m_bytes_needed = 0;
             return true;
         }
         else if(m_block_size > m_block_uncompressed_max)
         {
             FAIL("ERROR IN SIZE")
         }
-        else
-        {
-            m_bytes_needed = m_block_size + (m_lz4s_header.blockChecksumFlag ? 4 : 0);
-         }
+        m_bytes_needed = m_block_size + (m_lz4s_header.blockChecksumFlag ? 4 : 0);
 
          // BUFFER contains only HEADER
 
       if ((src_end - src_begin) >= m_bytes_needed &&
-          (dst_end - dst_begin) >= m_block_uncompressed_max &&
-          m_out_buf.empty()) {
+          m_out_buf.empty() &&
+          decode_direct<Checksum>(src_begin, m_block_size, dst_begin, dst_end, path_direct)) {
         #ifdef LZ4_FILTER_DEBUG
                     printf("[*] ultra fast path!\n");
         #endif
-        // ULTRA-FAST PATH: decompress from src to dst
-        uint32_t block_size = m_block_size;
-        int raw_size = lz4_decompress(src_begin, dst_begin, block_size,m_block_uncompressed_max);
-        dst_begin += raw_size;
-        src_begin += block_size;
-        m_in_buf.clear();
+        // ULTRA-FAST PATH: decompressed from src to dst
+        src_begin += m_bytes_needed;
+        m_in_offset += 4 + m_bytes_needed;
         m_bytes_needed = 4;  // ready to read next block size
         m_waitblockstart = true;
-        return true;
         }
-    }     
+        else if (m_in_place)
+            stage_in_place(m_block_size, m_bytes_needed - m_block_size);
+        return true;
+    }
+
+    // m_in_buf now contains the whole block, followed by its checksum if any
+    // (or m_out_buf ends with them, when read in place)
+    const bool in_place = m_staging_in_place;
+    const char* block = in_place
+        ? &m_out_buf[m_out_buf.size() - m_block_size - (m_lz4s_header.blockChecksumFlag ? 4 : 0)]
+        : &m_in_buf[0];
+    m_staging_in_place = false;
+    if ((in_place || m_out_buf.empty()) &&
+        decode_direct<Checksum>(block, m_block_size, dst_begin, dst_end, path_gathered)) {
+        #ifdef LZ4_FILTER_DEBUG
+                    printf("[*] fast path!\n");
+        #endif
+        // FAST-PATH: decompressed directly to dst
+        m_out_buf.clear();
+    }
+    else if (in_place)
+    {
+        // decompress the end of m_out_buf to its start
+        stage_state(true);
+        const std::chrono::steady_clock::time_point start = block_start(path_staged, m_block_size);
+        int raw_size = lz4s_decode_block<Checksum>(block, &m_out_buf[0], m_block_uncompressed_max);
+        block_done(start, path_staged, m_block_size, raw_size);
+        m_out_buf.resize(raw_size);
+    }
     else
     {
         // decompress m_in_buf and APPEND decompressed data to m_out_buf
-        std::vector<char>::size_type prev_size = m_out_buf.size();
+        std::size_t prev_size = m_out_buf.size();
+        stage_state(prev_size == 0);
+        m_out_buf.resize(prev_size + m_block_uncompressed_max);
+        track_memory();
+        const std::chrono::steady_clock::time_point start = block_start(path_staged, m_block_size);
+        int raw_size = lz4s_decode_block<Checksum>(&m_in_buf[0], &m_out_buf[prev_size], m_block_uncompressed_max);
+        block_done(start, path_staged, m_block_size, raw_size);
+        m_out_buf.resize(prev_size + raw_size);  // resize to actual data written
+    }
+
+    // next block => skip automatically checksum if present
+    m_in_offset += 4 + m_block_size + (m_lz4s_header.blockChecksumFlag ? 4 : 0);
+    m_in_buf.clear();
+    m_waitblockstart = true;
+    m_bytes_needed = 4;  // ready to read next block size
+    return true;
+}
+
+// Between two blocks nothing is kept but counters, checksum state, the
+// stream header and the window of linked blocks, all of which only
+// change when a block is decoded: whatever input is staged since belongs
+// to the next block, and is read again after a restore.
+void lz4_base::save_state(lz4_checkpoint& cp) const
+{
+    cp.compressed_offset = m_in_offset;
+    cp.decoded_offset = m_decoded_base + m_total;
+    cp.header = m_header;
+    cp.frame_decoded = m_total;
+    cp.content_xxh = m_content_xxh;
+    cp.dict = m_dict;
+}
 
+// a block is about to be decoded into m_out_buf: the state before it is
+// where a restart goes on from once the bytes before it are output.
+// States older than the last one output are dropped.
+void lz4_base::stage_state(bool out_empty)
+{
+    const uint64_t output = m_decoded_base + m_total - (out_empty ? 0 : m_out_buf.size());
+    if (out_empty)
+        m_staged_states.clear();
+    while (m_staged_states.size() > 1 && m_staged_states[1].decoded_offset <= output)
+        m_staged_states.pop_front();
+    m_staged_states.push_back(lz4_checkpoint());
+    save_state(m_staged_states.back());
+}
 
-        if(m_block_uncompressed)
+bool lz4_base::checkpoint(lz4_checkpoint& cp) const
+{
+    if (m_fail)
+        return false;
+    const std::size_t pending = m_staging_in_place ? 0 : m_out_buf.size();
+    if (!pending)
+    {
+        save_state(cp);
+        return true;
+    }
+    // the last state before what is still in m_out_buf
+    const uint64_t output = m_decoded_base + m_total - pending;
+    for (std::deque<lz4_checkpoint>::const_reverse_iterator i = m_staged_states.rbegin();
+         i != m_staged_states.rend(); ++i)
+    {
+        if (i->decoded_offset <= output)
         {
-              if (m_out_buf.empty() &&
-                          (dst_end - dst_begin) >= m_block_size) {
-                        #ifdef LZ4_FILTER_DEBUG
-                                    printf("[*] fast path!\n");
-                        #endif
-                        std::copy_n(m_in_buf.begin()+4,m_block_size, dst_begin);
-                        dst_begin += m_block_size;
-                } 
-                else 
-                {
-                    m_out_buf.resize(prev_size + m_block_size);
-                    std::copy_n(m_in_buf.begin()+4,m_block_size,m_out_buf.begin()+prev_size);
-                }
+            cp = *i;
+            return true;
         }
-        else
-        {
+    }
+    return false;
+}
 
-              if (m_out_buf.empty() &&
-                  (dst_end - dst_begin) >= m_block_uncompressed_max) {
-                    // FAST-PATH: decompress directly to dst
-                    int raw_size = lz4_decompress(&m_in_buf[4], dst_begin, m_block_size);
-                    dst_begin += raw_size;
-              } 
-              else 
-              {
+void lz4_base::restore(const lz4_checkpoint& cp)
+{
+    init(false);
+    if (!cp.header.empty())
+    {
+        const char* header = cp.header.data();
+        const char* const header_end = header + cp.header.size();
+        if (!decompress_filter_header(header, header_end, true) || header != header_end)
+            FAIL("lz4: bad checkpoint header");
+        m_total = cp.frame_decoded;
+        m_content_xxh = cp.content_xxh;
+        m_dict = cp.dict;
+    }
+    if (cp.decoded_offset < m_total)
+        FAIL("lz4: bad checkpoint offsets");
+    m_in_offset = cp.compressed_offset;
+    m_decoded_base = cp.decoded_offset - m_total;
+}
 
-                m_out_buf.resize(prev_size + m_block_uncompressed_max);
+// the first bytes of the first block, without decoding all of it
+// and without consuming anything; -1 if src does not hold the whole block
+std::streamsize lz4_base::decompress_peek(const char* src_begin, const char* src_end,
+                                          char* dst_begin, char* dst_end,
+                                          std::size_t& needed)
+{
+    if (!m_was_header || !m_waitblockstart || !m_in_buf.empty() ||
+        !m_out_buf.empty() || m_total)
+    {
+        throw std::logic_error("lz4: peek is only possible before the first block is decoded");
+    }
+    needed = 4;
+    if (src_end - src_begin < 4)
+        return -1;
 
-                int raw_size = lz4_decompress(&m_in_buf[4], &m_out_buf[prev_size], m_block_size, m_out_buf.size()-prev_size);
-                m_out_buf.resize(prev_size + raw_size);  // resize to actual data written
-            }
-        }
+    uint32_t block_size = *(uint32_t*)src_begin;
+    bool uncompressed = false;
+    if (m_lz4s)
+    {
+        uncompressed = (block_size & 0x80000000) != 0;
+        block_size &= 0x7FFFFFFF;
+        if (block_size == 0)
+            return 0; // empty frame
+        if (block_size > m_block_uncompressed_max)
+            FAIL("ERROR IN SIZE");
+    }
+    else if (block_size == 0 || block_size > LZ4_COMPRESSBOUND(lz4::legacy_blocksize))
+    {
+        FAIL("invalid lz4 block size!");
+    }
+    needed = 4 + block_size;
+    if ((std::size_t)(src_end - src_begin) < needed)
+        return -1;
 
-        // next block => skip automatically checksum if present
-        m_in_buf.clear();
-        m_waitblockstart = true;
-        m_bytes_needed = 4;  // ready to read next block size
-    }; 
-    return true;
+    int n = std::min<std::ptrdiff_t>(dst_end - dst_begin, m_block_uncompressed_max);
+    if (uncompressed)
+    {
+        n = std::min<int>(n, block_size);
+        memcpy(dst_begin, src_begin + 4, n);
+        return n;
+    }
+    int raw_size = LZ4_decompress_safe_partial(src_begin + 4, dst_begin, block_size, n, n);
+    if (raw_size < 0)
+        FAIL("lz4: decoded_size <= 0");
+    return raw_size;
 }
 
+// autodetected format, checksums skipped
+bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
+                                 char*& dst_begin, char* dst_end, bool flush) {
+  return decompress_filter<lz4::autodetect_format, lz4::skip_checksums>(
+      src_begin, src_end, dst_begin, dst_end, flush);
+}
+
+template<typename Format, typename Checksum>
 bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
                                  char*& dst_begin, char* dst_end, bool flush) {
 #ifdef LZ4_FILTER_DEBUG
@@ -417,27 +1516,50 @@ bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
     // decompression failed, do not try to process anything else
     return false;
   }
+  if (m_trimmed)
+  {
+    wake();
+  }
 
-  if(!m_was_header)
+  if(!m_was_header && m_out_buf.empty())
   {
       if(!decompress_filter_header(src_begin,src_end,flush))
       {
-            return false;
+            // EOF on empty input, otherwise wait for the rest of the header
+            return !flush;
         }
+      if(!Format::autodetect && m_lz4s != Format::lz4s)
+      {
+          FAIL(Format::lz4s ? "not a lz4s stream!" : "not a lz4 legacy stream!");
+      }
   }
 
   // consume output buffer if ANY
   decompress_filter_output(dst_begin,dst_end);
 
   // process input as long as buffer is not full
-    while (src_begin < src_end && m_out_buf.size() < MAX_OUT_BUF) 
+    // (in place: only once the previous block is out, as the next one
+    // is read into the same buffer)
+    while (src_begin < src_end &&
+           (m_staging_in_place || m_out_buf.size() < (m_in_place ? 1 : m_out_limit)))
     {
         const unsigned int src_size = src_end - src_begin;
-        if (src_size >= m_bytes_needed) 
+        if (!m_was_header)
         {
-            if(m_lz4s)
+            // next concatenated frame
+            if(!decompress_filter_header(src_begin,src_end,flush))
+                break;
+            if(!Format::autodetect && m_lz4s != Format::lz4s)
             {
-                if(!decompress_filter_input_lz4s(src_begin,src_end,dst_begin,dst_end))
+                FAIL(Format::lz4s ? "not a lz4s stream!" : "not a lz4 legacy stream!");
+            }
+        }
+        else if (src_size >= m_bytes_needed) 
+        {
+            // known at compile time unless the format is autodetected
+            if(Format::autodetect ? m_lz4s : Format::lz4s)
+            {
+                if(!decompress_filter_input_lz4s<Checksum>(src_begin,src_end,dst_begin,dst_end))
                     break;
             }
             else
@@ -448,7 +1570,8 @@ bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
         }
         else
         {
-            m_in_buf.insert( m_in_buf.end(), src_begin, src_end );
+            LZ4_PROBE(stage, this, src_size, m_bytes_needed);
+            stage_input( src_begin, src_size );
             src_begin = src_end;
             m_bytes_needed -= src_size;            
         }
@@ -461,10 +1584,19 @@ bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
     printf("[d] lz4::decomp_filter exit m_in_buf: %ld, m_out_buf: %ld, m_bytes_needed = %d wait = %s input left = %d\n",
            m_in_buf.size(), m_out_buf.size(), m_bytes_needed,!m_was_header ? "header": m_waitblockstart ? "blocksize" : "blockdata",src_end - src_begin);
 #endif
-  
+
+  if (m_auto_trim && src_begin == src_end)
+  {
+    // waits for input: idle for all we know
+    trim();
+  }
+
   if (flush) 
   {
-    if (!m_in_buf.empty() && src_end-src_begin > 0) 
+    // all input consumed => must stop between blocks (or frames)
+    const bool at_boundary = m_in_buf.empty() &&
+        (!m_was_header || (!(Format::autodetect ? m_lz4s : Format::lz4s) && m_waitblockstart));
+    if (src_begin == src_end && !at_boundary)
     {
         FAIL("lz4: unexpected EOF");
     }
@@ -476,21 +1608,610 @@ bool lz4_base::decompress_filter(const char*& src_begin, const char* src_end,
   }
 }
 
+// may_overflow: -1 rather than a failure if the block might be larger
+// than uc, it is decoded again with room for a whole block
 int lz4_base::lz4_decompress(const char* src_begin, char* dst_begin,
-                             int comp_chunk_size, int uc) {
-  int raw_size = LZ4_decompress_safe(src_begin, dst_begin, comp_chunk_size,
-                                     uc);
+                             int comp_chunk_size, int uc, bool may_overflow) {
+  // zero blocks as lz4_compressor writes them are only a memset
+  int raw_size = zero_block_size(src_begin, comp_chunk_size);
+  if (raw_size > 0 && raw_size <= uc)
+    memset(dst_begin, 0, raw_size);
+  else if (m_linked && !m_dict.empty())
+    raw_size = LZ4_decompress_safe_usingDict(src_begin, dst_begin, comp_chunk_size, uc,
+                                             m_dict.data(), m_dict.size());
+  else
+    raw_size = LZ4_decompress_safe(src_begin, dst_begin, comp_chunk_size, uc);
 #ifdef LZ4_FILTER_DEBUG
   printf("[d] decompressed size = %d\n", raw_size);
 #endif
   if (raw_size <= 0) {
+    if (may_overflow) return -1;
     FAIL("lz4: decoded_size <= 0");
   }
+  m_total += raw_size;
+  m_last_in = comp_chunk_size;
+  m_last_out = raw_size;
   return raw_size;
 }
 
+// the only formats and checksum policies basic_lz4_decompressor can use
+template bool lz4_base::decompress_filter<lz4::autodetect_format, lz4::skip_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+template bool lz4_base::decompress_filter<lz4::autodetect_format, lz4::verify_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+template bool lz4_base::decompress_filter<lz4::legacy_format, lz4::skip_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+template bool lz4_base::decompress_filter<lz4::legacy_format, lz4::verify_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+template bool lz4_base::decompress_filter<lz4::frame_format, lz4::skip_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+template bool lz4_base::decompress_filter<lz4::frame_format, lz4::verify_checksums>(
+    const char*&, const char*, char*&, char*, bool);
+
 }  // namespace detail
 
+//------------------Implementation of encode_header/encode_block-----------------//
+
+namespace lz4 {
+
+size_t encode_header(const lz4_params& params, char* dst) {
+  if (params.format != frame) {
+    memcpy(dst, &legacy_magic, sizeof(legacy_magic));
+    return sizeof(legacy_magic);
+  }
+  memcpy(dst, &lz4s_magic, sizeof(lz4s_magic));
+  uint8_t* descriptor = (uint8_t*)dst + sizeof(lz4s_magic);
+  descriptor[0] = (1 << 6)                                      // version
+                  | (params.linked_blocks ? 0 : (1 << 5))       // independent blocks
+                  | (params.block_checksum ? (1 << 4) : 0)
+                  | (params.content_size >= 0 ? (1 << 3) : 0)
+                  | (params.content_checksum ? (1 << 2) : 0);
+  descriptor[1] = params.block_size_id << 4;
+  size_t descriptor_size = 2;
+  if (params.content_size >= 0) {
+    uint64_t content_size = params.content_size;
+    memcpy(descriptor + 2, &content_size, sizeof(content_size));
+    descriptor_size += sizeof(content_size);
+  }
+  descriptor[descriptor_size] = (xxh32(descriptor, descriptor_size) >> 8) & 0xff;
+  return sizeof(lz4s_magic) + descriptor_size + 1;
+}
+
+size_t encode_block(const lz4_params& params, const char* src, size_t src_size, char* dst,
+                    const char* dict, size_t dict_size) {
+  int32_t comp_size = detail::compress_block(src, src_size, dst + 4, LZ4_COMPRESSBOUND(src_size),
+                                             dict, dict_size);
+  if (params.format != frame) {
+    if (comp_size <= 0) throw std::runtime_error("it does not fit! (2)");
+    memcpy(dst, &comp_size, 4);
+    return 4 + comp_size;
+  }
+  uint32_t block_size = comp_size;
+  if (comp_size <= 0 || (size_t)comp_size >= src_size) {
+    // incompressible => store as is
+    memcpy(dst + 4, src, src_size);
+    block_size = src_size | 0x80000000;
+    comp_size = src_size;
+  }
+  memcpy(dst, &block_size, 4);
+  if (!params.block_checksum) return 4 + comp_size;
+  uint32_t checksum = xxh32(dst + 4, comp_size);
+  memcpy(dst + 4 + comp_size, &checksum, 4);
+  return 4 + comp_size + 4;
+}
+
+}  // namespace lz4
+
+//------------------Implementation of lz4_checkpoint-------------------------//
+
+// "LZ4K", offsets, header, checksum state and window, in host byte
+// order: a checkpoint is read back on the machine that wrote it
+static const uint32_t checkpoint_magic = 0x4b345a4c;
+
+void save_checkpoint(std::ostream& out, const lz4_checkpoint& cp) {
+  const uint32_t header_size = cp.header.size(), dict_size = cp.dict.size();
+  out.write((const char*)&checkpoint_magic, 4);
+  out.write((const char*)&cp.compressed_offset, 8);
+  out.write((const char*)&cp.decoded_offset, 8);
+  out.write((const char*)&cp.frame_decoded, 8);
+  out.write((const char*)&cp.content_xxh, sizeof(cp.content_xxh));
+  out.write((const char*)&header_size, 4);
+  out.write(cp.header.data(), header_size);
+  out.write((const char*)&dict_size, 4);
+  out.write(cp.dict.data(), dict_size);
+  if (!out) throw std::runtime_error("lz4: write error");
+}
+
+lz4_checkpoint load_checkpoint(std::istream& in) {
+  lz4_checkpoint cp;
+  uint32_t magic = 0, header_size = 0, dict_size = 0;
+  in.read((char*)&magic, 4);
+  if (!in || magic != checkpoint_magic) throw std::runtime_error("lz4: not a checkpoint");
+  in.read((char*)&cp.compressed_offset, 8);
+  in.read((char*)&cp.decoded_offset, 8);
+  in.read((char*)&cp.frame_decoded, 8);
+  in.read((char*)&cp.content_xxh, sizeof(cp.content_xxh));
+  in.read((char*)&header_size, 4);
+  if (!in || header_size > lz4::lz4s_max_header_size) throw std::runtime_error("lz4: bad checkpoint");
+  cp.header.resize(header_size);
+  in.read(cp.header.data(), header_size);
+  in.read((char*)&dict_size, 4);
+  if (!in || dict_size > lz4::dict_size) throw std::runtime_error("lz4: bad checkpoint");
+  cp.dict.resize(dict_size);
+  in.read(cp.dict.data(), dict_size);
+  if (!in) throw std::runtime_error("lz4: truncated checkpoint");
+  return cp;
+}
+
+//------------------Implementation of lz4_buffer_pool------------------------//
+
+struct lz4_buffer_pool::impl {
+  std::size_t max_bytes;
+  std::size_t bytes;
+  mutable std::mutex mutex;
+  std::multimap<std::size_t, buffer> buffers;  // by capacity
+};
+
+lz4_buffer_pool::lz4_buffer_pool(std::size_t max_bytes) : pimpl_(new impl) {
+  pimpl_->max_bytes = max_bytes;
+  pimpl_->bytes = 0;
+}
+
+lz4_buffer_pool::~lz4_buffer_pool() {}
+
+lz4_buffer_pool& lz4_buffer_pool::shared() {
+  static lz4_buffer_pool instance;
+  return instance;
+}
+
+lz4_buffer_pool::buffer lz4_buffer_pool::take(std::size_t capacity) {
+  buffer b;
+  {
+    std::lock_guard<std::mutex> lock(pimpl_->mutex);
+    std::multimap<std::size_t, buffer>::iterator it = pimpl_->buffers.lower_bound(capacity);
+    if (it != pimpl_->buffers.end()) {
+      b.swap(it->second);
+      pimpl_->bytes -= it->first;
+      pimpl_->buffers.erase(it);
+      return b;
+    }
+  }
+  b.reserve(capacity);
+  return b;
+}
+
+void lz4_buffer_pool::give(buffer& b) {
+  const std::size_t capacity = b.capacity();
+  buffer kept;
+  kept.swap(b);
+  if (!capacity) return;
+  kept.clear();
+  std::lock_guard<std::mutex> lock(pimpl_->mutex);
+  if (pimpl_->bytes + capacity > pimpl_->max_bytes) return;  // freed as kept goes
+  pimpl_->buffers.insert(std::make_pair(capacity, buffer()))->second.swap(kept);
+  pimpl_->bytes += capacity;
+}
+
+std::size_t lz4_buffer_pool::size() const {
+  std::lock_guard<std::mutex> lock(pimpl_->mutex);
+  return pimpl_->bytes;
+}
+
+//------------------Implementation of lz4_sparse_file_sink-------------------//
+
+// holes are made of whole pages of the file
+static const size_t sparse_page_size = 4096;
+
+struct lz4_sparse_file_sink::impl {
+  int fd;
+  bool close_fd;
+  bool seekable;
+  bool append;            // O_APPEND: every write goes to the end of file
+  uint64_t offset;        // where the next byte goes
+  uint64_t initial_size;  // zeros below it may overwrite data
+  uint64_t skipped;
+  // the page offset is in, until it is complete: the first bytes
+  // belong to the file before the sink wrote anything
+  char page[sparse_page_size];
+  size_t fill, first;
+
+  impl(int fd, bool close_fd) : fd(fd), close_fd(close_fd), skipped(0) {
+    const off_t pos = lseek(fd, 0, SEEK_CUR);
+    struct stat st;
+    seekable = pos >= 0 && 0 == fstat(fd, &st) && S_ISREG(st.st_mode);
+    const int flags = fcntl(fd, F_GETFL);
+    append = seekable && flags >= 0 && (flags & O_APPEND);
+    // the offset of an O_APPEND descriptor says nothing about where
+    // writes go; they never land on the data already there
+    offset = append ? st.st_size : seekable ? pos : 0;
+    initial_size = seekable ? st.st_size : 0;
+    fill = first = offset % sparse_page_size;
+  }
+  ~impl() { if (close_fd && fd >= 0) ::close(fd); }
+
+  void write_at(const char* s, size_t n, uint64_t pos) {
+    while (n) {
+      const ssize_t amt = seekable && !append ? pwrite(fd, s, n, pos) : ::write(fd, s, n);
+      if (amt < 0 && errno == EINTR) continue;
+      if (amt <= 0) throw std::runtime_error(std::string("lz4: write error: ") + strerror(errno));
+      s += amt;
+      n -= amt;
+      pos += amt;
+    }
+  }
+
+  // size zero bytes at pos: a hole past the old end of file, a punched
+  // hole over old data, written zeros when neither is possible. When
+  // appending, pos is the end of file: growing the file makes the hole.
+  void zeros_at(uint64_t pos, uint64_t size) {
+    static const char zero_page[sparse_page_size] = {0};
+    const uint64_t end = pos + size;
+    if (append && 0 == ftruncate(fd, end)) {
+      skipped += size;
+      return;
+    }
+    if (seekable && pos < initial_size) {
+      const uint64_t punch_end = std::min(end, initial_size);
+#ifdef FALLOC_FL_PUNCH_HOLE
+      if (0 == fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, pos, punch_end - pos)) {
+        skipped += punch_end - pos;
+        pos = punch_end;
+      }
+#endif
+      for (; pos < punch_end; pos += sparse_page_size)
+        write_at(zero_page, std::min<uint64_t>(sparse_page_size, punch_end - pos), pos);
+    }
+    if (!seekable || append) {
+      for (; pos < end; pos += sparse_page_size)
+        write_at(zero_page, std::min<uint64_t>(sparse_page_size, end - pos), pos);
+      return;
+    }
+    skipped += end - pos;
+  }
+
+  // whole pages starting at pos, runs of zero pages left out
+  void pages(const char* p, size_t size, uint64_t pos) {
+    const char* const end = p + size;
+    const char* data = p;  // not written yet, at pos
+    while (p != end) {
+      if (!detail::all_zero(p, sparse_page_size)) {
+        p += sparse_page_size;
+        continue;
+      }
+      const char* z = p + sparse_page_size;
+      while (z != end && detail::all_zero(z, sparse_page_size)) z += sparse_page_size;
+      write_at(data, p - data, pos);
+      zeros_at(pos + (p - data), z - p);
+      pos += z - data;
+      p = data = z;
+    }
+    write_at(data, end - data, pos);
+  }
+
+  // the bytes of page that are the sink's, at offset - fill + first
+  void flush_page() {
+    const uint64_t pos = offset - fill + first;
+    if (fill == sparse_page_size && !first)
+      pages(page, fill, pos);
+    else if (detail::all_zero(page + first, fill - first))
+      zeros_at(pos, fill - first);
+    else
+      write_at(page + first, fill - first, pos);
+    fill = first = 0;
+  }
+};
+
+lz4_sparse_file_sink::lz4_sparse_file_sink(const std::string& path, BOOST_IOS::openmode mode) {
+  const int fd = ::open(path.c_str(),
+                        O_WRONLY | O_CREAT | ((mode & BOOST_IOS::trunc) ? O_TRUNC : 0), 0666);
+  if (fd < 0) throw std::runtime_error("lz4: can not open " + path + ": " + strerror(errno));
+  pimpl_.reset(new impl(fd, true));
+}
+
+lz4_sparse_file_sink::lz4_sparse_file_sink(int fd, bool close_fd)
+    : pimpl_(new impl(fd, close_fd)) {}
+
+bool lz4_sparse_file_sink::is_open() const { return pimpl_->fd >= 0; }
+
+uint64_t lz4_sparse_file_sink::skipped() const { return pimpl_->skipped; }
+
+// writes are cut at page boundaries of the file: a page split between
+// calls is gathered first, whole pages go from s
+std::streamsize lz4_sparse_file_sink::write(const char_type* s, std::streamsize n) {
+  impl& i = *pimpl_;
+  const char* const end = s + n;
+  if (i.fill) {
+    const size_t amt = std::min<size_t>(n, sparse_page_size - i.fill);
+    memcpy(i.page + i.fill, s, amt);
+    i.fill += amt;
+    i.offset += amt;
+    s += amt;
+    if (i.fill < sparse_page_size) return n;
+    i.flush_page();
+  }
+  const size_t whole = (end - s) / sparse_page_size * sparse_page_size;
+  i.pages(s, whole, i.offset);
+  i.offset += whole;
+  s += whole;
+  memcpy(i.page, s, end - s);
+  i.fill = end - s;
+  i.offset += end - s;
+  return n;
+}
+
+void lz4_sparse_file_sink::close() {
+  impl& i = *pimpl_;
+  if (i.fd < 0) return;
+  if (i.fill > i.first) i.flush_page();
+  struct stat st;
+  // a trailing hole still counts in the file size
+  if (i.seekable && 0 == fstat(i.fd, &st) && (uint64_t)st.st_size < i.offset &&
+      0 != ftruncate(i.fd, i.offset))
+    throw std::runtime_error(std::string("lz4: truncate error: ") + strerror(errno));
+  if (i.close_fd) ::close(i.fd);
+  i.fd = -1;
+}
+
+//------------------Implementation of lz4_readahead_source-------------------//
+
+struct lz4_readahead_source::impl {
+  struct chunk {
+    std::vector<char> data;
+    std::streamsize size;
+  };
+
+  std::function<std::streamsize(char*, std::streamsize)> reader;
+  std::vector<chunk> chunks;
+  std::mutex mutex;
+  std::condition_variable cv;  // chunk filled / chunk freed / stop
+  std::deque<chunk*> full, free;
+  chunk* current;              // being consumed by read(), not in any queue
+  std::streamsize pos;
+  bool eof, stop;
+  std::exception_ptr error;
+  std::thread thread;
+
+  impl() : current(0), pos(0), eof(false), stop(false) {}
+  ~impl() { shutdown(); }
+
+  void run();
+  void shutdown();
+};
+
+void lz4_readahead_source::impl::run() {
+  try {
+    for (;;) {
+      chunk* c;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return stop || !free.empty(); });
+        if (stop) return;
+        c = free.front();
+        free.pop_front();
+      }
+      // the only place that touches the wrapped source, outside the lock;
+      // while it would block, waits twice as long each time, up to 10 ms
+      std::streamsize amt;
+      for (std::chrono::microseconds wait(50); (amt = reader(c->data.data(), c->data.size())) == 0;
+           wait = std::min(2 * wait, std::chrono::microseconds(10000))) {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (cv.wait_for(lock, wait, [this] { return stop; })) {
+          free.push_front(c);
+          return;
+        }
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      if (amt == -1) {
+        free.push_front(c);
+        eof = true;
+        cv.notify_all();
+        return;
+      }
+      c->size = amt;
+      full.push_back(c);
+      cv.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+    eof = true;
+    cv.notify_all();
+  }
+}
+
+void lz4_readahead_source::impl::shutdown() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    cv.notify_all();
+  }
+  if (thread.joinable()) thread.join();
+}
+
+void lz4_readahead_source::start(
+    const std::function<std::streamsize(char*, std::streamsize)>& reader,
+    unsigned int depth, std::streamsize chunk_size) {
+  if (!depth || chunk_size <= 0)
+    throw std::invalid_argument("lz4_readahead_source: empty queue");
+  pimpl_.reset(new impl());
+  pimpl_->reader = reader;
+  pimpl_->chunks.resize(depth);
+  for (impl::chunk& c : pimpl_->chunks) {
+    c.data.resize(chunk_size);
+    pimpl_->free.push_back(&c);
+  }
+  pimpl_->thread = std::thread(&impl::run, pimpl_.get());
+}
+
+std::streamsize lz4_readahead_source::read(char_type* s, std::streamsize n) {
+  impl& r = *pimpl_;
+  std::streamsize total = 0;
+  if (!n) return 0;
+  while (total < n) {
+    if (!r.current) {
+      std::unique_lock<std::mutex> lock(r.mutex);
+      if (total && r.full.empty()) break;  // return what we have, do not wait
+      r.cv.wait(lock, [&r] { return !r.full.empty() || r.eof || r.stop; });
+      if (r.full.empty()) {
+        if (r.error) std::rethrow_exception(r.error);
+        break;  // EOF
+      }
+      r.current = r.full.front();
+      r.full.pop_front();
+      r.pos = 0;
+    }
+    std::streamsize amt = std::min(n - total, r.current->size - r.pos);
+    memcpy(s + total, r.current->data.data() + r.pos, amt);
+    total += amt;
+    r.pos += amt;
+    if (r.pos == r.current->size) {
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.free.push_back(r.current);
+      r.current = 0;
+      r.cv.notify_all();
+    }
+  }
+  return total ? total : -1;
+}
+
+void lz4_readahead_source::close() { pimpl_->shutdown(); }
+
+//------------------Implementation of executor-------------------------------//
+
+namespace lz4 {
+
+// tasks of one stream; in a worker queue while it has tasks waiting
+struct executor::stream_state {
+  std::mutex mutex;
+  std::condition_variable cv;  // a task ran
+  std::deque<task> tasks;      // waiting
+  unsigned in_flight;          // waiting or running
+  unsigned max_in_flight;
+  explicit stream_state(unsigned max) : in_flight(0), max_in_flight(max) {}
+};
+
+struct executor::impl {
+  struct worker {
+    std::mutex mutex;
+    std::deque<std::shared_ptr<stream_state> > ready;
+  };
+
+  std::vector<std::unique_ptr<worker> > workers;
+  std::vector<std::thread> threads;
+  std::mutex sleep_mutex;
+  std::condition_variable wake;
+  size_t queued;  // streams in the worker queues, under sleep_mutex
+  bool stop;
+  std::atomic<unsigned> next;  // worker for the next new stream
+
+  impl() : queued(0), stop(false), next(0) {}
+
+  void enqueue(const std::shared_ptr<stream_state>& s, unsigned w);
+  std::shared_ptr<stream_state> take(unsigned self);
+  void run(unsigned self);
+};
+
+void executor::impl::enqueue(const std::shared_ptr<stream_state>& s, unsigned w) {
+  {
+    worker& wk = *workers[w % workers.size()];
+    std::lock_guard<std::mutex> lock(wk.mutex);
+    wk.ready.push_back(s);
+  }
+  std::lock_guard<std::mutex> lock(sleep_mutex);
+  ++queued;
+  wake.notify_one();
+}
+
+// the oldest stream of the own queue, else steal the oldest of another
+std::shared_ptr<executor::stream_state> executor::impl::take(unsigned self) {
+  for (size_t i = 0; i < workers.size(); ++i) {
+    worker& wk = *workers[(self + i) % workers.size()];
+    std::lock_guard<std::mutex> lock(wk.mutex);
+    if (wk.ready.empty()) continue;
+    std::shared_ptr<stream_state> s = wk.ready.front();
+    wk.ready.pop_front();
+    std::lock_guard<std::mutex> sleep_lock(sleep_mutex);
+    --queued;
+    return s;
+  }
+  return std::shared_ptr<stream_state>();
+}
+
+void executor::impl::run(unsigned self) {
+  for (;;) {
+    std::shared_ptr<stream_state> s = take(self);
+    if (!s) {
+      std::unique_lock<std::mutex> lock(sleep_mutex);
+      wake.wait(lock, [this] { return stop || queued; });
+      if (stop && !queued) return;
+      continue;
+    }
+    task t;
+    bool more;
+    {
+      std::lock_guard<std::mutex> lock(s->mutex);
+      t.swap(s->tasks.front());
+      s->tasks.pop_front();
+      more = !s->tasks.empty();
+    }
+    // one task per turn: the stream goes to the back of the queue,
+    // where another worker may take its next task meanwhile
+    if (more) enqueue(s, self);
+    t();
+    std::lock_guard<std::mutex> lock(s->mutex);
+    --s->in_flight;
+    s->cv.notify_all();
+  }
+}
+
+executor::executor(unsigned threads) : pimpl_(new impl()) {
+  if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+  for (unsigned i = 0; i < threads; ++i)
+    pimpl_->workers.emplace_back(new impl::worker());
+  for (unsigned i = 0; i < threads; ++i)
+    pimpl_->threads.emplace_back(&impl::run, pimpl_.get(), i);
+}
+
+executor::~executor() {
+  {
+    std::lock_guard<std::mutex> lock(pimpl_->sleep_mutex);
+    pimpl_->stop = true;
+    pimpl_->wake.notify_all();
+  }
+  for (std::thread& t : pimpl_->threads) t.join();
+}
+
+executor& executor::shared() {
+  static executor instance;
+  return instance;
+}
+
+unsigned executor::size() const { return pimpl_->threads.size(); }
+
+executor::stream::stream(executor& ex, unsigned max_in_flight)
+    : m_executor(ex), m_state(std::make_shared<stream_state>(std::max(1u, max_in_flight))) {}
+
+executor::stream::~stream() { wait(); }
+
+void executor::stream::submit(task t) {
+  bool schedule;
+  {
+    std::unique_lock<std::mutex> lock(m_state->mutex);
+    m_state->cv.wait(lock, [this] { return m_state->in_flight < m_state->max_in_flight; });
+    schedule = m_state->tasks.empty();  // otherwise already queued
+    m_state->tasks.push_back(std::move(t));
+    ++m_state->in_flight;
+  }
+  if (schedule) m_executor.pimpl_->enqueue(m_state, m_executor.pimpl_->next++);
+}
+
+void executor::stream::wait() {
+  std::unique_lock<std::mutex> lock(m_state->mutex);
+  m_state->cv.wait(lock, [this] { return m_state->in_flight == 0; });
+}
+
+}  // namespace lz4
+
 //----------------------------------------------------------------------------//
 
 }  // namespace iostreams
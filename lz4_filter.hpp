@@ -5,9 +5,21 @@
 #include <boost/iostreams/constants.hpp>   // buffer size.
 #include <boost/iostreams/detail/config/dyn_link.hpp>
 #include <boost/iostreams/filter/symmetric.hpp>
+#include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/operations.hpp>
+#include <boost/shared_ptr.hpp>
 //#include <boost/config/abi_prefix.hpp>
 
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <utility>
 #include <vector>
 
 // https://docs.google.com/document/d/1cl8N1bmkTdIpPLtnlzbBSFAdUeyNo5fwfHbHU7VRNWY/edit
@@ -25,9 +37,38 @@ const uint32_t legacy_magic = 0x184C2102;
 // b) compatibility with previously compressed data will be lost
 const unsigned int legacy_blocksize  = 8*1024*1024; // 8 MB
 
+// size of the compressed data buffer used by the multichar (non-symmetric)
+// filters and by the lz4_file_* devices
+const unsigned int multichar_buffer_size = 64*1024; // 64 KB
+
+// decoding: smallest output range a block smaller than a full one is
+// decoded straight into, see lz4_base::set_direct_min()
+const unsigned int direct_min_size = 64*1024; // 64 KB
+
+// linked LZ4S blocks: how far back a block may refer to the data before
+// it, the LZ4 match window
+const unsigned int dict_size = 64*1024; // 64 KB
+
+// lz4_readahead_source reads this much per chunk: a whole compressed
+// legacy block with its size
+const unsigned int readahead_chunk_size = 4 + LZ4_COMPRESSBOUND(legacy_blocksize);
+
 // no LZ4S format for now, maybe in future..
 const uint32_t lz4s_magic   = 0x184D2204;
 
+// stream format written by lz4_compressor
+enum stream_format
+    {
+    legacy = 0,     // legacy_magic + 8 MB blocks, what lz4c writes with -l
+    frame  = 1      // lz4s_magic + LZ4S frame header + blocks + end mark
+    };
+
+// LZ4S maximal uncompressed block size for blockSizeId = 4..7
+inline unsigned int lz4s_blocksize(unsigned int block_size_id)
+    {
+    return 1 << (8 + 2 * block_size_id);
+    }
+
 #pragma pack(push,1)
 struct lz4s_file_header
     {
@@ -44,52 +85,416 @@ struct lz4s_file_header
         unsigned int reserved3:4;
         unsigned int blockSizeId:3;
         unsigned int reserved2:1;
+        // optional 8-byte content size (streamSize) goes here
         // descriptor[2]:
         uint8_t checkBits;  // = (xxh32(descriptor,2) >> 8) & 0xff
     };
 #pragma pack(pop)
 
+// stream formats known at compile time, see basic_lz4_decompressor
+struct autodetect_format    { static const bool autodetect = true;  static const bool lz4s = false; };
+struct legacy_format        { static const bool autodetect = false; static const bool lz4s = false; };
+struct frame_format         { static const bool autodetect = false; static const bool lz4s = true;  };
+
+// LZ4S block and content checksums: ignored, or verified when present
+struct skip_checksums       { static const bool verify = false; };
+struct verify_checksums     { static const bool verify = true;  };
+
+// largest possible LZ4S header: magic, FLG, BD, content size, dictID, HC
+const unsigned int lz4s_max_header_size = 4 + 2 + 8 + 4 + 1;
+
+// xxHash32, used by the LZ4S format for header, block and content checksums
+struct xxh32_state
+    {
+        uint64_t total_len;
+        uint32_t v[4];
+        uint32_t mem[4];
+        uint32_t memsize;
+        uint32_t seed;
+    };
+
+BOOST_IOSTREAMS_DECL void     xxh32_reset(xxh32_state& state, uint32_t seed = 0);
+BOOST_IOSTREAMS_DECL void     xxh32_update(xxh32_state& state, const void* data, size_t size);
+BOOST_IOSTREAMS_DECL uint32_t xxh32_digest(const xxh32_state& state);
+BOOST_IOSTREAMS_DECL uint32_t xxh32(const void* data, size_t size, uint32_t seed = 0);
+
+// in-place block decoding: a block of up to compressed_size bytes, put
+// at the very end of a buffer of in_place_buffer_size() bytes, decodes
+// to the start of that same buffer (LZ4_DECOMPRESS_INPLACE_MARGIN of lz4.h)
+inline size_t in_place_buffer_size(size_t max_decoded_size, size_t compressed_size)
+    {
+    return std::max(max_decoded_size, compressed_size) + (compressed_size >> 8) + 32;
+    }
+
+// what memory_budget leaves for the block buffers once the decoder's
+// input buffer is counted, 0 (no limit) for no budget; throws
+// std::invalid_argument when it leaves nothing
+inline size_t block_budget(size_t memory_budget, size_t input_buffer_size)
+    {
+    if (memory_budget && memory_budget <= input_buffer_size)
+        throw std::invalid_argument("lz4: memory budget below the input buffer size");
+    return memory_budget ? memory_budget - input_buffer_size : 0;
+    }
+
+// one-shot in-place decoding of a raw lz4 block (no size field, no frame)
+// held in the last compressed_size bytes of buffer; returns the decoded
+// size, at most max_decoded_size. Throws std::runtime_error on bad data.
+BOOST_IOSTREAMS_DECL size_t decompress_in_place(char* buffer, size_t buffer_size,
+                                                size_t compressed_size,
+                                                size_t max_decoded_size);
+
+//
+// Class name: latency_histogram
+// Description: Log-linear histogram of block latencies in nanoseconds,
+//      16 sub-buckets per power of two (< 6.25% error), in the manner of
+//      HdrHistogram. Filters record into it when one is attached with
+//      set_latency_histogram(); not synchronized, one per thread.
+//
+class BOOST_IOSTREAMS_DECL latency_histogram
+    {
+    public:
+        latency_histogram() { reset(); }
+
+        void record(uint64_t ns);
+        void reset();
+        uint64_t count() const { return m_count; }
+        uint64_t max() const { return m_max; }
+        // upper bound of the bucket holding the p-th percentile, p in [0, 100]
+        uint64_t percentile(double p) const;
+    private:
+        static const unsigned sub_buckets = 16;
+        uint64_t m_counts[64 * sub_buckets];
+        uint64_t m_count, m_max;
+    };
+
+//
+// Class name: executor
+// Description: Work-stealing thread pool shared by many compression
+//      streams. Each stream queues its tasks in an executor::stream;
+//      workers take one task of a stream at a time and put the stream
+//      back at the end of their queue, so streams are served round-robin
+//      and a big one cannot starve the others, while idle workers steal
+//      streams from busy ones. Tasks must not throw.
+//
+class BOOST_IOSTREAMS_DECL executor
+    {
+    public:
+        typedef std::function<void()> task;
+        class stream;
+
+        // threads == 0: one per hardware thread
+        explicit executor(unsigned threads = 0);
+        ~executor();    // runs the queued tasks, then joins
+
+        // the process-wide instance, started on first use
+        static executor& shared();
+        unsigned size() const;
+    private:
+        struct impl;
+        struct stream_state;
+        executor(const executor&);
+        executor& operator=(const executor&);
+
+        std::unique_ptr<impl> pimpl_;
+    };
+
+//
+// Class name: executor::stream
+// Description: Task queue of one stream. submit() blocks while
+//      max_in_flight tasks of the stream are queued or running.
+//
+class BOOST_IOSTREAMS_DECL executor::stream
+    {
+    public:
+        explicit stream(executor& ex, unsigned max_in_flight = 4);
+        ~stream();      // waits for the tasks of the stream
+
+        void submit(task t);
+        // waits until every submitted task has run
+        void wait();
+    private:
+        stream(const stream&);
+        stream& operator=(const stream&);
+
+        executor& m_executor;
+        std::shared_ptr<stream_state> m_state;
+    };
+
+} // namespace lz4
+
+//
+// Class name: lz4_params.
+// Description: Encapsulates the parameters passed to lz4_compressor
+//      to customize compression.
+//
+struct lz4_params
+    {
+    // Non-explicit constructor.
+    lz4_params( lz4::stream_format format = lz4::legacy,
+                std::streamsize    content_size = -1 )
+        : format(format), block_size_id(7), block_checksum(false),
+          content_checksum(true), content_size(content_size),
+          linked_blocks(false), chunk_min_size(0), chunk_avg_size(0), chunk_max_size(0),
+          max_buffered(0), min_block_size(0), max_age_ms(0), executor(0), max_in_flight(4)
+        { }
+    lz4::stream_format format;
+    unsigned int       block_size_id;       // LZ4S only: 4..7 => 64 KB .. 4 MB blocks
+    bool               block_checksum;      // LZ4S only: xxh32 after each block
+    bool               content_checksum;    // LZ4S only: xxh32 of all data after the end mark
+    std::streamsize    content_size;        // LZ4S only: written to the header when >= 0
+    // LZ4S only: each block is compressed with the last lz4::dict_size
+    // bytes of input before it as dictionary, and the frame is flagged
+    // as having linked blocks. Better ratio for small blocks; with an
+    // executor the blocks are still compressed in parallel, as the
+    // dictionary is raw input.
+    bool               linked_blocks;
+
+    // Content-defined blocks, on when chunk_avg_size > 0: a block ends
+    // where a rolling hash of the last 64 bytes of input says so, not at
+    // a fixed size, so data inserted or removed only changes the blocks
+    // around it; the other blocks come out byte for byte the same
+    // wherever they are in the stream (linked blocks: if the 64 KB before
+    // them are the same too). Not in streaming mode.
+    std::size_t        chunk_min_size;      // 0 = a quarter of chunk_avg_size
+    std::size_t        chunk_avg_size;      // >= 64, rounded down to a power of 2
+    std::size_t        chunk_max_size;      // 0 = 4 * chunk_avg_size; at most a block
+
+    // Streaming mode, on when max_buffered > 0: input is kept until
+    // max_buffered bytes are there, and a stream flush() emits it as a
+    // block only if it has min_block_size bytes, its oldest byte is older
+    // than max_age_ms (0 = no deadline), or sync_flush() was called.
+    std::streamsize    max_buffered;        // <= lz4::legacy_blocksize
+    std::streamsize    min_block_size;
+    unsigned int       max_age_ms;
+
+    // Blocks are compressed by executor threads when set (not in
+    // streaming mode), with at most max_in_flight blocks of this stream
+    // queued or compressing; output keeps the input order.
+    lz4::executor*     executor;            // e.g. &lz4::executor::shared()
+    unsigned int       max_in_flight;
+    };
+
+namespace lz4 {
+
+// stream header for params: legacy_magic, or the LZ4S magic and frame
+// descriptor. dst needs lz4s_max_header_size bytes; returns the bytes
+// written
+BOOST_IOSTREAMS_DECL size_t encode_header(const lz4_params& params, char* dst);
+
+// most bytes encode_block() writes for src_size bytes
+inline size_t encoded_block_bound(size_t src_size)
+    {
+    return 4 + LZ4_COMPRESSBOUND(src_size) + 4;
+    }
+
+// one block as params.format has it in a stream: size field, then the
+// lz4 data or, for an LZ4S block that does not shrink, the block itself
+// with the high bit of the size set, then its xxh32 if block_checksum.
+// Matches may reach into the dict_size bytes of dict, the data before
+// src. Returns the bytes written; throws std::runtime_error if a legacy
+// block fails.
+BOOST_IOSTREAMS_DECL size_t encode_block(const lz4_params& params, const char* src,
+                                         size_t src_size, char* dst,
+                                         const char* dict = 0, size_t dict_size = 0);
+
 } // namespace lz4
 
+//
+// Class name: lz4_checkpoint
+// Description: Where a decoder stands between two blocks: enough to go on
+//      decoding from compressed_offset of the stream, as read from its
+//      start, without what comes before. Output resumes at decoded_offset.
+//      A few dozen bytes, plus the last 64 KB decoded for linked blocks.
+//
+struct lz4_checkpoint
+    {
+    lz4_checkpoint() : compressed_offset(0), decoded_offset(0), frame_decoded(0)
+        { lz4::xxh32_reset(content_xxh); }
+    uint64_t          compressed_offset;
+    uint64_t          decoded_offset;
+    std::vector<char> header;           // of the current stream, empty between streams
+    uint64_t          frame_decoded;    // LZ4S: bytes decoded in the current frame
+    lz4::xxh32_state  content_xxh;      // LZ4S: content checksum so far, when verified
+    std::vector<char> dict;             // linked LZ4S blocks: the data the next block refers to
+    };
+
+// checkpoints as bytes, to be kept outside the process
+BOOST_IOSTREAMS_DECL void           save_checkpoint(std::ostream& out, const lz4_checkpoint& cp);
+BOOST_IOSTREAMS_DECL lz4_checkpoint load_checkpoint(std::istream& in);
+
+class lz4_buffer_pool;
+
 namespace detail
 {
 
+// resize() leaves new elements uninitialized: block buffers are written
+// by the decoder before they are read
+template<typename T>
+struct uninitialized_allocator : std::allocator<T>
+    {
+    template<typename U> struct rebind { typedef uninitialized_allocator<U> other; };
+    uninitialized_allocator() { }
+    template<typename U> uninitialized_allocator(const uninitialized_allocator<U>&) { }
+    template<typename U> void construct(U* p) { ::new((void*)p) U; }
+    template<typename U, typename... Args> void construct(U* p, Args&&... args)
+        { ::new((void*)p) U(std::forward<Args>(args)...); }
+    };
+
 class BOOST_IOSTREAMS_DECL lz4_base
     {
     public:
         typedef char char_type; // required for boost
 //        bool good(){ return !m_fail; };
 
+        // decoded size from the LZ4S header, -1 if the stream does not
+        // carry it or the header was not parsed yet
+        std::streamsize content_size() const { return m_content_size; }
+        // true once the stream header was parsed
+        bool header_done() const { return m_was_header; }
+        // streaming mode: emit buffered input as a block at the next
+        // flush(), whatever its size, without ending the stream
+        void sync_flush() { m_sync_flush = true; }
+        // block (de)coding latencies go to histogram, none if 0
+        void set_latency_histogram(lz4::latency_histogram* histogram) { m_latency = histogram; }
+        // decoding: blocks that can not go straight to the caller's
+        // output are read into the end of the output block buffer and
+        // decoded where they are, instead of into a second buffer;
+        // to be set before the first block
+        void set_in_place(bool in_place) { m_in_place = in_place; }
+        // decoding: most bytes the block buffers held at once so far
+        std::size_t memory_peak() const { return m_memory_peak; }
+        // decoding: an output range of at least size bytes, though smaller
+        // than a full block, gets the next block decoded straight into it
+        // if it is expected to fit (the previous block's ratio tells),
+        // instead of through m_out_buf; a block that does not fit after
+        // all is decoded again there. lz4::direct_min_size by default
+        void set_direct_min(std::size_t size) { m_direct_min = size; }
+        // decoding: the state after the last block whose decoded bytes
+        // are all output; false after a failure
+        bool checkpoint(lz4_checkpoint& cp) const;
+        // decoding: goes on from cp, the input from cp.compressed_offset
+        // on is what comes next
+        void restore(const lz4_checkpoint& cp);
+        // decoding: between two blocks with nothing staged, gives the
+        // block buffers to the buffer pool (frees them without one) until
+        // the next call decodes on; false if data is staged
+        bool trim();
+        // decoding: trim() at the end of every call that consumed its
+        // input, i.e. once the stream waits for more
+        void set_auto_trim(bool auto_trim) { m_auto_trim = auto_trim; }
+        void set_buffer_pool(lz4_buffer_pool* pool) { m_pool = pool; }
+        // true while the block buffers are given away
+        bool trimmed() const { return m_trimmed; }
+
     private:
+        lz4_params m_params;
         bool m_was_header;
         bool m_fail;
         uint32_t m_bytes_needed;
         lz4::lz4s_file_header m_lz4s_header;
         bool m_lz4s;
-        std::vector <char> m_in_buf, m_out_buf;
+        std::vector <char, uninitialized_allocator<char> > m_in_buf;
+        std::vector <char, uninitialized_allocator<char> > m_out_buf;
         bool m_waitblockstart;
+        bool m_frame_end;
         uint32_t m_block_size;
         bool m_block_uncompressed;
         uint32_t m_block_uncompressed_max = 0;
+        std::streamsize m_content_size;
+        uint64_t m_total;       // uncompressed bytes (de)compressed so far
+        lz4::xxh32_state m_content_xxh;
+        bool m_sync_flush;
+        std::chrono::steady_clock::time_point m_buffered_since;
+        lz4::latency_histogram* m_latency;
+        bool m_in_place;
+        bool m_staging_in_place;    // m_out_buf holds a block being read, not output
+        uint32_t m_stage_pos;       // where the next block bytes go in m_out_buf
+        std::size_t m_memory_budget;    // decoding: block buffers limit, 0 = none
+        std::size_t m_out_limit;        // decoded bytes kept before reading the next block
+        std::size_t m_memory_peak;
+        std::size_t m_direct_min;
+        bool m_direct_missed;           // the current block did not fit the output
+        uint32_t m_last_in, m_last_out; // sizes of the last block decoded
+        bool m_linked;                  // LZ4S blocks refer to the ones before them
+        std::vector<char> m_dict;       // the last lz4::dict_size bytes (de)compressed
+        uint64_t m_in_offset;           // compressed bytes up to the last block decoded
+        uint64_t m_decoded_base;        // decoded bytes of the streams before this one
+        std::vector<char> m_header;     // of the current stream, as read
+        std::deque<lz4_checkpoint> m_staged_states; // before blocks decoded into m_out_buf
+        lz4_buffer_pool* m_pool;
+        bool m_auto_trim;
+        bool m_trimmed;
+        std::size_t m_in_capacity, m_out_capacity;  // of the block buffers given away
+        std::size_t m_chunk_min, m_chunk_avg, m_chunk_max;  // content-defined blocks, 0 = off
+        uint64_t m_chunk_mask_small, m_chunk_mask_large;    // before / after the average size
+        uint64_t m_chunk_hash;
+        std::size_t m_chunk_size;       // input of the current chunk seen so far
+        bool m_chunk_done;              // m_in_buf holds a whole chunk
+        struct parallel_block;
+        std::shared_ptr<lz4::executor::stream> m_stream;
+        std::deque<std::shared_ptr<parallel_block> > m_blocks;  // in output order
 
         bool decompress_int_buf(const char*&, const char*, char*&, char*, bool);
         bool decompress_ext_buf(const char*&, const char*, char*&, char*, bool);
-        int  lz4_decompress(const char*, char*, int, int x = lz4::legacy_blocksize);
+        int  lz4_decompress(const char*, char*, int, int x = lz4::legacy_blocksize, bool may_overflow = false);
+        template<typename Checksum>
+        int  lz4s_decode_block(const char*, char*, int, bool may_overflow = false);
+        template<typename Checksum>
+        bool decode_direct(const char* block, uint32_t size, char*& dst_begin, char* dst_end, int path);
+        bool direct_likely(uint32_t size, std::ptrdiff_t capacity) const;
+        void lz4s_end_of_frame();
+        void stage_input(const char* src, uint32_t size);
+        void stage_in_place(uint32_t size, uint32_t checksum_size = 0);
+        void plan_memory();
+        void track_memory();
+        void keep_dict(const char* data, std::size_t size);
+        void save_state(lz4_checkpoint& cp) const;
+        void stage_state(bool out_empty);
+        void wake();
         void _write_decompressed_buf(char*&dst_begin, char*dst_end);
 
+        bool compress_filter_header(char*& dst_begin, char* dst_end);
+        bool compress_filter_legacy(const char*& src_begin, const char* src_end,
+                                    char*& dst_begin, char* dst_end);
+        bool compress_filter_lz4s(const char*& src_begin, const char* src_end,
+                                  char*& dst_begin, char* dst_end);
+        bool compress_filter_end(char*& dst_begin, char* dst_end);
+        bool compress_filter_stream(const char*& src_begin, const char* src_end,
+                                    char*& dst_begin, char* dst_end, bool flush);
+        bool compress_buffered(char*& dst_begin, char* dst_end);
+        bool chunk_boundary(const char* src, std::size_t size, std::size_t& amt);
+        bool compress_filter_chunked(const char*& src_begin, const char* src_end,
+                                     char*& dst_begin, char* dst_end, bool flush);
+        bool compress_filter_parallel(const char*& src_begin, const char* src_end,
+                                      char*& dst_begin, char* dst_end, bool flush);
+        void submit_block();
+        bool emit_blocks(char*& dst_begin, char* dst_end, bool wait);
         bool decompress_filter_input_legacy(const char*& src_begin, const char* src_end,
                                  char*& dst_begin, char* dst_end);
+        template<typename Checksum>
         bool decompress_filter_input_lz4s(const char*& src_begin, const char* src_end,
                                  char*& dst_begin, char* dst_end);
         bool decompress_filter_output(char*& dst_begin, char* dst_end);
-        bool decompress_filter_header(const char*& src_begin, const char* src_end, bool flush);
+        std::chrono::steady_clock::time_point block_start(int path, std::size_t size);
+        void block_done(std::chrono::steady_clock::time_point start, int path,
+                        std::size_t in_size, std::size_t out_size);
     protected:
-        lz4_base();
+        // memory_budget: decoding only, see basic_lz4_decompressor
+        explicit lz4_base(const lz4_params& params = lz4_params(), std::size_t memory_budget = 0);
         ~lz4_base();
         void init( bool compress );
         void reset(bool compress, bool realloc);
         bool compress_filter(const char*&, const char*, char*&, char*, bool);
+        bool compress_sync(char*& dst_begin, char* dst_end);
+        bool streaming() const { return m_params.max_buffered > 0; }
+        bool decompress_filter(const char*&, const char*, char*&, char*, bool);
+        // the block loop specialized for one stream format and checksum
+        // policy, instantiated in lz4_filter.cpp for the lz4:: tags only
+        template<typename Format, typename Checksum>
         bool decompress_filter(const char*&, const char*, char*&, char*, bool);
+        bool decompress_filter_header(const char*& src_begin, const char* src_end, bool flush);
+        std::streamsize decompress_peek(const char* src_begin, const char* src_end,
+                                        char* dst_begin, char* dst_end, std::size_t& needed);
     };
 
 //
@@ -102,11 +507,15 @@ class lz4_compressor_impl : public lz4_base
     {
     private:
     public:
-        lz4_compressor_impl();
+        explicit lz4_compressor_impl(const lz4_params& params = lz4_params());
         ~lz4_compressor_impl();
         bool filter( const char*& src_begin, const char* src_end,
                      char*& dest_begin, char* dest_end, bool flush );
+        template<typename Sink>
+        bool flush( Sink& snk );
         void close();
+    private:
+        std::vector<char, Alloc> m_flush_buf;
     };
 
 //
@@ -114,19 +523,56 @@ class lz4_compressor_impl : public lz4_base
 // Description: Model of C-Style Filter implementing decompression by
 //      delegating to the lz4 function inflate.
 //
-template<typename Alloc = std::allocator<char> >
+template<typename Alloc = std::allocator<char>,
+         typename Format = lz4::autodetect_format,
+         typename ChecksumPolicy = lz4::skip_checksums>
 class lz4_decompressor_impl : public lz4_base
     {
     public:
-        lz4_decompressor_impl();
+        explicit lz4_decompressor_impl(std::size_t memory_budget = 0);
         ~lz4_decompressor_impl();
         bool filter( const char*& begin_in, const char* end_in,
                      char*& begin_out, char* end_out, bool flush );
+        bool header( const char*& begin_in, const char* end_in, bool flush );
+        std::streamsize peek( const char* begin_in, const char* end_in,
+                              char* begin_out, char* end_out, std::size_t& needed );
         void close();
     };
 
 } // namespace detail
 
+//
+// Class name: lz4_buffer_pool
+// Description: Block buffers of idle decoders (see lz4_base::trim()),
+//      kept for whichever decoder goes on first instead of each stream
+//      holding its own. Up to max_bytes of capacity is kept, buffers
+//      beyond are freed. Thread-safe.
+//
+class BOOST_IOSTREAMS_DECL lz4_buffer_pool
+    {
+    public:
+        typedef std::vector<char, detail::uninitialized_allocator<char> > buffer;
+
+        explicit lz4_buffer_pool(std::size_t max_bytes = 256*1024*1024);
+        ~lz4_buffer_pool();
+
+        // the process-wide instance
+        static lz4_buffer_pool& shared();
+        // an empty buffer with room for at least capacity bytes: the
+        // smallest one kept that is large enough, or a new one
+        buffer take(std::size_t capacity);
+        // keeps the memory of b, which is left without any
+        void give(buffer& b);
+        // capacity kept
+        std::size_t size() const;
+    private:
+        struct impl;
+        lz4_buffer_pool(const lz4_buffer_pool&);
+        lz4_buffer_pool& operator=(const lz4_buffer_pool&);
+
+        std::unique_ptr<impl> pimpl_;
+    };
+
 using namespace ::boost::iostreams;
 
 //
@@ -141,16 +587,30 @@ struct basic_lz4_compressor : symmetric_filter<detail::lz4_compressor_impl<Alloc
         typedef detail::lz4_compressor_impl<Alloc>  impl_type;
         typedef symmetric_filter<impl_type, Alloc>  base_type;
     public:
-        struct category : dual_use, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag { };
+        struct category : dual_use, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag, flushable_tag { };
         std::streamsize optimal_buffer_size() const 
             { 
             // boost will try to feed us with blocks of data of this size
-            return lz4::legacy_blocksize; 
+            return m_optimal_buffer_size; 
             }
 
         typedef typename base_type::char_type               char_type;
 //        typedef typename base_type::category                category;
-        basic_lz4_compressor();
+        basic_lz4_compressor( const lz4_params& = lz4_params(),
+                              std::streamsize buffer_size = default_buffer_size );
+        static const std::streamsize default_buffer_size =
+            4 + sizeof(lz4::legacy_magic) + LZ4_COMPRESSBOUND(lz4::legacy_blocksize);
+
+        // stream flush point: in streaming mode emits buffered input
+        // when lz4_params say so
+        template<typename Sink>
+        bool flush(Sink& snk) { return this->filter().flush(snk); }
+        // next flush() emits buffered input whatever its size
+        void sync_flush() { this->filter().sync_flush(); }
+        void set_latency_histogram(lz4::latency_histogram* histogram)
+            { this->filter().set_latency_histogram(histogram); }
+    private:
+        std::streamsize m_optimal_buffer_size;
     };
 BOOST_IOSTREAMS_PIPABLE(basic_lz4_compressor, 1)
 
@@ -160,28 +620,311 @@ typedef basic_lz4_compressor<> lz4_compressor;
 // Template name: lz4_decompressor
 // Description: Model of InputFilter and OutputFilter implementing
 //      decompression using lz4.
+//      Format is lz4::autodetect_format (legacy or LZ4S, told by the magic),
+//      or lz4::legacy_format / lz4::frame_format to compile the block loop
+//      for that format alone; other streams are rejected.
+//      ChecksumPolicy is lz4::skip_checksums or lz4::verify_checksums.
 //
-template<typename Alloc = std::allocator<char> >
-struct basic_lz4_decompressor : symmetric_filter<detail::lz4_decompressor_impl<Alloc>, Alloc>
+template<typename Alloc = std::allocator<char>,
+         typename Format = lz4::autodetect_format,
+         typename ChecksumPolicy = lz4::skip_checksums>
+struct basic_lz4_decompressor
+    : symmetric_filter<detail::lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>, Alloc>
     {
     private:
-        typedef detail::lz4_decompressor_impl<Alloc> impl_type;
+        typedef detail::lz4_decompressor_impl<Alloc, Format, ChecksumPolicy> impl_type;
         typedef symmetric_filter<impl_type, Alloc>   base_type;
     public:
         struct category : dual_use, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag { };
         std::streamsize optimal_buffer_size() const
             { 
             // filter output buffer will be of this size
-            return lz4::legacy_blocksize;
+            // (whole blocks decoded there are never staged)
+            return m_memory_budget || m_pool ? lz4::multichar_buffer_size : lz4::legacy_blocksize;
             }
 
         typedef typename base_type::char_type        char_type;
 //        typedef typename base_type::category         category;
-        basic_lz4_decompressor( );
+        // memory_budget: bytes for the input buffer and the block buffers,
+        // 0 = no limit. Within it the decoder keeps fewer decoded bytes
+        // before reading on, or decodes in place (see set_in_place()),
+        // and rejects streams whose blocks do not fit at all.
+        // pool: for many mostly idle streams; the input buffer is small
+        // and the block buffers go to the pool whenever the stream waits
+        // for input between two blocks (see lz4_base::trim())
+        explicit basic_lz4_decompressor( std::size_t memory_budget = 0,
+                                         lz4_buffer_pool* pool = 0 );
+
+        // decoded size from the LZ4S header, -1 if unknown (yet)
+        std::streamsize content_size() { return this->filter().content_size(); }
+        // most bytes held at once so far, input buffer included
+        std::size_t memory_peak()
+            { return this->filter().memory_peak() + input_buffer_size(m_memory_budget, m_pool); }
+        void set_latency_histogram(lz4::latency_histogram* histogram)
+            { this->filter().set_latency_histogram(histogram); }
+        // roughly halves the memory held per stream, see lz4_base
+        void set_in_place(bool in_place) { this->filter().set_in_place(in_place); }
+        void set_direct_min(std::size_t size) { this->filter().set_direct_min(size); }
+        // see lz4_base; restore() before the first read, from a source
+        // positioned at cp.compressed_offset
+        bool checkpoint(lz4_checkpoint& cp) { return this->filter().checkpoint(cp); }
+        void restore(const lz4_checkpoint& cp) { this->filter().restore(cp); }
+        // see lz4_base
+        bool trim() { return this->filter().trim(); }
+        void set_auto_trim(bool auto_trim) { this->filter().set_auto_trim(auto_trim); }
+    private:
+        static std::streamsize input_buffer_size(std::size_t memory_budget, lz4_buffer_pool* pool)
+            {
+            // a whole legacy block, unless memory is counted
+            return memory_budget || pool ? lz4::multichar_buffer_size
+                : 4 + sizeof(lz4::legacy_magic) + LZ4_COMPRESSBOUND(lz4::legacy_blocksize);
+            }
+        std::size_t m_memory_budget;
+        lz4_buffer_pool* m_pool;
     };
-BOOST_IOSTREAMS_PIPABLE(basic_lz4_decompressor, 1)
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_decompressor, 3)
 
 typedef basic_lz4_decompressor<> lz4_decompressor;
+typedef basic_lz4_decompressor<std::allocator<char>, lz4::legacy_format> lz4_legacy_decompressor;
+typedef basic_lz4_decompressor<std::allocator<char>, lz4::frame_format>  lz4_frame_decompressor;
+
+//
+// Template name: lz4_multichar_compressor
+// Description: Model of OutputFilter implementing compression using lz4
+//      without symmetric_filter buffering: whole blocks are compressed
+//      straight from the caller's write() buffer, only the remainder is
+//      staged until the next call.
+//
+template<typename Alloc = std::allocator<char> >
+class basic_lz4_multichar_compressor
+    {
+    private:
+        typedef detail::lz4_compressor_impl<Alloc> impl_type;
+        struct impl;
+    public:
+        typedef char char_type;
+        struct category : output, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag { };
+        std::streamsize optimal_buffer_size() const
+            {
+            // a full block per write() call hits the direct path
+            return lz4::legacy_blocksize;
+            }
+
+        explicit basic_lz4_multichar_compressor(const lz4_params& = lz4_params());
+
+        template<typename Sink>
+        std::streamsize write(Sink& snk, const char_type* s, std::streamsize n);
+        template<typename Sink>
+        void close(Sink& snk);
+        void set_latency_histogram(lz4::latency_histogram* histogram)
+            { pimpl_->set_latency_histogram(histogram); }
+    private:
+        template<typename Sink>
+        void write_block(Sink& snk, const char_type* begin, const char_type* end, bool flush);
+
+        ::boost::shared_ptr<impl> pimpl_;
+    };
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_multichar_compressor, 1)
+
+typedef basic_lz4_multichar_compressor<> lz4_multichar_compressor;
+
+//
+// Template name: lz4_multichar_decompressor
+// Description: Model of InputFilter implementing decompression using lz4
+//      without symmetric_filter buffering: blocks are decoded straight
+//      into the caller's read() buffer when it can hold a whole block.
+//
+template<typename Alloc = std::allocator<char> >
+class basic_lz4_multichar_decompressor
+    {
+    private:
+        typedef detail::lz4_decompressor_impl<Alloc> impl_type;
+        struct impl;
+    public:
+        typedef char char_type;
+        struct category : input, filter_tag, multichar_tag, closable_tag, optimally_buffered_tag { };
+        std::streamsize optimal_buffer_size() const
+            {
+            // a read() of at least a block is decoded without staging
+            return lz4::legacy_blocksize;
+            }
+
+        // memory_budget: as for basic_lz4_decompressor, buffer_size included
+        explicit basic_lz4_multichar_decompressor(std::streamsize buffer_size = lz4::multichar_buffer_size,
+                                                  std::size_t memory_budget = 0);
+
+        template<typename Source>
+        std::streamsize read(Source& src, char_type* s, std::streamsize n);
+        template<typename Source>
+        void close(Source& src);
+
+        // parses the stream header without decoding anything and returns
+        // the decoded size stored there, -1 if the stream does not carry it
+        template<typename Source>
+        std::streamsize content_size(Source& src);
+
+        // decodes at most n first bytes of the first block, and no more,
+        // into s; the compressed block stays buffered, so read() goes on
+        // from the start of the stream without reading src again.
+        // Only possible before the first read().
+        template<typename Source>
+        std::streamsize peek(Source& src, char_type* s, std::streamsize n);
+        void set_latency_histogram(lz4::latency_histogram* histogram)
+            { pimpl_->set_latency_histogram(histogram); }
+        void set_in_place(bool in_place) { pimpl_->set_in_place(in_place); }
+        // read() sizes from this up to a block decode without a copy,
+        // see lz4_base
+        void set_direct_min(std::size_t size) { pimpl_->set_direct_min(size); }
+        std::size_t memory_peak() const { return pimpl_->memory_peak() + pimpl_->in_buf.size(); }
+
+        // the state after the last block read() handed out in full,
+        // see lz4_base
+        bool checkpoint(lz4_checkpoint& cp) const { return pimpl_->checkpoint(cp); }
+        // see lz4_base; in_buf, of buffer_size, is kept
+        bool trim() { return pimpl_->trim(); }
+        void set_auto_trim(bool auto_trim) { pimpl_->set_auto_trim(auto_trim); }
+        void set_buffer_pool(lz4_buffer_pool* pool) { pimpl_->set_buffer_pool(pool); }
+        // seeks src to cp.compressed_offset and goes on from there
+        template<typename Source>
+        void restore(Source& src, const lz4_checkpoint& cp);
+    private:
+        template<typename Source>
+        bool fill(Source& src);
+        template<typename Source>
+        bool fill_at_least(Source& src, std::size_t size);
+
+        ::boost::shared_ptr<impl> pimpl_;
+    };
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_multichar_decompressor, 1)
+
+typedef basic_lz4_multichar_decompressor<> lz4_multichar_decompressor;
+
+//
+// Class name: lz4_file_source
+// Description: Model of Source reading lz4 compressed data from a file.
+//      read() decodes straight into the caller's buffer when it can hold
+//      a whole block.
+//
+class lz4_file_source
+    {
+    public:
+        typedef char char_type;
+        struct category : source_tag, closable_tag { };
+
+        explicit lz4_file_source(const std::string& path,
+                                 std::streamsize buffer_size = lz4::multichar_buffer_size);
+
+        std::streamsize read(char_type* s, std::streamsize n);
+        bool is_open() const { return m_file.is_open(); }
+        void close();
+
+        // decoded size from the LZ4S header, -1 if the file does not carry it
+        std::streamsize content_size() { return m_filter.content_size(m_file); }
+        // the first n decoded bytes at most, see lz4_multichar_decompressor::peek
+        std::streamsize peek(char_type* s, std::streamsize n) { return m_filter.peek(m_file, s, n); }
+        // resumable reads of long files, see lz4_multichar_decompressor
+        bool checkpoint(lz4_checkpoint& cp) const { return m_filter.checkpoint(cp); }
+        void restore(const lz4_checkpoint& cp) { m_filter.restore(m_file, cp); }
+    private:
+        file_descriptor_source     m_file;
+        lz4_multichar_decompressor m_filter;
+    };
+
+//
+// Class name: lz4_file_sink
+// Description: Model of Sink writing lz4 compressed data to a file.
+//      write() compresses straight from the caller's buffer whole blocks
+//      at a time.
+//
+class lz4_file_sink
+    {
+    public:
+        typedef char char_type;
+        struct category : sink_tag, closable_tag { };
+
+        explicit lz4_file_sink(const std::string& path,
+                               const lz4_params& params = lz4_params(),
+                               BOOST_IOS::openmode mode = BOOST_IOS::trunc);
+
+        std::streamsize write(const char_type* s, std::streamsize n);
+        bool is_open() const { return m_file.is_open(); }
+        void close();
+    private:
+        file_descriptor_sink     m_file;
+        lz4_multichar_compressor m_filter;
+    };
+
+//
+// Class name: lz4_sparse_file_sink
+// Description: Model of Sink writing to a file where whole pages of
+//      zeros are not written: they are left as holes (punched out of data
+//      the file already had), so that decoded sparse images stay sparse:
+//
+//          out.push( lz4_decompressor() );
+//          out.push( lz4_sparse_file_sink(path) );
+//
+//      Zero blocks written by lz4_compressor are decoded with a memset,
+//      so restoring mostly empty images costs little more than a scan.
+//
+class BOOST_IOSTREAMS_DECL lz4_sparse_file_sink
+    {
+    public:
+        typedef char char_type;
+        struct category : sink_tag, closable_tag { };
+
+        explicit lz4_sparse_file_sink(const std::string& path,
+                                      BOOST_IOS::openmode mode = BOOST_IOS::trunc);
+        // an open file, written from its current offset (its end with
+        // O_APPEND); zeros are written out when it can not seek (pipe,
+        // terminal)
+        explicit lz4_sparse_file_sink(int fd, bool close_fd = false);
+
+        std::streamsize write(const char_type* s, std::streamsize n);
+        bool is_open() const;
+        void close();
+
+        // bytes left as holes so far
+        uint64_t skipped() const;
+    private:
+        struct impl;
+        ::boost::shared_ptr<impl> pimpl_;
+    };
+
+//
+// Class name: lz4_readahead_source
+// Description: Model of Source reading ahead from another Source on a
+//      background thread into a bounded queue of chunks, so that I/O on
+//      the compressed stream overlaps with decompression:
+//
+//          in.push( lz4_decompressor() );
+//          in.push( lz4_readahead_source(file) );
+//
+//      The wrapped Source is kept by reference and must outlive it.
+//
+class BOOST_IOSTREAMS_DECL lz4_readahead_source
+    {
+    public:
+        typedef char char_type;
+        struct category : source_tag, closable_tag { };
+
+        template<typename Source>
+        explicit lz4_readahead_source(Source& src,
+                                      unsigned int depth = 2,
+                                      std::streamsize chunk_size = lz4::readahead_chunk_size)
+            {
+            start([&src](char* s, std::streamsize n) { return ::boost::iostreams::read(src, s, n); },
+                  depth, chunk_size);
+            }
+
+        std::streamsize read(char_type* s, std::streamsize n);
+        void close();
+    private:
+        struct impl;
+        void start(const std::function<std::streamsize(char*, std::streamsize)>& reader,
+                   unsigned int depth, std::streamsize chunk_size);
+
+        ::boost::shared_ptr<impl> pimpl_;
+    };
 
 //----------------------------------------------------------------------------//
 
@@ -191,7 +934,8 @@ namespace detail
 //------------------Implementation of lz4_compressor_impl--------------------//
 
 template<typename Alloc>
-lz4_compressor_impl<Alloc>::lz4_compressor_impl()
+lz4_compressor_impl<Alloc>::lz4_compressor_impl(const lz4_params& params)
+    : lz4_base(params)
     {
     init(true);
     }
@@ -210,6 +954,29 @@ bool lz4_compressor_impl<Alloc>::filter
     return compress_filter(src_begin, src_end, dest_begin, dest_end, flush);
     }
 
+template<typename Alloc>
+template<typename Sink>
+bool lz4_compressor_impl<Alloc>::flush( Sink& snk )
+    {
+    if (!streaming())
+        return true;
+    // symmetric_filter has already passed everything it had to snk,
+    // so a block can be written there directly
+    if (m_flush_buf.empty())
+        m_flush_buf.resize(lz4::lz4s_max_header_size + 8 + LZ4_COMPRESSBOUND(lz4::legacy_blocksize));
+    bool again;
+    do
+        {
+        char* dst = m_flush_buf.data();
+        again = compress_sync(dst, m_flush_buf.data() + m_flush_buf.size());
+        std::streamsize amt = dst - m_flush_buf.data();
+        if (amt && ::boost::iostreams::write(snk, m_flush_buf.data(), amt) != amt)
+            return false;
+        }
+    while (again);
+    return true;
+    }
+
 template<typename Alloc>
 void lz4_compressor_impl<Alloc>::close()
     {
@@ -218,28 +985,44 @@ void lz4_compressor_impl<Alloc>::close()
 
 //------------------Implementation of lz4_decompressor_impl------------------//
 
-template<typename Alloc>
-lz4_decompressor_impl<Alloc>::lz4_decompressor_impl()
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::lz4_decompressor_impl(std::size_t memory_budget)
+    : lz4_base(lz4_params(), memory_budget)
     {
     init(false);
     }
 
-template<typename Alloc>
-lz4_decompressor_impl<Alloc>::~lz4_decompressor_impl()
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::~lz4_decompressor_impl()
     {
     reset(false, false);
     }
 
-template<typename Alloc>
-bool lz4_decompressor_impl<Alloc>::filter
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+bool lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::filter
 ( const char*& src_begin, const char* src_end, char*& dest_begin, char* dest_end, bool flush )
     {
-    // call a non-template version of filter, to avoid compiled code duplication
-    return decompress_filter(src_begin, src_end, dest_begin, dest_end, flush);
+    // call a non-template version of filter, to avoid compiled code duplication:
+    // there is one per format and checksum policy, not one per Alloc
+    return decompress_filter<Format, ChecksumPolicy>(src_begin, src_end, dest_begin, dest_end, flush);
     }
 
-template<typename Alloc>
-void lz4_decompressor_impl<Alloc>::close()
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+bool lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::header
+( const char*& src_begin, const char* src_end, bool flush )
+    {
+    return decompress_filter_header(src_begin, src_end, flush);
+    }
+
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+std::streamsize lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::peek
+( const char* src_begin, const char* src_end, char* dest_begin, char* dest_end, std::size_t& needed )
+    {
+    return decompress_peek(src_begin, src_end, dest_begin, dest_end, needed);
+    }
+
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+void lz4_decompressor_impl<Alloc, Format, ChecksumPolicy>::close()
     {
     reset(false, true);
     }
@@ -249,17 +1032,310 @@ void lz4_decompressor_impl<Alloc>::close()
 //------------------Implementation of lz4_decompressor-----------------------//
 
 template<typename Alloc>
-basic_lz4_compressor<Alloc>::basic_lz4_compressor() : 
-    base_type(4 + sizeof(lz4::legacy_magic) + LZ4_COMPRESSBOUND(lz4::legacy_blocksize))
+basic_lz4_compressor<Alloc>::basic_lz4_compressor
+    (const lz4_params& p, std::streamsize buffer_size) :
+    base_type(buffer_size, p),
+    m_optimal_buffer_size(p.max_buffered > 0 ? p.max_buffered : lz4::legacy_blocksize)
     {
     }
 
 //------------------Implementation of lz4_decompressor-----------------------//
 
+template<typename Alloc, typename Format, typename ChecksumPolicy>
+basic_lz4_decompressor<Alloc, Format, ChecksumPolicy>::basic_lz4_decompressor
+    (std::size_t memory_budget, lz4_buffer_pool* pool) :
+    base_type(input_buffer_size(memory_budget, pool),
+              lz4::block_budget(memory_budget, input_buffer_size(memory_budget, pool))),
+    m_memory_budget(memory_budget), m_pool(pool)
+    {
+    if (pool)
+        {
+        this->filter().set_buffer_pool(pool);
+        this->filter().set_auto_trim(true);
+        }
+    }
+
+//------------------Implementation of lz4_multichar_compressor--------------//
+
+template<typename Alloc>
+struct basic_lz4_multichar_compressor<Alloc>::impl : impl_type
+    {
+    explicit impl(const lz4_params& p) :
+        impl_type(p),
+        out_buf(lz4::lz4s_max_header_size + 4 + LZ4_COMPRESSBOUND(lz4::legacy_blocksize)) { }
+
+    std::vector<char, Alloc> stage;     // tail of input shorter than a block
+    std::vector<char, Alloc> out_buf;   // one compressed block
+    };
+
+template<typename Alloc>
+basic_lz4_multichar_compressor<Alloc>::basic_lz4_multichar_compressor(const lz4_params& p) :
+    pimpl_(new impl(p))
+    {
+    }
+
+template<typename Alloc>
+template<typename Sink>
+std::streamsize basic_lz4_multichar_compressor<Alloc>::write
+( Sink& snk, const char_type* s, std::streamsize n )
+    {
+    impl& c = *pimpl_;
+    const char_type *next_s = s, *end_s = s + n;
+    while (next_s != end_s)
+        {
+        if (c.stage.empty() && end_s - next_s >= (std::streamsize)lz4::legacy_blocksize)
+            {
+            // DIRECT PATH: compress a whole block from the caller's buffer
+            write_block(snk, next_s, next_s + lz4::legacy_blocksize, false);
+            next_s += lz4::legacy_blocksize;
+            continue;
+            }
+        std::streamsize amt = std::min<std::streamsize>(end_s - next_s,
+                                                        lz4::legacy_blocksize - c.stage.size());
+        c.stage.insert(c.stage.end(), next_s, next_s + amt);
+        next_s += amt;
+        if (c.stage.size() == lz4::legacy_blocksize)
+            {
+            write_block(snk, c.stage.data(), c.stage.data() + c.stage.size(), false);
+            c.stage.clear();
+            }
+        }
+    return n;
+    }
+
+template<typename Alloc>
+template<typename Sink>
+void basic_lz4_multichar_compressor<Alloc>::write_block
+( Sink& snk, const char_type* begin, const char_type* end, bool flush )
+    {
+    impl& c = *pimpl_;
+    bool again;
+    do
+        {
+        // LZ4S splits the input into several blocks,
+        // which may take more than one round
+        char* dst = c.out_buf.data();
+        again = c.filter(begin, end, dst, c.out_buf.data() + c.out_buf.size(), flush);
+
+        const char* next = c.out_buf.data();
+        while (next != dst)
+            {
+            std::streamsize amt = ::boost::iostreams::write(snk, next, dst - next);
+            if (amt <= 0)
+                throw std::runtime_error("lz4: cannot write compressed block");
+            next += amt;
+            }
+        }
+    while (again || begin != end);
+    }
+
+template<typename Alloc>
+template<typename Sink>
+void basic_lz4_multichar_compressor<Alloc>::close( Sink& snk )
+    {
+    impl& c = *pimpl_;
+    try {
+        // the last (short) block and the end of stream,
+        // or just the header on empty input
+        write_block(snk, c.stage.data(), c.stage.data() + c.stage.size(), true);
+    } catch (...) {
+        c.stage.clear();
+        c.close();
+        throw;
+    }
+    c.stage.clear();
+    c.close();
+    }
+
+//------------------Implementation of lz4_multichar_decompressor------------//
+
+template<typename Alloc>
+struct basic_lz4_multichar_decompressor<Alloc>::impl : impl_type
+    {
+    impl(std::streamsize buffer_size, std::size_t memory_budget) :
+        impl_type(lz4::block_budget(memory_budget, buffer_size)),
+        in_buf(buffer_size), ptr(0), end(0), eof(false), done(false)
+        {
+        }
+
+    std::vector<char, Alloc> in_buf;    // compressed data read from source
+    const char *ptr, *end;              // unconsumed part of in_buf
+    bool eof, done;
+    };
+
+template<typename Alloc>
+basic_lz4_multichar_decompressor<Alloc>::basic_lz4_multichar_decompressor(std::streamsize buffer_size,
+                                                                          std::size_t memory_budget) :
+    pimpl_(new impl(buffer_size, memory_budget))
+    {
+    }
+
+template<typename Alloc>
+template<typename Source>
+bool basic_lz4_multichar_decompressor<Alloc>::fill( Source& src )
+    {
+    impl& d = *pimpl_;
+    std::streamsize amt = ::boost::iostreams::read(src, d.in_buf.data(), d.in_buf.size());
+    d.ptr = d.end = d.in_buf.data();
+    if (amt == -1)
+        {
+        d.eof = true;
+        return true;
+        }
+    d.end += amt;
+    return amt != 0;
+    }
+
+template<typename Alloc>
+template<typename Source>
+std::streamsize basic_lz4_multichar_decompressor<Alloc>::read
+( Source& src, char_type* s, std::streamsize n )
+    {
+    impl& d = *pimpl_;
+    char_type *next_s = s, *end_s = s + n;
+    while (next_s != end_s && !d.done)
+        {
+        if (d.ptr == d.end && !d.eof && !fill(src))
+            break; // no more input without blocking
+
+        // the filter decodes straight into [next_s, end_s) whenever
+        // there is room for a whole block there, or likely room for
+        // the next one
+        if (!d.filter(d.ptr, d.end, next_s, end_s, d.eof))
+            d.done = true;
+        }
+    if (next_s == s && d.done)
+        return -1;
+    return next_s - s;
+    }
+
+template<typename Alloc>
+template<typename Source>
+std::streamsize basic_lz4_multichar_decompressor<Alloc>::content_size( Source& src )
+    {
+    impl& d = *pimpl_;
+    while (!d.header_done() && !d.done)
+        {
+        if (d.ptr == d.end && !d.eof && !fill(src))
+            break; // no more input without blocking
+        if (!d.header(d.ptr, d.end, d.eof) && d.eof)
+            d.done = true; // empty stream
+        }
+    return d.content_size();
+    }
+
+template<typename Alloc>
+template<typename Source>
+bool basic_lz4_multichar_decompressor<Alloc>::fill_at_least( Source& src, std::size_t size )
+    {
+    impl& d = *pimpl_;
+    std::size_t have = d.end - d.ptr;
+    if (have >= size)
+        return true;
+
+    // keep the unconsumed data, at the start of a buffer big enough
+    if (have)
+        memmove(d.in_buf.data(), d.ptr, have);
+    if (d.in_buf.size() < size)
+        d.in_buf.resize(size);
+    d.ptr = d.in_buf.data();
+    d.end = d.ptr + have;
+    while ((std::size_t)(d.end - d.ptr) < size && !d.eof)
+        {
+        std::streamsize amt = ::boost::iostreams::read(src, const_cast<char*>(d.end),
+                                                       d.in_buf.data() + d.in_buf.size() - d.end);
+        if (amt == -1)
+            d.eof = true;
+        else if (amt == 0)
+            return false; // would block
+        else
+            d.end += amt;
+        }
+    return (std::size_t)(d.end - d.ptr) >= size;
+    }
+
+template<typename Alloc>
+template<typename Source>
+std::streamsize basic_lz4_multichar_decompressor<Alloc>::peek
+( Source& src, char_type* s, std::streamsize n )
+    {
+    impl& d = *pimpl_;
+    content_size(src);
+    if (!d.header_done())
+        return d.done ? -1 : 0;
+
+    std::size_t needed = 0;
+    std::streamsize amt;
+    while ((amt = d.peek(d.ptr, d.end, s, s + n, needed)) < 0)
+        {
+        if (!fill_at_least(src, needed))
+            {
+            if (d.eof)
+                throw std::runtime_error("lz4: unexpected EOF");
+            return 0; // would block
+            }
+        }
+    return amt;
+    }
+
 template<typename Alloc>
-basic_lz4_decompressor<Alloc>::basic_lz4_decompressor() : 
-    base_type(4 + sizeof(lz4::legacy_magic) + LZ4_COMPRESSBOUND(lz4::legacy_blocksize))
+template<typename Source>
+void basic_lz4_multichar_decompressor<Alloc>::restore( Source& src, const lz4_checkpoint& cp )
+    {
+    impl& d = *pimpl_;
+    if (::boost::iostreams::seek(src, cp.compressed_offset, BOOST_IOS::beg, BOOST_IOS::in) !=
+        std::streampos((std::streamoff)cp.compressed_offset))
+        throw std::runtime_error("lz4: cannot seek to the checkpoint");
+    d.ptr = d.end = 0;
+    d.eof = d.done = false;
+    d.restore(cp);
+    }
+
+template<typename Alloc>
+template<typename Source>
+void basic_lz4_multichar_decompressor<Alloc>::close( Source& )
+    {
+    impl& d = *pimpl_;
+    d.ptr = d.end = 0;
+    d.eof = d.done = false;
+    d.close();
+    }
+
+//------------------Implementation of lz4_file_source------------------------//
+
+inline lz4_file_source::lz4_file_source(const std::string& path, std::streamsize buffer_size) :
+    m_file(path, BOOST_IOS::in | BOOST_IOS::binary), m_filter(buffer_size)
+    {
+    }
+
+inline std::streamsize lz4_file_source::read(char_type* s, std::streamsize n)
+    {
+    return m_filter.read(m_file, s, n);
+    }
+
+inline void lz4_file_source::close()
+    {
+    m_filter.close(m_file);
+    m_file.close();
+    }
+
+//------------------Implementation of lz4_file_sink--------------------------//
+
+inline lz4_file_sink::lz4_file_sink(const std::string& path, const lz4_params& params,
+                                    BOOST_IOS::openmode mode) :
+    m_file(path, mode | BOOST_IOS::out | BOOST_IOS::binary), m_filter(params)
+    {
+    }
+
+inline std::streamsize lz4_file_sink::write(const char_type* s, std::streamsize n)
+    {
+    return m_filter.write(m_file, s, n);
+    }
+
+inline void lz4_file_sink::close()
     {
+    m_filter.close(m_file);
+    m_file.close();
     }
 
 //----------------------------------------------------------------------------//
@@ -0,0 +1,295 @@
+#include "lz4_log.hpp"
+#include <boost/iostreams/device/file_descriptor.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace ext {
+namespace boost {
+namespace iostreams {
+
+//------------------Implementation of lz4_log_writer-------------------------//
+
+// The head word is the sequence number of the buffer being filled (high
+// 32 bits) and the bytes reserved in it so far (low 32 bits): a write()
+// swaps in the head with its size added, if its record still fits, and
+// knows at once both the buffer and where its record goes. The first
+// write() that finds no room closes the buffer by setting the offset to
+// block_size + 1, seals it and moves the head to the next buffer; the
+// writes that find it closed wait for that, then try the next one. The
+// offset never goes past block_size + 1, so it cannot carry into the
+// sequence number however many writes retry.
+// Buffer seq is buffers[seq % count], open for seq once the writer
+// thread wrote out seq - count.
+struct lz4_log_writer::impl {
+  struct buffer {
+    std::unique_ptr<char[]> data;
+    std::atomic<uint64_t> ready;      // the sequence number it is open for
+    std::atomic<uint64_t> sealed;     // that sequence number + 1 once sealed
+    std::atomic<uint64_t> committed;  // bytes copied in
+    uint64_t used;                    // bytes reserved before the seal
+  };
+
+  static const uint64_t offset_mask = 0xffffffff;
+
+  lz4_log_params params;
+  int fd;
+  bool close_fd;
+  std::unique_ptr<buffer[]> buffers;
+  std::atomic<uint64_t> head;
+  std::atomic<uint64_t> dropped, blocks;
+  std::atomic<bool> failed;
+
+  // writes only lock to wait: for a buffer, for the head to move on
+  std::mutex mutex;
+  std::condition_variable cv;  // sealed / written / stop
+  uint64_t written;            // buffers written out
+  bool stop;
+  std::exception_ptr error;
+  std::thread thread;
+
+  impl(int fd, bool close_fd, const lz4_log_params& params);
+  ~impl() { shutdown(); }
+
+  buffer& at(uint64_t seq) { return buffers[seq % params.buffers]; }
+  void wait_ready(buffer& b, uint64_t seq);
+  void wait_head(uint64_t seq);
+  void seal(uint64_t seq, uint64_t used);
+  uint64_t seal_head(bool if_old);
+  void check();
+  void run();
+  void shutdown();
+};
+
+lz4_log_writer::impl::impl(int fd, bool close_fd, const lz4_log_params& p)
+    : params(p), fd(fd), close_fd(close_fd), head(0), dropped(0), blocks(0),
+      failed(false), written(0), stop(false) {
+  const std::size_t max = params.output.format == lz4::frame
+                              ? lz4::lz4s_blocksize(params.output.block_size_id)
+                              : lz4::legacy_blocksize;
+  if (params.output.format == lz4::frame &&
+      (params.output.block_size_id < 4 || params.output.block_size_id > 7))
+    throw std::invalid_argument("lz4_log_writer: block_size_id must be 4..7");
+  if (!params.block_size || params.block_size > max)
+    throw std::invalid_argument("lz4_log_writer: block_size must fit a block");
+  if (params.buffers < 2)
+    throw std::invalid_argument("lz4_log_writer: at least 2 buffers");
+  params.output.max_buffered = params.block_size;
+  params.output.min_block_size = 0;
+  params.output.max_age_ms = 0;
+  params.output.executor = 0;
+  params.output.content_size = -1;
+  buffers.reset(new buffer[params.buffers]);
+  for (unsigned int i = 0; i < params.buffers; ++i) {
+    buffers[i].data.reset(new char[params.block_size]);
+    buffers[i].ready = i;
+    buffers[i].sealed = 0;
+    buffers[i].committed = 0;
+    buffers[i].used = 0;
+  }
+  thread = std::thread(&impl::run, this);
+}
+
+void lz4_log_writer::impl::check() {
+  if (failed.load(std::memory_order_acquire)) {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::rethrow_exception(error);
+  }
+}
+
+void lz4_log_writer::impl::wait_ready(buffer& b, uint64_t seq) {
+  if (b.ready.load(std::memory_order_acquire) == seq) return;
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&] { return b.ready.load(std::memory_order_acquire) == seq || error; });
+  if (error) std::rethrow_exception(error);
+}
+
+void lz4_log_writer::impl::wait_head(uint64_t seq) {
+  if ((head.load(std::memory_order_acquire) >> 32) != seq) return;
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&] { return (head.load(std::memory_order_acquire) >> 32) != seq || error; });
+  if (error) std::rethrow_exception(error);
+}
+
+// only called by whoever closed buffer seq; the head stays as it is
+// until then
+void lz4_log_writer::impl::seal(uint64_t seq, uint64_t used) {
+  buffer& b = at(seq);
+  wait_ready(b, seq);
+  b.used = used;
+  b.sealed.store(seq + 1, std::memory_order_release);
+  head.store((seq + 1) << 32, std::memory_order_release);
+  std::lock_guard<std::mutex> lock(mutex);
+  cv.notify_all();
+}
+
+// seals the buffer being filled, if it holds records when if_old is set;
+// returns its sequence number
+uint64_t lz4_log_writer::impl::seal_head(bool if_old) {
+  uint64_t h = head.load(std::memory_order_acquire);
+  do {
+    const uint64_t offset = h & offset_mask;
+    // closed already, by a write() or another flush
+    if ((if_old && offset == 0) || offset > params.block_size) return h >> 32;
+  } while (!head.compare_exchange_weak(h, (h & ~offset_mask) | (params.block_size + 1)));
+  seal(h >> 32, h & offset_mask);
+  return h >> 32;
+}
+
+void lz4_log_writer::impl::run() {
+  try {
+    lz4_compressor c(params.output);
+    ::boost::iostreams::filtering_ostream out;
+    out.push(c);
+    out.push(::boost::iostreams::file_descriptor_sink(
+        fd, ::boost::iostreams::never_close_handle));
+    out.exceptions(std::ios::badbit);
+    for (uint64_t next = 0;; ++next) {
+      buffer& b = at(next);
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (b.sealed.load(std::memory_order_acquire) != next + 1) {
+          if (stop) {
+            lock.unlock();
+            out.reset();  // end mark
+            if (params.fsync_blocks) ::fsync(fd);
+            return;
+          }
+          if (!params.max_age_ms) {
+            cv.wait(lock);
+          } else if (cv.wait_for(lock, std::chrono::milliseconds(params.max_age_ms)) ==
+                     std::cv_status::timeout) {
+            lock.unlock();
+            seal_head(true);
+            lock.lock();
+          }
+        }
+      }
+      // the last records may still be copied in
+      while (b.committed.load(std::memory_order_acquire) != b.used)
+        std::this_thread::yield();
+      if (b.used) {
+        out.write(b.data.get(), b.used);
+        c.sync_flush();
+        out.flush();
+        const uint64_t n = ++blocks;
+        if (params.fsync_blocks && n % params.fsync_blocks == 0 && ::fsync(fd) != 0)
+          throw std::runtime_error(std::string("lz4_log_writer: fsync: ") + strerror(errno));
+      }
+      b.committed.store(0, std::memory_order_relaxed);
+      std::lock_guard<std::mutex> lock(mutex);
+      b.ready.store(next + params.buffers, std::memory_order_release);
+      written = next + 1;
+      cv.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    error = std::current_exception();
+    failed = true;
+    cv.notify_all();
+  }
+}
+
+void lz4_log_writer::impl::shutdown() {
+  if (!thread.joinable()) return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    stop = true;
+    cv.notify_all();
+  }
+  thread.join();
+  if (close_fd) ::close(fd);
+}
+
+lz4_log_writer::lz4_log_writer(const std::string& path, const lz4_log_params& params) {
+  const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0666);
+  if (fd < 0) throw std::runtime_error("lz4: can not open " + path + ": " + strerror(errno));
+  try {
+    pimpl_.reset(new impl(fd, true, params));
+  } catch (...) {
+    ::close(fd);
+    throw;
+  }
+}
+
+lz4_log_writer::lz4_log_writer(int fd, const lz4_log_params& params, bool close_fd)
+    : pimpl_(new impl(fd, close_fd, params)) {}
+
+lz4_log_writer::~lz4_log_writer() {
+  try {
+    close();
+  } catch (...) {
+  }
+}
+
+bool lz4_log_writer::write(const char* data, std::size_t size) {
+  impl& i = *pimpl_;
+  const uint64_t cap = i.params.block_size;
+  if (size > cap) throw std::invalid_argument("lz4_log_writer: record larger than block_size");
+  i.check();
+  if (!size) return true;
+  if (i.params.drop_when_full) {
+    // the buffer the record is likely to go to is not written out yet
+    const uint64_t h = i.head.load(std::memory_order_acquire);
+    const uint64_t seq = (h >> 32) + ((h & impl::offset_mask) + size > cap ? 1 : 0);
+    if (i.at(seq).ready.load(std::memory_order_acquire) != seq) {
+      ++i.dropped;
+      return false;
+    }
+  }
+  uint64_t old = i.head.load(std::memory_order_acquire);
+  for (;;) {
+    const uint64_t seq = old >> 32, offset = old & impl::offset_mask;
+    if (offset > cap) {
+      i.wait_head(seq);
+      old = i.head.load(std::memory_order_acquire);
+    } else if (offset + size <= cap) {
+      if (!i.head.compare_exchange_weak(old, old + size)) continue;
+      impl::buffer& b = i.at(seq);
+      i.wait_ready(b, seq);
+      memcpy(b.data.get() + offset, data, size);
+      b.committed.fetch_add(size, std::memory_order_release);
+      return true;
+    } else if (i.head.compare_exchange_weak(old, (seq << 32) | (cap + 1))) {
+      i.seal(seq, offset);
+      old = i.head.load(std::memory_order_acquire);
+    }
+  }
+}
+
+void lz4_log_writer::flush() {
+  impl& i = *pimpl_;
+  i.check();
+  const uint64_t seq = i.seal_head(false);
+  std::unique_lock<std::mutex> lock(i.mutex);
+  i.cv.wait(lock, [&] { return i.written > seq || i.error; });
+  if (i.error) std::rethrow_exception(i.error);
+  lock.unlock();
+  if (i.params.fsync_blocks && ::fsync(i.fd) != 0)
+    throw std::runtime_error(std::string("lz4_log_writer: fsync: ") + strerror(errno));
+}
+
+void lz4_log_writer::close() {
+  impl& i = *pimpl_;
+  if (!i.thread.joinable()) return;
+  if (!i.failed) flush();
+  i.shutdown();
+  i.check();
+}
+
+uint64_t lz4_log_writer::dropped() const { return pimpl_->dropped; }
+
+uint64_t lz4_log_writer::blocks() const { return pimpl_->blocks; }
+
+}  // namespace iostreams
+}  // namespace boost
+}  // namespace ext
@@ -0,0 +1,88 @@
+#ifndef LZ4_LOG_HPP_INCLUDED
+#define LZ4_LOG_HPP_INCLUDED
+
+// one compressed log file written by many threads, none of which waits
+// for a block to be compressed:
+//
+//   lz4_log_params p;
+//   p.fsync_blocks = 16;
+//   lz4_log_writer log("app.log.lz4", p);
+//   ...
+//   log.write(record.data(), record.size());     // from any thread
+
+#include <boost/cstdint.hpp> // uint*_t
+#include <boost/iostreams/detail/config/dyn_link.hpp>
+#include <boost/shared_ptr.hpp>
+
+#include <string>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+//
+// Class name: lz4_log_params.
+// Description: Encapsulates the parameters passed to lz4_log_writer.
+//
+struct lz4_log_params
+    {
+    // Non-explicit constructor.
+    lz4_log_params( const lz4_params& output = lz4_params(),
+                    std::size_t       block_size = 1024*1024 )
+        : output(output), block_size(block_size), buffers(4),
+          drop_when_full(false), fsync_blocks(0), max_age_ms(100)
+        { }
+    // stream format and checksums; the streaming mode fields and the
+    // executor are the writer's own
+    lz4_params   output;
+    std::size_t  block_size;        // records per block, at most a block of output.format
+    unsigned int buffers;           // >= 2, memory is buffers * block_size
+    bool         drop_when_full;    // write() drops records rather than wait for a buffer
+    unsigned int fsync_blocks;      // fsync() after that many blocks, 0 = never
+    unsigned int max_age_ms;        // records wait at most about that long, 0 = for a full buffer
+    };
+
+//
+// Class name: lz4_log_writer
+// Description: Writes records from any number of threads to one lz4
+//      stream. Each write() reserves room in the current staging buffer
+//      with one atomic addition and copies the record there; a thread of
+//      the writer turns each staging buffer, once full or old, into one
+//      block and writes the blocks in order. Records are never split
+//      across blocks, nor interleaved. When all buffers wait to be
+//      written, write() waits for one or, with drop_when_full, drops the
+//      record. The stream ends at close(); a file gets a new stream
+//      appended at each opening (same format each time),
+//      lz4_decompressor reads them as one.
+//
+class BOOST_IOSTREAMS_DECL lz4_log_writer
+    {
+    public:
+        explicit lz4_log_writer(const std::string& path,
+                                const lz4_log_params& params = lz4_log_params());
+        explicit lz4_log_writer(int fd, const lz4_log_params& params = lz4_log_params(),
+                                bool close_fd = false);
+        ~lz4_log_writer();
+
+        // false if the record was dropped; size <= block_size.
+        // Rethrows what failed writing the log.
+        bool write(const char* data, std::size_t size);
+        // waits until the records written so far are in the file,
+        // fsync()'ed if fsync_blocks is set
+        void flush();
+        // flushes and ends the stream; no write() may follow
+        void close();
+
+        uint64_t dropped() const;   // records
+        uint64_t blocks() const;    // written so far
+    private:
+        lz4_log_writer(const lz4_log_writer&);
+        lz4_log_writer& operator=(const lz4_log_writer&);
+
+        struct impl;
+        ::boost::shared_ptr<impl> pimpl_;
+    };
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_LOG_HPP_INCLUDED
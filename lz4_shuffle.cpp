@@ -0,0 +1,396 @@
+#include "lz4_shuffle.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef __SSE2__
+#define LZ4_SHUFFLE_SSE2 1
+#endif
+#if defined(__GNUC__)
+#define LZ4_SHUFFLE_AVX2 1
+#endif
+#endif
+
+namespace ext {
+namespace boost {
+namespace iostreams {
+namespace lz4 {
+
+//------------------Implementation of the transforms-------------------------//
+
+// 16 elements of E bytes are transposed in E registers by rounds of
+// byte interleaving of register j with register j + E/2: 4 rounds give
+// the byte planes, log2(E) rounds of the same undo them
+
+static void shuffle_scalar(const uint8_t* in, uint8_t* out, size_t count,
+                           unsigned element_size, size_t first) {
+  for (size_t i = first; i < count; ++i)
+    for (unsigned b = 0; b < element_size; ++b)
+      out[b * count + i] = in[i * element_size + b];
+}
+
+static void unshuffle_scalar(const uint8_t* in, uint8_t* out, size_t count,
+                             unsigned element_size, size_t first) {
+  for (size_t i = first; i < count; ++i)
+    for (unsigned b = 0; b < element_size; ++b)
+      out[i * element_size + b] = in[b * count + i];
+}
+
+static unsigned log2_of(unsigned element_size) {
+  unsigned rounds = 0;
+  while ((1u << rounds) < element_size) ++rounds;
+  return rounds;
+}
+
+#ifdef LZ4_SHUFFLE_SSE2
+template <unsigned E>
+static size_t shuffle_sse2(const uint8_t* in, uint8_t* out, size_t count) {
+  size_t i = 0;
+  for (; i + 16 <= count; i += 16) {
+    __m128i r[E], t[E];
+    for (unsigned j = 0; j < E; ++j)
+      r[j] = _mm_loadu_si128((const __m128i*)(in + i * E + 16 * j));
+    for (unsigned round = 0; round < 4; ++round) {
+      for (unsigned j = 0; j < E / 2; ++j) {
+        t[2 * j] = _mm_unpacklo_epi8(r[j], r[j + E / 2]);
+        t[2 * j + 1] = _mm_unpackhi_epi8(r[j], r[j + E / 2]);
+      }
+      std::copy(t, t + E, r);
+    }
+    for (unsigned b = 0; b < E; ++b)
+      _mm_storeu_si128((__m128i*)(out + b * count + i), r[b]);
+  }
+  return i;
+}
+
+template <unsigned E>
+static size_t unshuffle_sse2(const uint8_t* in, uint8_t* out, size_t count) {
+  size_t i = 0;
+  const unsigned rounds = log2_of(E);
+  for (; i + 16 <= count; i += 16) {
+    __m128i r[E], t[E];
+    for (unsigned b = 0; b < E; ++b)
+      r[b] = _mm_loadu_si128((const __m128i*)(in + b * count + i));
+    for (unsigned round = 0; round < rounds; ++round) {
+      for (unsigned j = 0; j < E / 2; ++j) {
+        t[2 * j] = _mm_unpacklo_epi8(r[j], r[j + E / 2]);
+        t[2 * j + 1] = _mm_unpackhi_epi8(r[j], r[j + E / 2]);
+      }
+      std::copy(t, t + E, r);
+    }
+    for (unsigned j = 0; j < E; ++j)
+      _mm_storeu_si128((__m128i*)(out + i * E + 16 * j), r[j]);
+  }
+  return i;
+}
+#endif
+
+#ifdef LZ4_SHUFFLE_AVX2
+// the same per 128 bit lane: elements i..i+15 in the low lanes,
+// i+16..i+31 in the high ones
+template <unsigned E>
+__attribute__((target("avx2")))
+static size_t shuffle_avx2(const uint8_t* in, uint8_t* out, size_t count) {
+  size_t i = 0;
+  for (; i + 32 <= count; i += 32) {
+    __m256i r[E], t[E];
+    for (unsigned j = 0; j < E; ++j)
+      r[j] = _mm256_inserti128_si256(
+          _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(in + i * E + 16 * j))),
+          _mm_loadu_si128((const __m128i*)(in + (i + 16) * E + 16 * j)), 1);
+    for (unsigned round = 0; round < 4; ++round) {
+      for (unsigned j = 0; j < E / 2; ++j) {
+        t[2 * j] = _mm256_unpacklo_epi8(r[j], r[j + E / 2]);
+        t[2 * j + 1] = _mm256_unpackhi_epi8(r[j], r[j + E / 2]);
+      }
+      std::copy(t, t + E, r);
+    }
+    for (unsigned b = 0; b < E; ++b)
+      _mm256_storeu_si256((__m256i*)(out + b * count + i), r[b]);
+  }
+  return i;
+}
+
+template <unsigned E>
+__attribute__((target("avx2")))
+static size_t unshuffle_avx2(const uint8_t* in, uint8_t* out, size_t count) {
+  size_t i = 0;
+  const unsigned rounds = log2_of(E);
+  for (; i + 32 <= count; i += 32) {
+    __m256i r[E], t[E];
+    for (unsigned b = 0; b < E; ++b)
+      r[b] = _mm256_loadu_si256((const __m256i*)(in + b * count + i));
+    for (unsigned round = 0; round < rounds; ++round) {
+      for (unsigned j = 0; j < E / 2; ++j) {
+        t[2 * j] = _mm256_unpacklo_epi8(r[j], r[j + E / 2]);
+        t[2 * j + 1] = _mm256_unpackhi_epi8(r[j], r[j + E / 2]);
+      }
+      std::copy(t, t + E, r);
+    }
+    for (unsigned j = 0; j < E; ++j) {
+      _mm_storeu_si128((__m128i*)(out + i * E + 16 * j), _mm256_castsi256_si128(r[j]));
+      _mm_storeu_si128((__m128i*)(out + (i + 16) * E + 16 * j), _mm256_extracti128_si256(r[j], 1));
+    }
+  }
+  return i;
+}
+
+static bool has_avx2() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+#endif
+
+// elements done by the vector code, the rest is left to the scalar one
+template <unsigned E>
+static size_t shuffle_simd(const uint8_t* in, uint8_t* out, size_t count, bool inverse) {
+#ifdef LZ4_SHUFFLE_AVX2
+  if (has_avx2())
+    return inverse ? unshuffle_avx2<E>(in, out, count) : shuffle_avx2<E>(in, out, count);
+#endif
+#ifdef LZ4_SHUFFLE_SSE2
+  return inverse ? unshuffle_sse2<E>(in, out, count) : shuffle_sse2<E>(in, out, count);
+#else
+  (void)in; (void)out; (void)count; (void)inverse;
+  return 0;
+#endif
+}
+
+static void transpose(const char* in, char* out, size_t size, unsigned element_size,
+                      bool inverse) {
+  const uint8_t* src = (const uint8_t*)in;
+  uint8_t* dst = (uint8_t*)out;
+  const size_t count = size / element_size;
+  size_t done = 0;
+  switch (element_size) {
+    case 1:
+      memcpy(dst, src, size);
+      return;
+    case 2: done = shuffle_simd<2>(src, dst, count, inverse); break;
+    case 4: done = shuffle_simd<4>(src, dst, count, inverse); break;
+    case 8: done = shuffle_simd<8>(src, dst, count, inverse); break;
+    case 16: done = shuffle_simd<16>(src, dst, count, inverse); break;
+  }
+  if (inverse)
+    unshuffle_scalar(src, dst, count, element_size, done);
+  else
+    shuffle_scalar(src, dst, count, element_size, done);
+  const size_t tail = count * element_size;
+  memcpy(dst + tail, src + tail, size - tail);
+}
+
+void shuffle(const char* in, char* out, size_t size, unsigned element_size) {
+  transpose(in, out, size, element_size, false);
+}
+
+void unshuffle(const char* in, char* out, size_t size, unsigned element_size) {
+  transpose(in, out, size, element_size, true);
+}
+
+template <typename T>
+static void delta_encode_as(char* data, size_t count) {
+  T prev = 0;
+  for (size_t i = 0; i < count; ++i) {
+    T value;
+    memcpy(&value, data + i * sizeof(T), sizeof(T));
+    T delta = value - prev;
+    memcpy(data + i * sizeof(T), &delta, sizeof(T));
+    prev = value;
+  }
+}
+
+template <typename T>
+static void delta_decode_as(char* data, size_t count) {
+  T prev = 0;
+  for (size_t i = 0; i < count; ++i) {
+    T delta;
+    memcpy(&delta, data + i * sizeof(T), sizeof(T));
+    prev += delta;
+    memcpy(data + i * sizeof(T), &prev, sizeof(T));
+  }
+}
+
+void delta_encode(char* data, size_t size, unsigned element_size) {
+  switch (element_size) {
+    case 1: delta_encode_as<uint8_t>(data, size); break;
+    case 2: delta_encode_as<uint16_t>(data, size / 2); break;
+    case 4: delta_encode_as<uint32_t>(data, size / 4); break;
+    case 8: delta_encode_as<uint64_t>(data, size / 8); break;
+    default: throw std::invalid_argument("lz4_shuffle: delta needs 1, 2, 4 or 8 byte elements");
+  }
+}
+
+void delta_decode(char* data, size_t size, unsigned element_size) {
+  switch (element_size) {
+    case 1: delta_decode_as<uint8_t>(data, size); break;
+    case 2: delta_decode_as<uint16_t>(data, size / 2); break;
+    case 4: delta_decode_as<uint32_t>(data, size / 4); break;
+    case 8: delta_decode_as<uint64_t>(data, size / 8); break;
+    default: throw std::invalid_argument("lz4_shuffle: delta needs 1, 2, 4 or 8 byte elements");
+  }
+}
+
+}  // namespace lz4
+
+//------------------Implementation of lz4_shuffle_base-----------------------//
+
+namespace detail {
+
+lz4_shuffle_base::lz4_shuffle_base(const lz4_shuffle_params& params)
+    : m_params(params) {
+  init();
+}
+
+void lz4_shuffle_base::init() {
+  m_was_header = false;
+  m_header.clear();
+  m_in_buf.clear();
+  m_out_buf.clear();
+  m_out_pos = 0;
+}
+
+// both ways, delta on whole elements only: the first element of each
+// block is kept, so blocks are independent
+void lz4_shuffle_base::encode_block(const char* src, size_t size, char* dst) {
+  if (m_params.delta) {
+    m_tmp.assign(src, src + size);
+    lz4::delta_encode(m_tmp.data(), size - size % m_params.element_size, m_params.element_size);
+    src = m_tmp.data();
+  }
+  if (m_params.shuffle)
+    lz4::shuffle(src, dst, size, m_params.element_size);
+  else
+    memcpy(dst, src, size);
+}
+
+void lz4_shuffle_base::decode_block(const char* src, size_t size, char* dst) {
+  if (m_params.shuffle)
+    lz4::unshuffle(src, dst, size, m_params.element_size);
+  else
+    memcpy(dst, src, size);
+  if (m_params.delta)
+    lz4::delta_decode(dst, size - size % m_params.element_size, m_params.element_size);
+}
+
+// pending transformed data to dst, false if dst is full
+bool lz4_shuffle_base::output(char*& dst_begin, char* dst_end) {
+  size_t amt = std::min<size_t>(m_out_buf.size() - m_out_pos, dst_end - dst_begin);
+  memcpy(dst_begin, m_out_buf.data() + m_out_pos, amt);
+  dst_begin += amt;
+  m_out_pos += amt;
+  return m_out_pos == m_out_buf.size();
+}
+
+bool lz4_shuffle_base::encode_filter(const char*& src_begin, const char* src_end,
+                                     char*& dst_begin, char* dst_end, bool flush) {
+  const unsigned element_size = m_params.element_size;
+  if (!m_was_header) {
+    if (!element_size || element_size > 255)
+      throw std::invalid_argument("lz4_shuffle: element size must be 1..255");
+    if (m_params.delta && element_size != 1 && element_size != 2 &&
+        element_size != 4 && element_size != 8)
+      throw std::invalid_argument("lz4_shuffle: delta needs 1, 2, 4 or 8 byte elements");
+    m_params.block_size -= m_params.block_size % element_size;
+    if (!m_params.block_size)
+      throw std::invalid_argument("lz4_shuffle: block smaller than an element");
+    const uint8_t header[lz4::shuffle_header_size - 4] = {
+        uint8_t((m_params.shuffle ? lz4::shuffle_flag_shuffle : 0) |
+                (m_params.delta ? lz4::shuffle_flag_delta : 0)),
+        uint8_t(element_size), 0, 0,
+        uint8_t(m_params.block_size), uint8_t(m_params.block_size >> 8),
+        uint8_t(m_params.block_size >> 16), uint8_t(m_params.block_size >> 24)};
+    m_out_buf.resize(lz4::shuffle_header_size);
+    memcpy(m_out_buf.data(), &lz4::shuffle_magic, 4);
+    memcpy(m_out_buf.data() + 4, header, sizeof(header));
+    m_out_pos = 0;
+    m_was_header = true;
+  }
+  const size_t block_size = m_params.block_size;
+  for (;;) {
+    if (!output(dst_begin, dst_end)) return true;  // dst is full
+    if (m_in_buf.empty() && (size_t)(src_end - src_begin) >= block_size &&
+        (size_t)(dst_end - dst_begin) >= block_size) {
+      // whole block from src straight to dst
+      encode_block(src_begin, block_size, dst_begin);
+      src_begin += block_size;
+      dst_begin += block_size;
+      continue;
+    }
+    size_t amt = std::min<size_t>(src_end - src_begin, block_size - m_in_buf.size());
+    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+    src_begin += amt;
+    if (m_in_buf.empty() ||
+        (m_in_buf.size() < block_size && !(flush && src_begin == src_end)))
+      break;
+    m_out_buf.resize(m_in_buf.size());
+    encode_block(m_in_buf.data(), m_in_buf.size(), m_out_buf.data());
+    m_out_pos = 0;
+    m_in_buf.clear();
+  }
+  return !flush;
+}
+
+// gathers the marker, false until all of it is there
+bool lz4_shuffle_base::decode_header(const char*& src_begin, const char* src_end) {
+  size_t amt = std::min<size_t>(src_end - src_begin, lz4::shuffle_header_size - m_header.size());
+  m_header.insert(m_header.end(), src_begin, src_begin + amt);
+  src_begin += amt;
+  if (m_header.size() < lz4::shuffle_header_size) return false;
+
+  const uint8_t* h = (const uint8_t*)m_header.data();
+  uint32_t magic;
+  memcpy(&magic, h, 4);
+  if (magic != lz4::shuffle_magic) throw std::runtime_error("lz4_shuffle: no shuffle marker");
+  if (h[4] & ~(lz4::shuffle_flag_shuffle | lz4::shuffle_flag_delta))
+    throw std::runtime_error("lz4_shuffle: unknown transform");
+  m_params.shuffle = (h[4] & lz4::shuffle_flag_shuffle) != 0;
+  m_params.delta = (h[4] & lz4::shuffle_flag_delta) != 0;
+  m_params.element_size = h[5];
+  m_params.block_size = h[8] | (h[9] << 8) | (h[10] << 16) | ((uint32_t)h[11] << 24);
+  if (!m_params.element_size || !m_params.block_size ||
+      m_params.block_size % m_params.element_size)
+    throw std::runtime_error("lz4_shuffle: bad marker");
+  m_was_header = true;
+  return true;
+}
+
+bool lz4_shuffle_base::decode_filter(const char*& src_begin, const char* src_end,
+                                     char*& dst_begin, char* dst_end, bool flush) {
+  if (!m_was_header && !decode_header(src_begin, src_end)) {
+    if (flush && !m_header.empty())
+      throw std::runtime_error("lz4_shuffle: unexpected EOF");
+    return !flush;
+  }
+  const size_t block_size = m_params.block_size;
+  for (;;) {
+    if (!output(dst_begin, dst_end)) return true;  // dst is full
+    if (m_in_buf.empty() && (size_t)(src_end - src_begin) >= block_size &&
+        (size_t)(dst_end - dst_begin) >= block_size) {
+      decode_block(src_begin, block_size, dst_begin);
+      src_begin += block_size;
+      dst_begin += block_size;
+      continue;
+    }
+    size_t amt = std::min<size_t>(src_end - src_begin, block_size - m_in_buf.size());
+    m_in_buf.insert(m_in_buf.end(), src_begin, src_begin + amt);
+    src_begin += amt;
+    // the last block is the short one
+    if (m_in_buf.empty() ||
+        (m_in_buf.size() < block_size && !(flush && src_begin == src_end)))
+      break;
+    m_out_buf.resize(m_in_buf.size());
+    decode_block(m_in_buf.data(), m_in_buf.size(), m_out_buf.data());
+    m_out_pos = 0;
+    m_in_buf.clear();
+  }
+  return !flush;
+}
+
+}  // namespace detail
+
+}  // namespace iostreams
+}  // namespace boost
+}  // namespace ext
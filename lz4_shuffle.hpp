@@ -0,0 +1,156 @@
+#ifndef LZ4_SHUFFLE_HPP_INCLUDED
+#define LZ4_SHUFFLE_HPP_INCLUDED
+
+// byte-shuffle / delta pre-filter for arrays of numbers, to be pushed
+// before lz4_compressor (and after lz4_decompressor when decoding):
+//
+//   out.push(lz4_shuffler(lz4_shuffle_params(8)));   // doubles
+//   out.push(lz4_compressor());
+//   out.push(file);
+
+#include <boost/cstdint.hpp> // uint*_t
+#include <boost/iostreams/detail/config/dyn_link.hpp>
+#include <boost/iostreams/filter/symmetric.hpp>
+#include <boost/iostreams/pipeline.hpp>
+
+#include <memory>
+#include <vector>
+
+namespace ext { namespace boost { namespace iostreams { namespace lz4 {
+
+// stream marker, followed by flags, element size, 2 zero bytes and
+// the block size (little endian)
+const uint32_t shuffle_magic = 0x46554853; // "SHUF"
+const unsigned int shuffle_header_size = 12;
+const unsigned int shuffle_flag_shuffle = 1;
+const unsigned int shuffle_flag_delta   = 2;
+
+// element i byte b of in goes to out[b * (size / element_size) + i];
+// the size % element_size last bytes are copied as they are.
+// SSE2/AVX2 for element sizes 2, 4, 8 and 16 on x86.
+BOOST_IOSTREAMS_DECL void shuffle(const char* in, char* out, size_t size, unsigned element_size);
+BOOST_IOSTREAMS_DECL void unshuffle(const char* in, char* out, size_t size, unsigned element_size);
+// in place, elements as little endian integers of 1, 2, 4 or 8 bytes
+BOOST_IOSTREAMS_DECL void delta_encode(char* data, size_t size, unsigned element_size);
+BOOST_IOSTREAMS_DECL void delta_decode(char* data, size_t size, unsigned element_size);
+
+} // namespace lz4
+
+//
+// Class name: lz4_shuffle_params.
+// Description: Encapsulates the parameters passed to lz4_shuffler.
+//
+struct lz4_shuffle_params
+    {
+    // Non-explicit constructor.
+    lz4_shuffle_params( unsigned int element_size = 8,
+                        bool         delta = false )
+        : element_size(element_size), shuffle(true), delta(delta),
+          block_size(256*1024)
+        { }
+    unsigned int element_size;     // 1..255 bytes, 1, 2, 4 or 8 with delta
+    bool         shuffle;          // byte planes
+    bool         delta;            // difference to the previous element, before shuffling
+    uint32_t     block_size;       // rounded down to a multiple of element_size
+    };
+
+namespace detail
+{
+
+class BOOST_IOSTREAMS_DECL lz4_shuffle_base
+    {
+    public:
+        typedef char char_type; // required for boost
+    private:
+        lz4_shuffle_params m_params;
+        bool m_was_header;
+        std::vector<char> m_header;     // decoder: header bytes so far
+        std::vector<char> m_in_buf;     // staged block
+        std::vector<char> m_out_buf;    // transformed block being output
+        size_t m_out_pos;
+        std::vector<char> m_tmp;        // delta before shuffle
+
+        void encode_block(const char* src, size_t size, char* dst);
+        void decode_block(const char* src, size_t size, char* dst);
+        bool output(char*& dst_begin, char* dst_end);
+        bool decode_header(const char*& src_begin, const char* src_end);
+    protected:
+        explicit lz4_shuffle_base(const lz4_shuffle_params& params = lz4_shuffle_params());
+        void init();
+        bool encode_filter(const char*&, const char*, char*&, char*, bool);
+        bool decode_filter(const char*&, const char*, char*&, char*, bool);
+    };
+
+template<typename Alloc = std::allocator<char> >
+class lz4_shuffler_impl : public lz4_shuffle_base
+    {
+    public:
+        explicit lz4_shuffler_impl(const lz4_shuffle_params& params = lz4_shuffle_params())
+            : lz4_shuffle_base(params) { }
+        bool filter( const char*& src_begin, const char* src_end,
+                     char*& dest_begin, char* dest_end, bool flush )
+            { return encode_filter(src_begin, src_end, dest_begin, dest_end, flush); }
+        void close() { init(); }
+    };
+
+template<typename Alloc = std::allocator<char> >
+class lz4_unshuffler_impl : public lz4_shuffle_base
+    {
+    public:
+        bool filter( const char*& src_begin, const char* src_end,
+                     char*& dest_begin, char* dest_end, bool flush )
+            { return decode_filter(src_begin, src_end, dest_begin, dest_end, flush); }
+        void close() { init(); }
+    };
+
+} // namespace detail
+
+using namespace ::boost::iostreams;
+
+//
+// Template name: lz4_shuffler
+// Description: Model of InputFilter and OutputFilter writing a shuffle
+//      marker, then the input transformed block by block as set by
+//      lz4_shuffle_params.
+//
+template<typename Alloc = std::allocator<char> >
+struct basic_lz4_shuffler : symmetric_filter<detail::lz4_shuffler_impl<Alloc>, Alloc>
+    {
+    private:
+        typedef detail::lz4_shuffler_impl<Alloc>    impl_type;
+        typedef symmetric_filter<impl_type, Alloc>  base_type;
+    public:
+        typedef typename base_type::char_type       char_type;
+        typedef typename base_type::category        category;
+        basic_lz4_shuffler( const lz4_shuffle_params& p = lz4_shuffle_params(),
+                            std::streamsize buffer_size = default_device_buffer_size )
+            : base_type(buffer_size, p) { }
+    };
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_shuffler, 1)
+
+typedef basic_lz4_shuffler<> lz4_shuffler;
+
+//
+// Template name: lz4_unshuffler
+// Description: Model of InputFilter and OutputFilter undoing what the
+//      marker at the start of the stream says lz4_shuffler did.
+//
+template<typename Alloc = std::allocator<char> >
+struct basic_lz4_unshuffler : symmetric_filter<detail::lz4_unshuffler_impl<Alloc>, Alloc>
+    {
+    private:
+        typedef detail::lz4_unshuffler_impl<Alloc>  impl_type;
+        typedef symmetric_filter<impl_type, Alloc>  base_type;
+    public:
+        typedef typename base_type::char_type       char_type;
+        typedef typename base_type::category        category;
+        explicit basic_lz4_unshuffler( std::streamsize buffer_size = default_device_buffer_size )
+            : base_type(buffer_size) { }
+    };
+BOOST_IOSTREAMS_PIPABLE(basic_lz4_unshuffler, 1)
+
+typedef basic_lz4_unshuffler<> lz4_unshuffler;
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_SHUFFLE_HPP_INCLUDED
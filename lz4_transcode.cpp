@@ -0,0 +1,47 @@
+#include "lz4_transcode.hpp"
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <stdexcept>
+
+namespace ext {
+namespace boost {
+namespace iostreams {
+
+//------------------Implementation of lz4_transcode--------------------------//
+
+// The legacy blocks are decoded on the calling thread, in place in a
+// single 8 MB buffer, while the frame blocks are encoded by the executor:
+// decoding runs several times faster than encoding, so the calling thread
+// keeps the executor busy. Memory stays at one legacy block plus
+// max_in_flight frame blocks, whatever the stream size.
+uint64_t lz4_transcode(std::istream& in, std::ostream& out,
+                       const lz4_transcode_params& params) {
+  lz4_params output = params.output;
+  if (output.format != lz4::frame)
+    throw std::runtime_error("lz4: transcoding writes LZ4S frames");
+  if (output.max_buffered > 0)
+    throw std::runtime_error("lz4: transcoding does not use streaming mode");
+  if (!output.executor) output.executor = &lz4::executor::shared();
+  if (output.block_size_id < 4 || output.block_size_id > 7)
+    throw std::runtime_error("lz4: block_size_id must be 4..7");
+  const std::streamsize block = lz4::lz4s_blocksize(output.block_size_id);
+
+  lz4_legacy_decompressor decoder;
+  decoder.set_in_place(true);
+  ::boost::iostreams::filtering_istream decoded;
+  decoded.push(decoder, block);
+  if (params.gzip_input) decoded.push(::boost::iostreams::gzip_decompressor());
+  decoded.push(in);
+
+  ::boost::iostreams::filtering_ostream encoded;
+  encoded.push(lz4_compressor(output), block);
+  encoded.push(out);
+  encoded.exceptions(std::ios::badbit);
+
+  return ::boost::iostreams::copy(decoded, encoded, block);
+}
+
+}  // namespace iostreams
+}  // namespace boost
+}  // namespace ext
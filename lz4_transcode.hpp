@@ -0,0 +1,51 @@
+#ifndef LZ4_TRANSCODE_HPP_INCLUDED
+#define LZ4_TRANSCODE_HPP_INCLUDED
+
+// legacy lz4 streams (8 MB blocks, as lz4_compressor writes by default)
+// to LZ4S frames, without the decoded data ever going to disk:
+//
+//   lz4_transcode_params p;
+//   p.output.block_size_id = 4;        // 64 KB blocks
+//   p.output.block_checksum = true;
+//   lz4_transcode(in, out, p);
+
+#include <boost/cstdint.hpp> // uint*_t
+#include <boost/iostreams/detail/config/dyn_link.hpp>
+
+#include <iosfwd>
+
+#include "lz4_filter.hpp"
+
+namespace ext { namespace boost { namespace iostreams {
+
+//
+// Class name: lz4_transcode_params.
+// Description: Encapsulates the parameters passed to lz4_transcode.
+//
+struct lz4_transcode_params
+    {
+    // Non-explicit constructor.
+    lz4_transcode_params( const lz4_params& output = lz4_params(lz4::frame),
+                          bool              gzip_input = false )
+        : output(output), gzip_input(gzip_input)
+        { }
+    // frames written: block size, checksums; blocks are encoded by
+    // output.executor threads, lz4::executor::shared() if not set,
+    // with at most output.max_in_flight blocks in memory
+    lz4_params output;
+    bool       gzip_input;      // the legacy stream is itself gzip'ed
+    };
+
+//
+// Function name: lz4_transcode
+// Description: Decodes the legacy lz4 stream read from in (concatenated
+//      streams too) and writes it to out as LZ4S frames. Returns the
+//      decoded size. Throws std::runtime_error on bad input, including
+//      an input that already is a frame.
+//
+BOOST_IOSTREAMS_DECL uint64_t lz4_transcode( std::istream& in, std::ostream& out,
+                                             const lz4_transcode_params& params = lz4_transcode_params() );
+
+} } } // End namespaces iostreams, boost, ext.
+
+#endif // LZ4_TRANSCODE_HPP_INCLUDED
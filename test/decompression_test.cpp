@@ -1,29 +1,39 @@
 
 #include <iostream>
+#include <atomic>
 #include <fstream>
 #include <random>
 #include <thread>
 #include <iomanip>
 #include <cstring>
+#include <chrono>
+#include <map>
+#include <sstream>
+#include <memory>
+#include <new>
+#include <sys/resource.h>
 /* BOOST */
+#include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/device/array.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filtering_streambuf.hpp>
-#include "lz4_filter.hpp"
+#include "../lz4_filter.hpp"
 
 #define COLOR_GREEN "\x1b[32m"
 #define COLOR_RED "\x1b[31m"
+#define COLOR_RESET "\x1b[0m"
     template<typename T>
     using deleted_unique_ptr = std::unique_ptr<T,std::function<void(T*)>>;
 
-int main(int argc, char const *argv[])
-{   
-    if(argc < 2)
-    {
-        return -1;
-    }
-
-    std::string filename = argv[1];
+namespace bio = boost::iostreams;
+namespace lz4 = ext::boost::iostreams;
 
+// original mode: FILE.lz4 and FILE.gz must decode to the same data,
+// read in random sizes
+static int compare_files(const std::string& filename)
+{
     std::ifstream realfilelz4,realfilegz;
     boost::iostreams::filtering_streambuf<boost::iostreams::input> biolz4;
     boost::iostreams::filtering_streambuf<boost::iostreams::input> biogz;
@@ -37,7 +47,7 @@ int main(int argc, char const *argv[])
         return 0;
     }
     realfilegz.open(filename+".gz",std::ifstream::in | std::ifstream::binary);
-    if(!realfilelz4.is_open())
+    if(!realfilegz.is_open())
     {
         std::cerr << "cannot open file with +.gz" << std::endl;
         return 0;
@@ -45,11 +55,11 @@ int main(int argc, char const *argv[])
 
     biogz.push(boost::iostreams::gzip_decompressor());
     biogz.push(realfilegz);
-    iogz = deleted_unique_ptr<std::istream>(new std::istream(&biogz), [](std::istream*p) { delete p; }); // DeleterOwned(true));   
+    iogz = deleted_unique_ptr<std::istream>(new std::istream(&biogz), [](std::istream*p) { delete p; }); // DeleterOwned(true));
 
     biolz4.push(ext::boost::iostreams::lz4_decompressor());
     biolz4.push(realfilelz4);
-    iolz4 = deleted_unique_ptr<std::istream>(new std::istream(&biolz4), [](std::istream*p) { delete p; }); // DeleterOwned(true));   
+    iolz4 = deleted_unique_ptr<std::istream>(new std::istream(&biolz4), [](std::istream*p) { delete p; }); // DeleterOwned(true));
 
     static char buf1[128*1024],buf2[128*1024];
     std::random_device rd;
@@ -58,7 +68,7 @@ int main(int argc, char const *argv[])
 
     size_t offset = 0;
     while(true)
-    {   
+    {
         int q = dis(gen);
         iogz->read(buf1,q);
         iolz4->read(buf2,q);
@@ -66,7 +76,7 @@ int main(int argc, char const *argv[])
         if(ngz != nlz4)
         {
             std::cerr << COLOR_RED <<  "@" << offset << " different read gz:" << ngz << " vs lz4:" << nlz4 << std::endl;
-            break;
+            return 1;
         }
         else if(!ngz)
             break;
@@ -75,7 +85,7 @@ int main(int argc, char const *argv[])
             if(memcmp(buf1,buf2,ngz) != 0)
             {
                 std::cerr << COLOR_RED << "@" << offset << " different content sized " << ngz << std::endl;
-                break;
+                return 1;
             }
             else
             {
@@ -83,9 +93,734 @@ int main(int argc, char const *argv[])
                 //std::cerr <<COLOR_GREEN << "@" << offset << " " << ngz << std::endl;
             }
         }
-        if(offset % 128*1024*1024 == 0)
+        if(offset % (128*1024*1024) == 0)
             std::cerr << COLOR_GREEN << "@" << offset << std::endl;
     }
     std::cerr << "processed " << offset << " bytes " << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+
+//------------------synthetic corpus-----------------------------------------//
+
+static const char* const corpus_kinds[] = { "text", "logs", "binary", "random" };
+
+// same seed, same corpus: results stay comparable between runs
+static std::string make_corpus(const std::string& kind, size_t size, unsigned seed)
+{
+    std::mt19937 gen(seed);
+    std::string data;
+    data.reserve(size + 256);
+    if(kind == "text")
+    {
+        static const char* const words[] = {
+            "the", "of", "and", "to", "in", "a", "is", "that", "for", "it",
+            "as", "was", "with", "be", "by", "on", "not", "he", "this", "are",
+            "stream", "filter", "block", "compression", "buffer", "decoder",
+            "throughput", "latency", "request", "response", "boost", "frame" };
+        const size_t nwords = sizeof(words) / sizeof(words[0]);
+        // roughly zipfian: low indices are much more frequent
+        std::geometric_distribution<size_t> word(0.12);
+        std::uniform_int_distribution<> line(6, 16);
+        while(data.size() < size)
+        {
+            for(int i = line(gen); i; --i)
+            {
+                data += words[std::min(word(gen), nwords - 1)];
+                data += i > 1 ? ' ' : '.';
+            }
+            data += '\n';
+        }
+    }
+    else if(kind == "logs")
+    {
+        static const char* const levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN", "ERROR" };
+        static const char* const paths[] = { "/api/v1/users", "/api/v1/orders", "/api/v2/search",
+                                             "/health", "/static/app.js", "/api/v1/login" };
+        std::uniform_int_distribution<> level(0, 5), path(0, 5), worker(0, 15),
+                                        latency(1, 900), status(0, 19);
+        uint64_t ts = 1700000000000ULL;
+        char line[256];
+        while(data.size() < size)
+        {
+            ts += gen() % 50;
+            int n = snprintf(line, sizeof(line),
+                             "%llu %s [worker-%d] request id=%08x path=%s status=%d latency_ms=%d\n",
+                             (unsigned long long)ts, levels[level(gen)], worker(gen), (unsigned)gen(),
+                             paths[path(gen)], status(gen) ? 200 : 500, latency(gen));
+            data.append(line, n);
+        }
+    }
+    else if(kind == "binary")
+    {
+        // fixed size records of slowly changing fields
+        struct record { uint64_t ts; uint32_t id; float value; uint16_t flags; uint16_t pad; };
+        std::uniform_int_distribution<uint32_t> id(0, 1000);
+        std::normal_distribution<float> value(100.0f, 15.0f);
+        record r = { 1700000000000ULL, 0, 0.0f, 0, 0 };
+        while(data.size() < size)
+        {
+            r.ts += gen() % 16;
+            r.id = id(gen);
+            r.value = value(gen);
+            r.flags = (gen() % 8) == 0 ? 1 : 0;
+            data.append((const char*)&r, sizeof(r));
+        }
+    }
+    else
+    {
+        while(data.size() < size)
+        {
+            uint32_t v = gen();
+            data.append((const char*)&v, sizeof(v));
+        }
+    }
+    data.resize(size);
+    return data;
+}
+
+//------------------measurements---------------------------------------------//
+
+static long proc_status_kb(const char* field)
+{
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while(std::getline(status, line))
+        if(line.compare(0, strlen(field), field) == 0)
+            return atol(line.c_str() + strlen(field));
+    return -1;
+}
+
+// peak resident set size in KB since the last reset_peak_rss()
+static long peak_rss_kb()
+{
+    long kb = proc_status_kb("VmHWM:");
+    if(kb >= 0)
+        return kb;
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static long rss_kb()
+{
+    return std::max(0L, proc_status_kb("VmRSS:"));
+}
+
+static void reset_peak_rss()
+{
+    // linux >= 4.0; when it fails, the peak is the process one
+    std::ofstream clear_refs("/proc/self/clear_refs");
+    clear_refs << "5";
+}
+
+struct result
+{
+    std::string corpus, codec, chain;
+    size_t raw_size = 0, comp_size = 0;
+    double comp_mbs = 0, decomp_mbs = 0;
+    // peak memory on top of what was resident when the chain started
+    long comp_rss_kb = 0, decomp_rss_kb = 0;
+
+    std::string key() const { return corpus + "/" + codec + "/" + chain; }
+    double ratio() const { return comp_size ? (double)raw_size / comp_size : 0; }
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double mb_per_s(size_t size, bench_clock::duration elapsed)
+{
+    double s = std::chrono::duration<double>(elapsed).count();
+    return s > 0 ? size / s / (1024 * 1024) : 0;
+}
+
+// istream/ostream chain: filtering_ostream in, filtering_istream out
+template<typename Compressor, typename Decompressor>
+struct stream_chain
+{
+    static void compress(const std::string& in, std::string& out)
+    {
+        bio::filtering_ostream os;
+        os.push(Compressor());
+        os.push(bio::back_inserter(out));
+        os.write(in.data(), in.size());
+    }
+    static void decompress(const std::string& in, std::string& out)
+    {
+        bio::filtering_istream is;
+        is.push(Decompressor());
+        is.push(bio::array_source(in.data(), in.size()));
+        char buf[64*1024];
+        while(is.read(buf, sizeof(buf)) || is.gcount())
+            out.append(buf, is.gcount());
+    }
+};
+
+// boost::iostreams::copy between devices through a filter
+template<typename Compressor, typename Decompressor>
+struct copy_chain
+{
+    static void compress(const std::string& in, std::string& out)
+    {
+        bio::filtering_ostream os;
+        os.push(Compressor());
+        os.push(bio::back_inserter(out));
+        bio::copy(bio::array_source(in.data(), in.size()), os);
+    }
+    static void decompress(const std::string& in, std::string& out)
+    {
+        bio::filtering_istream is;
+        is.push(Decompressor());
+        is.push(bio::array_source(in.data(), in.size()));
+        bio::copy(is, bio::back_inserter(out));
+    }
+};
+
+// filtering_streambuf used directly, as by the original compare mode
+template<typename Compressor, typename Decompressor>
+struct streambuf_chain
+{
+    static void compress(const std::string& in, std::string& out)
+    {
+        bio::filtering_streambuf<bio::output> sb;
+        sb.push(Compressor());
+        sb.push(bio::back_inserter(out));
+        sb.sputn(in.data(), in.size());
+        sb.pubsync();
+        sb.reset();
+    }
+    static void decompress(const std::string& in, std::string& out)
+    {
+        bio::filtering_streambuf<bio::input> sb;
+        sb.push(Decompressor());
+        sb.push(bio::array_source(in.data(), in.size()));
+        char buf[64*1024];
+        std::streamsize n;
+        while((n = sb.sgetn(buf, sizeof(buf))) > 0)
+            out.append(buf, n);
+    }
+};
+
+// best of repeat runs
+template<typename Chain>
+static result run_chain(const std::string& corpus, const std::string& data,
+                        const char* codec, const char* chain, int repeat)
+{
+    result r;
+    r.corpus = corpus;
+    r.codec = codec;
+    r.chain = chain;
+    r.raw_size = data.size();
+
+    bench_clock::duration best_comp = bench_clock::duration::max();
+    bench_clock::duration best_decomp = bench_clock::duration::max();
+    for(int i = 0; i < repeat; ++i)
+    {
+        std::string comp, decomp;
+        comp.reserve(data.size() + data.size() / 8);
+        decomp.reserve(data.size());
+
+        reset_peak_rss();
+        long before = rss_kb();
+        bench_clock::time_point start = bench_clock::now();
+        Chain::compress(data, comp);
+        best_comp = std::min(best_comp, bench_clock::now() - start);
+        r.comp_rss_kb = std::max(r.comp_rss_kb, peak_rss_kb() - before);
+
+        reset_peak_rss();
+        before = rss_kb();
+        start = bench_clock::now();
+        Chain::decompress(comp, decomp);
+        best_decomp = std::min(best_decomp, bench_clock::now() - start);
+        r.decomp_rss_kb = std::max(r.decomp_rss_kb, peak_rss_kb() - before);
+
+        if(decomp != data)
+            throw std::runtime_error(r.key() + ": decoded data differs");
+        r.comp_size = comp.size();
+    }
+    r.comp_mbs = mb_per_s(data.size(), best_comp);
+    r.decomp_mbs = mb_per_s(data.size(), best_decomp);
+    return r;
+}
+
+template<template<typename, typename> class Chain>
+static void run_codecs(const std::string& corpus, const std::string& data,
+                       const char* chain, int repeat, std::vector<result>& results)
+{
+    results.push_back(run_chain<Chain<lz4::lz4_compressor, lz4::lz4_decompressor> >(
+                          corpus, data, "lz4", chain, repeat));
+    results.push_back(run_chain<Chain<bio::gzip_compressor, bio::gzip_decompressor> >(
+                          corpus, data, "gzip", chain, repeat));
+}
+
+// one result per line, so that compare mode does not need a JSON library
+static void write_json(std::ostream& out, const std::vector<result>& results)
+{
+    out << "{\n  \"results\": [\n" << std::fixed << std::setprecision(2);
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const result& r = results[i];
+        out << "    {\"name\": \"" << r.key() << "\", \"raw_size\": " << r.raw_size
+            << ", \"comp_size\": " << r.comp_size << ", \"ratio\": " << r.ratio()
+            << ", \"comp_mbs\": " << r.comp_mbs << ", \"decomp_mbs\": " << r.decomp_mbs
+            << ", \"comp_rss_kb\": " << r.comp_rss_kb << ", \"decomp_rss_kb\": " << r.decomp_rss_kb
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void print_table(std::ostream& out, const std::vector<result>& results)
+{
+    out << std::left << std::setw(28) << "corpus/codec/chain" << std::right
+        << std::setw(8) << "ratio" << std::setw(12) << "comp MB/s" << std::setw(12) << "dec MB/s"
+        << std::setw(14) << "comp RSS KB" << std::setw(14) << "dec RSS KB" << "\n"
+        << std::fixed << std::setprecision(2);
+    for(const result& r : results)
+        out << std::left << std::setw(28) << r.key() << std::right
+            << std::setw(8) << r.ratio() << std::setw(12) << r.comp_mbs << std::setw(12) << r.decomp_mbs
+            << std::setw(14) << r.comp_rss_kb << std::setw(14) << r.decomp_rss_kb << "\n";
+}
+
+static int bench(size_t size, unsigned seed, int repeat, const std::string& json_path)
+{
+    std::vector<result> results;
+    for(const char* kind : corpus_kinds)
+    {
+        std::string data = make_corpus(kind, size, seed);
+        run_codecs<stream_chain>(kind, data, "stream", repeat, results);
+        run_codecs<copy_chain>(kind, data, "copy", repeat, results);
+        run_codecs<streambuf_chain>(kind, data, "streambuf", repeat, results);
+    }
+    print_table(std::cout, results);
+    if(!json_path.empty())
+    {
+        std::ofstream json(json_path);
+        write_json(json, results);
+        if(!json)
+        {
+            std::cerr << "cannot write " << json_path << std::endl;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+//------------------multi-stream scaling-------------------------------------//
+
+// every allocation of the program goes through these; while counting is
+// on, calls and the time spent in malloc() and free() are added up
+static std::atomic<bool> alloc_counting(false);
+static std::atomic<uint64_t> alloc_calls(0), alloc_ns(0);
+
+static void count_alloc(bench_clock::time_point start)
+{
+    alloc_ns.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           bench_clock::now() - start).count(), std::memory_order_relaxed);
+    alloc_calls.fetch_add(1, std::memory_order_relaxed);
+}
+
+void* operator new(std::size_t size)
+{
+    const bool counting = alloc_counting.load(std::memory_order_relaxed);
+    const bench_clock::time_point start = counting ? bench_clock::now() : bench_clock::time_point();
+    void* p = malloc(size ? size : 1);
+    if(counting)
+        count_alloc(start);
+    if(!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept
+{
+    if(!alloc_counting.load(std::memory_order_relaxed))
+        return free(p);
+    const bench_clock::time_point start = bench_clock::now();
+    free(p);
+    count_alloc(start);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+    operator delete(p);
+}
+
+struct scale_config
+{
+    unsigned threads, streams;
+    const char* block;
+    lz4::lz4_params params;
+    std::streamsize buffer;     // filter buffer, -1 = the filter's optimal size
+
+    std::string key() const
+    {
+        std::ostringstream s;
+        s << "scale/t" << threads << "/s" << streams << "/" << block << "/buf-";
+        if(buffer < 0) s << "default"; else s << buffer / 1024 << "K";
+        return s.str();
+    }
+};
+
+struct scale_result
+{
+    std::string name;
+    double comp_mbs = 0, decomp_mbs = 0;
+    // aggregate MB/s over threads x MB/s of the same chains on one thread
+    double comp_eff = 0, decomp_eff = 0;
+    uint64_t allocs = 0;
+    double alloc_ms = 0, alloc_pct = 0;     // summed over threads, share of their time
+    long rss_kb = 0;
+};
+
+static const size_t scale_chunk = 64*1024;
+
+// one thread: its streams are open at the same time and fed in turns,
+// one chunk each, the way a server interleaves connections
+static void scale_compress(const std::string& data, const scale_config& c,
+                           std::vector<std::string>& out)
+{
+    std::vector<std::unique_ptr<bio::filtering_ostream> > os;
+    for(unsigned k = 0; k < c.streams; ++k)
+    {
+        os.emplace_back(new bio::filtering_ostream);
+        os.back()->push(lz4::lz4_compressor(c.params), c.buffer);
+        os.back()->push(bio::back_inserter(out[k]));
+    }
+    const size_t slice = data.size() / c.streams;
+    for(size_t pos = 0; pos < slice; pos += scale_chunk)
+        for(unsigned k = 0; k < c.streams; ++k)
+            os[k]->write(data.data() + k * slice + pos, std::min(scale_chunk, slice - pos));
+    for(unsigned k = 0; k < c.streams; ++k)
+        os[k]->reset();
+}
+
+static void scale_decompress(const scale_config& c, const std::vector<std::string>& in,
+                             std::vector<std::string>& out)
+{
+    std::vector<std::unique_ptr<bio::filtering_istream> > is;
+    for(unsigned k = 0; k < c.streams; ++k)
+    {
+        is.emplace_back(new bio::filtering_istream);
+        is.back()->push(lz4::lz4_decompressor(), c.buffer);
+        is.back()->push(bio::array_source(in[k].data(), in[k].size()));
+    }
+    char buf[scale_chunk];
+    for(unsigned left = c.streams; left; )
+    {
+        for(unsigned k = 0; k < c.streams; ++k)
+        {
+            if(!*is[k])
+                continue;
+            is[k]->read(buf, sizeof(buf));
+            out[k].append(buf, is[k]->gcount());
+            if(!*is[k])
+                --left;
+        }
+    }
+}
+
+// wall time of fn(thread index) run on c.threads threads at once
+template<typename Fn>
+static bench_clock::duration run_threads(const scale_config& c, Fn fn)
+{
+    std::vector<std::thread> threads;
+    std::vector<std::exception_ptr> errors(c.threads);
+    const bench_clock::time_point start = bench_clock::now();
+    for(unsigned t = 0; t < c.threads; ++t)
+        threads.emplace_back([&, t] {
+            try { fn(t); } catch(...) { errors[t] = std::current_exception(); }
+        });
+    for(std::thread& t : threads)
+        t.join();
+    const bench_clock::duration elapsed = bench_clock::now() - start;
+    for(const std::exception_ptr& e : errors)
+        if(e)
+            std::rethrow_exception(e);
+    return elapsed;
+}
+
+// size bytes per thread, split between its streams
+static scale_result run_scale(const std::string& data, const scale_config& c)
+{
+    const size_t slice = data.size() / c.streams;
+    std::vector<std::vector<std::string> > comp(c.threads), decomp(c.threads);
+    for(unsigned t = 0; t < c.threads; ++t)
+    {
+        comp[t].resize(c.streams);
+        decomp[t].resize(c.streams);
+        for(unsigned k = 0; k < c.streams; ++k)
+        {
+            // outside of what is measured
+            comp[t][k].reserve(slice + slice / 8 + 1024);
+            decomp[t][k].reserve(slice);
+        }
+    }
+
+    reset_peak_rss();
+    const long before = rss_kb();
+    alloc_calls = 0;
+    alloc_ns = 0;
+    alloc_counting = true;
+    const bench_clock::duration comp_time =
+        run_threads(c, [&](unsigned t) { scale_compress(data, c, comp[t]); });
+    const bench_clock::duration decomp_time =
+        run_threads(c, [&](unsigned t) { scale_decompress(c, comp[t], decomp[t]); });
+    alloc_counting = false;
+
+    scale_result r;
+    r.name = c.key();
+    r.rss_kb = peak_rss_kb() - before;
+    r.comp_mbs = mb_per_s(slice * c.streams * c.threads, comp_time);
+    r.decomp_mbs = mb_per_s(slice * c.streams * c.threads, decomp_time);
+    r.allocs = alloc_calls;
+    r.alloc_ms = alloc_ns / 1e6;
+    const double thread_ms = c.threads *
+        std::chrono::duration<double, std::milli>(comp_time + decomp_time).count();
+    r.alloc_pct = thread_ms > 0 ? 100 * r.alloc_ms / thread_ms : 0;
+
+    for(unsigned t = 0; t < c.threads; ++t)
+        for(unsigned k = 0; k < c.streams; ++k)
+            if(decomp[t][k].compare(0, std::string::npos, data, k * slice, slice) != 0)
+                throw std::runtime_error(r.name + ": decoded data differs");
+    return r;
+}
+
+static void write_scale_json(std::ostream& out, const std::vector<scale_result>& results)
+{
+    out << "{\n  \"results\": [\n" << std::fixed << std::setprecision(2);
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        const scale_result& r = results[i];
+        // comp_rss_kb: compare mode checks it like the one of --bench
+        out << "    {\"name\": \"" << r.name << "\", \"comp_mbs\": " << r.comp_mbs
+            << ", \"decomp_mbs\": " << r.decomp_mbs << ", \"comp_eff\": " << r.comp_eff
+            << ", \"decomp_eff\": " << r.decomp_eff << ", \"allocs\": " << r.allocs
+            << ", \"alloc_ms\": " << r.alloc_ms << ", \"alloc_pct\": " << r.alloc_pct
+            << ", \"comp_rss_kb\": " << r.rss_kb
+            << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "  ]\n}\n";
+}
+
+static void print_scale_table(std::ostream& out, const std::vector<scale_result>& results)
+{
+    out << std::left << std::setw(40) << "threads/streams/block/buffer" << std::right
+        << std::setw(11) << "comp MB/s" << std::setw(7) << "eff" << std::setw(11) << "dec MB/s"
+        << std::setw(7) << "eff" << std::setw(9) << "allocs" << std::setw(11) << "alloc ms"
+        << std::setw(8) << "alloc%" << std::setw(10) << "RSS KB" << "\n"
+        << std::fixed << std::setprecision(2);
+    for(const scale_result& r : results)
+        out << std::left << std::setw(40) << r.name << std::right
+            << std::setw(11) << r.comp_mbs << std::setw(7) << r.comp_eff
+            << std::setw(11) << r.decomp_mbs << std::setw(7) << r.decomp_eff
+            << std::setw(9) << r.allocs << std::setw(11) << r.alloc_ms
+            << std::setw(8) << r.alloc_pct << std::setw(10) << r.rss_kb << "\n";
+}
+
+// threads 1, 2, 4 .. max_threads x 1 and max_streams streams per thread
+// x block sizes x filter buffer sizes, on the logs corpus
+static int scale(size_t size, unsigned seed, unsigned max_threads, unsigned max_streams,
+                 const std::string& json_path)
+{
+    const std::string data = make_corpus("logs", size, seed);
+    lz4::lz4_params frame_64k(lz4::lz4::frame), frame_4m(lz4::lz4::frame);
+    frame_64k.block_size_id = 4;
+    frame_4m.block_size_id = 7;
+    const struct { const char* name; lz4::lz4_params params; } blocks[] = {
+        { "legacy-8M", lz4::lz4_params() }, { "frame-64K", frame_64k }, { "frame-4M", frame_4m } };
+    const std::streamsize buffers[] = { -1, 64*1024 };
+
+    std::vector<unsigned> threads;
+    for(unsigned t = 1; t < max_threads; t *= 2)
+        threads.push_back(t);
+    threads.push_back(max_threads);
+    std::vector<unsigned> streams(1, 1);
+    if(max_streams > 1)
+        streams.push_back(max_streams);
+
+    std::vector<scale_result> results;
+    for(unsigned s : streams)
+        for(const auto& b : blocks)
+            for(std::streamsize buffer : buffers)
+            {
+                scale_result single;
+                for(unsigned t : threads)
+                {
+                    scale_config c = { t, s, b.name, b.params, buffer };
+                    scale_result r = run_scale(data, c);
+                    if(t == 1)
+                        single = r;
+                    r.comp_eff = single.comp_mbs > 0 ? r.comp_mbs / (t * single.comp_mbs) : 0;
+                    r.decomp_eff = single.decomp_mbs > 0 ? r.decomp_mbs / (t * single.decomp_mbs) : 0;
+                    results.push_back(r);
+                }
+            }
+    print_scale_table(std::cout, results);
+    if(!json_path.empty())
+    {
+        std::ofstream json(json_path);
+        write_scale_json(json, results);
+        if(!json)
+        {
+            std::cerr << "cannot write " << json_path << std::endl;
+            return 2;
+        }
+    }
+    return 0;
+}
+
+//------------------compare mode---------------------------------------------//
+
+static double json_number(const std::string& line, const std::string& field)
+{
+    size_t pos = line.find("\"" + field + "\": ");
+    return pos == std::string::npos ? 0 : atof(line.c_str() + pos + field.size() + 4);
+}
+
+static std::map<std::string, result> read_json(const std::string& path)
+{
+    std::ifstream in(path);
+    if(!in)
+        throw std::runtime_error("cannot open " + path);
+    std::map<std::string, result> results;
+    std::string line;
+    while(std::getline(in, line))
+    {
+        size_t pos = line.find("\"name\": \"");
+        if(pos == std::string::npos)
+            continue;
+        pos += 9;
+        result r;
+        std::string name = line.substr(pos, line.find('"', pos) - pos);
+        r.raw_size = json_number(line, "raw_size");
+        r.comp_size = json_number(line, "comp_size");
+        r.comp_mbs = json_number(line, "comp_mbs");
+        r.decomp_mbs = json_number(line, "decomp_mbs");
+        r.comp_rss_kb = json_number(line, "comp_rss_kb");
+        r.decomp_rss_kb = json_number(line, "decomp_rss_kb");
+        results[name] = r;
+    }
+    return results;
+}
+
+// fails when a throughput drops, or a size or memory peak grows,
+// by more than threshold percent
+static int compare(const std::string& baseline_path, const std::string& current_path, double threshold)
+{
+    std::map<std::string, result> baseline = read_json(baseline_path);
+    std::map<std::string, result> current = read_json(current_path);
+    int regressions = 0;
+    const double limit = threshold / 100;
+    for(const auto& b : baseline)
+    {
+        auto c = current.find(b.first);
+        if(c == current.end())
+        {
+            std::cerr << COLOR_RED << b.first << ": missing from " << current_path << COLOR_RESET << std::endl;
+            ++regressions;
+            continue;
+        }
+        struct { const char* what; double base, cur; bool higher_is_better; } checks[] = {
+            { "comp MB/s", b.second.comp_mbs, c->second.comp_mbs, true },
+            { "decomp MB/s", b.second.decomp_mbs, c->second.decomp_mbs, true },
+            { "compressed size", (double)b.second.comp_size, (double)c->second.comp_size, false },
+            { "comp RSS", (double)b.second.comp_rss_kb, (double)c->second.comp_rss_kb, false },
+            { "decomp RSS", (double)b.second.decomp_rss_kb, (double)c->second.decomp_rss_kb, false },
+        };
+        for(const auto& check : checks)
+        {
+            if(check.base <= 0)
+                continue;
+            double change = (check.cur - check.base) / check.base;
+            bool worse = check.higher_is_better ? change < -limit : change > limit;
+            if(worse)
+            {
+                std::cerr << COLOR_RED << b.first << ": " << check.what << " " << check.base
+                          << " -> " << check.cur << std::showpos << " (" << std::setprecision(1) << std::fixed
+                          << change * 100 << "%)" << std::noshowpos << COLOR_RESET << std::endl;
+                ++regressions;
+            }
+        }
+    }
+    if(regressions)
+        std::cerr << regressions << " regression(s) above " << threshold << "%" << std::endl;
+    else
+        std::cerr << COLOR_GREEN << "no regression above " << threshold << "%" << COLOR_RESET << std::endl;
+    return regressions ? 1 : 0;
+}
+
+static int usage(const char* argv0)
+{
+    std::cerr << "usage: " << argv0 << " FILE\n"
+                 "           compare FILE.lz4 and FILE.gz contents\n"
+              << "       " << argv0 << " --bench [--size MB] [--seed N] [--repeat N] [--json OUT]\n"
+                 "           lz4 vs gzip on a synthetic corpus (text, logs, binary, random)\n"
+              << "       " << argv0 << " --scale [--size MB] [--seed N] [--threads N] [--streams N] [--json OUT]\n"
+                 "           lz4 on 1, 2, 4 .. N threads, each with 1 or N streams open at once,\n"
+                 "           for several block and buffer sizes; MB per thread (default 8)\n"
+              << "       " << argv0 << " --compare BASELINE.json CURRENT.json [--threshold PERCENT]\n"
+                 "           exit status 1 on regressions above the threshold (default 10%)\n";
+    return -1;
+}
+
+int main(int argc, char const *argv[])
+{
+    if(argc < 2)
+    {
+        return usage(argv[0]);
+    }
+
+    std::string mode = argv[1];
+    try
+    {
+        if(mode == "--bench")
+        {
+            size_t size = 16;
+            unsigned seed = 42;
+            int repeat = 3;
+            std::string json;
+            for(int i = 2; i + 1 < argc; i += 2)
+            {
+                std::string opt = argv[i];
+                if(opt == "--size") size = atol(argv[i + 1]);
+                else if(opt == "--seed") seed = atol(argv[i + 1]);
+                else if(opt == "--repeat") repeat = std::max(1, atoi(argv[i + 1]));
+                else if(opt == "--json") json = argv[i + 1];
+                else return usage(argv[0]);
+            }
+            return bench(size * 1024 * 1024, seed, repeat, json);
+        }
+        if(mode == "--scale")
+        {
+            size_t size = 8;
+            unsigned seed = 42;
+            unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+            unsigned streams = 4;
+            std::string json;
+            for(int i = 2; i + 1 < argc; i += 2)
+            {
+                std::string opt = argv[i];
+                if(opt == "--size") size = atol(argv[i + 1]);
+                else if(opt == "--seed") seed = atol(argv[i + 1]);
+                else if(opt == "--threads") threads = std::max(1, atoi(argv[i + 1]));
+                else if(opt == "--streams") streams = std::max(1, atoi(argv[i + 1]));
+                else if(opt == "--json") json = argv[i + 1];
+                else return usage(argv[0]);
+            }
+            return scale(size * 1024 * 1024, seed, threads, streams, json);
+        }
+        if(mode == "--compare")
+        {
+            if(argc != 4 && !(argc == 6 && std::string(argv[4]) == "--threshold"))
+                return usage(argv[0]);
+            return compare(argv[2], argv[3], argc == 6 ? atof(argv[5]) : 10.0);
+        }
+        if(mode[0] == '-')
+            return usage(argv[0]);
+        return compare_files(mode);
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << COLOR_RED << e.what() << COLOR_RESET << std::endl;
+        return 2;
+    }
+}
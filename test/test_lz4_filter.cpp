@@ -1,10 +1,27 @@
 #include <gtest/gtest.h>
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <boost/iostreams/filtering_stream.hpp>
 #include <boost/iostreams/filter/gzip.hpp>
 #include <boost/iostreams/copy.hpp>
+#include <boost/iostreams/stream.hpp>
+#include <atomic>
+#include <set>
+#include <lz4.h>
+#include <lz4frame.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <thread>
 #include "../lz4_filter.hpp"
+#include "../lz4_asio.hpp"
+#include "../lz4_auto.hpp"
+#include "../lz4_shuffle.hpp"
+#include "../lz4_transcode.hpp"
+#include "../lz4_blocks.hpp"
+#include "../lz4_log.hpp"
+#include "../lz4_buffer.hpp"
+#include <unistd.h>
 
 namespace bio = boost::iostreams;
 namespace ext { namespace bio = ext::boost::iostreams; }
@@ -24,6 +41,27 @@ const uint8_t ref_comp_data[] = {
     0xc9, 0x50, 0x36, 0x37, 0x38, 0x39, 0x30
 };
 
+// reference LZ4S frame of ref_raw_data, as written by
+// `lz4 --content-size -BX`: content size, block and content checksums
+const uint8_t ref_lz4s_data[] = {
+    // magic
+    0x04, 0x22, 0x4d, 0x18,
+    // FLG, BD, content size (1000), HC
+    0x7c, 0x40, 0xe8, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3d,
+    // block 1 size
+    0x17, 0x00, 0x00, 0x00,
+    // block 1 data
+    0xaf, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x30, 0x0a, 0x00, 0xff, 0xff, 0xff,
+    0xc9, 0x50, 0x36, 0x37, 0x38, 0x39, 0x30,
+    // block 1 checksum
+    0xdf, 0x30, 0xf7, 0x74,
+    // end mark
+    0x00, 0x00, 0x00, 0x00,
+    // content checksum
+    0xcc, 0xf1, 0x16, 0x7b
+};
+
 TEST(lz4_decompress, streambuf_reference_data) {
     std::stringstream src(std::string((const char*)ref_comp_data, sizeof(ref_comp_data)));
     bio::filtering_streambuf<bio::input> in;
@@ -433,6 +471,1804 @@ TEST(lz4_decompress, zero_length_data) {
     ASSERT_EQ( buf.str().size(), 0 );
 }
 
+std::string random_string(size_t size){
+    std::string s(size, 0);
+    std::ifstream ifurandom( "/dev/urandom" );
+    ifurandom.read( &s[0], size );
+    return s;
+}
+
+TEST(lz4_multichar, same_output_as_symmetric) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(RANDOM_DATA_SIZE, 'x');
+
+    std::stringbuf buf1, buf2;
+    {
+        std::ostream out( &buf1 );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor() );
+        bifo.push( out );
+        bifo.write( data.data(), data.size() );
+    }
+    {
+        std::ostream out( &buf2 );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor() );
+        bifo.push( out );
+        bifo.write( data.data(), data.size() );
+    }
+    ASSERT_EQ( buf1.str(), buf2.str() );
+
+    std::string s1;
+    {
+        bio::filtering_istream bifi;
+        std::istream in( &buf2 );
+        bifi.push( ext::bio::lz4_multichar_decompressor() );
+        bifi.push( in );
+        bifi.exceptions( std::ifstream::badbit );
+        std::stringbuf buf3;
+        std::ostream out( &buf3 );
+        boost::iostreams::copy(bifi, out);
+        s1 = buf3.str();
+    }
+    ASSERT_EQ( data, s1 );
+}
+
+TEST(lz4_multichar, direct_read) {
+    std::string data = random_string(RANDOM_DATA_SIZE);
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor() );
+        bifo.push( out );
+        bifo << data;
+    }
+
+    std::istream in( &buf );
+    ext::bio::lz4_multichar_decompressor d;
+    std::vector<char> out_buf( data.size() + 1 );
+    std::streamsize total = 0, n;
+    while( (n = d.read(in, &out_buf[total], out_buf.size() - total)) > 0 ){
+        total += n;
+    }
+    ASSERT_EQ( data, std::string(&out_buf[0], total) );
+}
+
+TEST(lz4_multichar, empty_data) {
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor() );
+        bifo.push( out );
+    }
+    ASSERT_EQ( std::string((const char*)ref_comp_data, 4), buf.str() );
+}
+
+struct counting_source {
+    typedef char char_type;
+    typedef bio::source_tag category;
+    std::istream& in;
+    std::streamsize total;
+    explicit counting_source(std::istream& in) : in(in), total(0) { }
+    std::streamsize read(char* s, std::streamsize n){
+        in.read(s, n);
+        std::streamsize amt = in.gcount();
+        total += amt;
+        return amt ? amt : -1;
+    }
+};
+
+void test_peek(const ext::bio::lz4_params& params){
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(10*1024*1024, 'x');
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor(params) );
+        bifo.push( out );
+        bifo << data;
+    }
+    std::string compressed = buf.str();
+
+    std::istream in( &buf );
+    counting_source src( in );
+    ext::bio::lz4_multichar_decompressor d;
+    char head[100];
+    ASSERT_EQ( 100, d.peek(src, head, sizeof(head)) );
+    ASSERT_EQ( data.substr(0, 100), std::string(head, 100) );
+
+    std::vector<char> out_buf( data.size() + 1 );
+    std::streamsize total = 0, n;
+    while( (n = d.read(src, &out_buf[total], out_buf.size() - total)) > 0 ){
+        total += n;
+    }
+    ASSERT_EQ( data, std::string(&out_buf[0], total) );
+    // the peeked block was not read from the source a second time
+    ASSERT_EQ( (std::streamsize)compressed.size(), src.total );
+}
+
+TEST(lz4_multichar, peek_legacy) {
+    test_peek( ext::bio::lz4_params() );
+}
+
+TEST(lz4_multichar, peek_frame) {
+    test_peek( ext::bio::lz4_params(ext::bio::lz4::frame) );
+}
+
+TEST(lz4_multichar, peek_after_read) {
+    std::string data = random_string(RANDOM_DATA_SIZE);
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor() );
+        bifo.push( out );
+        bifo << data;
+    }
+    std::istream in( &buf );
+    ext::bio::lz4_multichar_decompressor d;
+    char head[100];
+    ASSERT_EQ( 100, d.read(in, head, sizeof(head)) );
+    ASSERT_THROW( d.peek(in, head, sizeof(head)), std::logic_error );
+}
+
+TEST(lz4_file, source_sink_roundtrip) {
+    std::string path = testing::TempDir() + "lz4_file_roundtrip.lz4";
+    std::string data = random_string(RANDOM_DATA_SIZE / 3) + ref_raw_data;
+    {
+        bio::stream<ext::bio::lz4_file_sink> out( path );
+        out.write( data.data(), data.size() );
+    }
+
+    ext::bio::lz4_file_source src( path );
+    ASSERT_TRUE( src.is_open() );
+    std::string s1( data.size() * 2, 0 );
+    std::streamsize n = src.read( &s1[0], s1.size() );
+    src.close();
+    ASSERT_EQ( data, s1.substr(0, n) );
+    std::remove( path.c_str() );
+}
+
+TEST(xxh32, reference_values) {
+    ASSERT_EQ( 0x02CC5D05u, ext::bio::lz4::xxh32("", 0) );
+    ASSERT_EQ( 0x74f730dfu, ext::bio::lz4::xxh32(ref_lz4s_data + 19, 0x17) );
+    ASSERT_EQ( 0x7b16f1ccu, ext::bio::lz4::xxh32(ref_raw_data, strlen(ref_raw_data)) );
+
+    // streaming in odd pieces gives the same digest
+    ext::bio::lz4::xxh32_state state;
+    ext::bio::lz4::xxh32_reset(state);
+    for( size_t i=0; i<strlen(ref_raw_data); i+=7 ){
+        ext::bio::lz4::xxh32_update(state, ref_raw_data + i, std::min<size_t>(7, strlen(ref_raw_data) - i));
+    }
+    ASSERT_EQ( 0x7b16f1ccu, ext::bio::lz4::xxh32_digest(state) );
+}
+
+TEST(lz4s, decompress_reference_data) {
+    std::stringbuf ibuf(std::string((const char*)ref_lz4s_data, sizeof(ref_lz4s_data)));
+    std::stringbuf obuf;
+    ext::bio::lz4_decompressor d;
+    {
+        bio::filtering_istream bifi;
+        std::istream in( &ibuf );
+        bifi.push( d );
+        bifi.push( in );
+        bifi.exceptions( std::ifstream::badbit );
+        std::ostream out( &obuf );
+        boost::iostreams::copy(bifi, out);
+    }
+    ASSERT_EQ( ref_raw_data, obuf.str() );
+}
+
+TEST(lz4s, compress_reference_data) {
+    ext::bio::lz4_params p(ext::bio::lz4::frame, strlen(ref_raw_data));
+    p.block_size_id = 4;
+    p.block_checksum = true;
+
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( out );
+        bifo.exceptions( std::ifstream::eofbit | std::ifstream::failbit | std::ifstream::badbit );
+        bifo << ref_raw_data;
+    }
+    ASSERT_EQ( std::string((const char*)ref_lz4s_data, sizeof(ref_lz4s_data)), buf.str() );
+}
+
+TEST(lz4s, content_size_before_first_byte) {
+    std::stringbuf buf(std::string((const char*)ref_lz4s_data, sizeof(ref_lz4s_data)));
+    std::istream in( &buf );
+    ext::bio::lz4_multichar_decompressor d;
+    ASSERT_EQ( 1000, d.content_size(in) );
+
+    std::string s;
+    s.reserve( d.content_size(in) );
+    bio::filtering_istream bifi;
+    bifi.push( d );
+    bifi.push( in );
+    boost::iostreams::copy(bifi, boost::iostreams::back_inserter(s));
+    ASSERT_EQ( ref_raw_data, s );
+}
+
+TEST(lz4s, content_size_mismatch) {
+    ext::bio::lz4_params p(ext::bio::lz4::frame, 10);
+    std::stringbuf buf;
+    std::ostream out( &buf );
+    bio::filtering_ostream bifo;
+    bifo.push( ext::bio::lz4_compressor(p) );
+    bifo.push( out );
+    bifo << "123456789";
+    ASSERT_THROW( bifo.pop(), std::runtime_error );
+}
+
+TEST(lz4s, bad_header_checksum) {
+    std::string data((const char*)ref_lz4s_data, sizeof(ref_lz4s_data));
+    data[14] ^= 1;
+    std::stringbuf buf(data);
+    bio::filtering_istream bifi;
+    std::istream in( &buf );
+    bifi.push( ext::bio::lz4_decompressor() );
+    bifi.push( in );
+    std::ofstream out;
+    ASSERT_THROW( boost::iostreams::copy(bifi, out), std::runtime_error );
+}
+
+TEST(lz4s, premature_eof) {
+    for( unsigned int i=1; i<sizeof(ref_lz4s_data); i++ ){
+        std::stringbuf buf(std::string((const char*)ref_lz4s_data, i));
+        bio::filtering_istream bifi;
+        std::istream in( &buf );
+        bifi.push( ext::bio::lz4_decompressor() );
+        bifi.push( in );
+        std::ofstream out;
+        ASSERT_THROW( boost::iostreams::copy(bifi, out), std::runtime_error ) << i;
+    }
+}
+
+void test_lz4s_comp_decomp(const std::string& data, const ext::bio::lz4_params& p){
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( out );
+        bifo.write( data.data(), data.size() );
+    }
+    // two frames in a row decode as one stream
+    std::string twice = buf.str() + buf.str();
+    std::stringbuf buf2(twice);
+    std::string s1;
+    {
+        bio::filtering_istream bifi;
+        std::istream in( &buf2 );
+        bifi.push( ext::bio::lz4_decompressor() );
+        bifi.push( in );
+        bifi.exceptions( std::ifstream::badbit );
+        boost::iostreams::copy(bifi, boost::iostreams::back_inserter(s1));
+    }
+    ASSERT_EQ( data + data, s1 );
+}
+
+TEST(lz4s, comp_decomp) {
+    std::string data = random_string(RANDOM_DATA_SIZE / 2) + std::string(RANDOM_DATA_SIZE, 'x');
+    for( unsigned int id=4; id<=7; id++ ){
+        ext::bio::lz4_params p(ext::bio::lz4::frame, data.size());
+        p.block_size_id = id;
+        p.block_checksum = id & 1;
+        test_lz4s_comp_decomp(data, p);
+    }
+    test_lz4s_comp_decomp("", ext::bio::lz4_params(ext::bio::lz4::frame, 0));
+}
+
+std::string decompress_string(const std::string& data){
+    std::stringbuf buf(data);
+    std::string s;
+    bio::filtering_istream bifi;
+    std::istream in( &buf );
+    bifi.push( ext::bio::lz4_decompressor() );
+    bifi.push( in );
+    bifi.exceptions( std::ifstream::badbit );
+    boost::iostreams::copy(bifi, boost::iostreams::back_inserter(s));
+    return s;
+}
+
+TEST(lz4_streaming, min_block_size) {
+    ext::bio::lz4_params p;
+    p.max_buffered = 64*1024;
+    p.min_block_size = 1000;
+
+    std::stringbuf buf;
+    std::ostream out( &buf );
+    bio::filtering_ostream bifo;
+    bifo.push( ext::bio::lz4_compressor(p) );
+    bifo.push( out );
+
+    bifo << "short record\n";
+    bifo.flush();
+    ASSERT_EQ( 4, buf.str().size() ); // header only, the record is held
+
+    std::string data = "short record\n";
+    for( int i=0; i<100; i++ ){
+        bifo << "another record\n";
+        data += "another record\n";
+    }
+    bifo.flush();
+    ASSERT_EQ( data, decompress_string(buf.str()) ); // block boundary, stream goes on
+
+    bifo << "tail";
+    bifo.pop();
+    ASSERT_EQ( data + "tail", decompress_string(buf.str()) );
+}
+
+TEST(lz4_streaming, sync_flush) {
+    ext::bio::lz4_params p(ext::bio::lz4::frame);
+    p.max_buffered = 64*1024;
+    p.min_block_size = 1000;
+
+    std::stringbuf buf;
+    std::ostream out( &buf );
+    ext::bio::lz4_compressor c(p);
+    bio::filtering_ostream bifo;
+    bifo.push( c );
+    bifo.push( out );
+
+    bifo << ref_raw_data;
+    bifo.flush();
+    size_t size = buf.str().size();
+    bifo << "1234567890";
+    c.sync_flush();
+    bifo.flush();
+    ASSERT_LT( size, buf.str().size() );
+
+    bifo.pop();
+    ASSERT_EQ( std::string(ref_raw_data) + "1234567890", decompress_string(buf.str()) );
+}
+
+TEST(lz4_streaming, max_age) {
+    ext::bio::lz4_params p;
+    p.max_buffered = 64*1024;
+    p.min_block_size = 1000;
+    p.max_age_ms = 5;
+
+    std::stringbuf buf;
+    std::ostream out( &buf );
+    bio::filtering_ostream bifo;
+    bifo.push( ext::bio::lz4_compressor(p) );
+    bifo.push( out );
+
+    bifo << "1234567890";
+    bifo.flush();
+    ASSERT_EQ( 4, buf.str().size() );
+    std::this_thread::sleep_for( std::chrono::milliseconds(10) );
+    bifo.flush();
+    ASSERT_EQ( "1234567890", decompress_string(buf.str()) );
+}
+
+TEST(lz4_streaming, max_buffered) {
+    ext::bio::lz4_params p;
+    p.max_buffered = 64*1024;
+    p.min_block_size = 1024*1024;
+
+    std::string data = random_string(200*1024);
+    std::stringbuf buf;
+    std::ostream out( &buf );
+    bio::filtering_ostream bifo;
+    bifo.push( ext::bio::lz4_compressor(p) );
+    bifo.push( out );
+    bifo.write( data.data(), data.size() );
+    bifo.flush();
+    // three full blocks are out, the rest waits for min_block_size
+    ASSERT_EQ( data.substr(0, 3*64*1024), decompress_string(buf.str()) );
+    bifo.pop();
+    ASSERT_EQ( data, decompress_string(buf.str()) );
+}
+
+TEST(lz4_readahead, comp_decomp) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(RANDOM_DATA_SIZE, 'x');
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor() );
+        bifo.push( out );
+        bifo.write( data.data(), data.size() );
+    }
+
+    std::istream in( &buf );
+    std::string s;
+    {
+        bio::filtering_istream bifi;
+        bifi.push( ext::bio::lz4_decompressor() );
+        bifi.push( ext::bio::lz4_readahead_source(in, 2, 100000) );
+        bifi.exceptions( std::ifstream::badbit );
+        boost::iostreams::copy(bifi, boost::iostreams::back_inserter(s));
+    }
+    ASSERT_EQ( data, s );
+}
+
+struct failing_source {
+    typedef char char_type;
+    typedef bio::source_tag category;
+    std::streamsize read(char*, std::streamsize) { throw std::runtime_error("I/O error"); }
+};
+
+TEST(lz4_readahead, error_is_rethrown) {
+    failing_source src;
+    ext::bio::lz4_readahead_source ra(src);
+    char c;
+    ASSERT_THROW( ra.read(&c, 1), std::runtime_error );
+}
+
+// never has data yet, as a non-blocking socket with nothing to read
+struct idle_source {
+    typedef char char_type;
+    typedef bio::source_tag category;
+    std::atomic<int>* calls;
+    std::streamsize read(char*, std::streamsize) { ++*calls; return 0; }
+};
+
+TEST(lz4_readahead, idle_source_backs_off) {
+    std::atomic<int> calls( 0 );
+    idle_source src = { &calls };
+    {
+        ext::bio::lz4_readahead_source ra(src);
+        std::this_thread::sleep_for( std::chrono::milliseconds(200) );
+        ASSERT_GT( calls.load(), 5 );
+        // 10 ms apart once backed off
+        ASSERT_LT( calls.load(), 60 );
+        ra.close();
+    }
+}
+
+template<typename Decompressor>
+std::string decompress_with(const std::string& data){
+    std::stringbuf buf(data);
+    std::string s;
+    bio::filtering_istream bifi;
+    std::istream in( &buf );
+    bifi.push( Decompressor() );
+    bifi.push( in );
+    bifi.exceptions( std::ifstream::badbit );
+    boost::iostreams::copy(bifi, boost::iostreams::back_inserter(s));
+    return s;
+}
+
+typedef ext::bio::basic_lz4_decompressor<std::allocator<char>,
+    ext::bio::lz4::frame_format, ext::bio::lz4::verify_checksums> lz4_verifying_frame_decompressor;
+
+TEST(lz4_fixed_format, legacy) {
+    std::string legacy((const char*)ref_comp_data, sizeof(ref_comp_data));
+    std::string frame((const char*)ref_lz4s_data, sizeof(ref_lz4s_data));
+    ASSERT_EQ( ref_raw_data, decompress_with<ext::bio::lz4_legacy_decompressor>(legacy) );
+    ASSERT_THROW( decompress_with<ext::bio::lz4_legacy_decompressor>(frame), std::runtime_error );
+}
+
+TEST(lz4_fixed_format, frame) {
+    std::string legacy((const char*)ref_comp_data, sizeof(ref_comp_data));
+    std::string frame((const char*)ref_lz4s_data, sizeof(ref_lz4s_data));
+    ASSERT_EQ( ref_raw_data, decompress_with<ext::bio::lz4_frame_decompressor>(frame) );
+    ASSERT_EQ( ref_raw_data, decompress_with<lz4_verifying_frame_decompressor>(frame) );
+    ASSERT_THROW( decompress_with<ext::bio::lz4_frame_decompressor>(legacy), std::runtime_error );
+}
+
+TEST(lz4_fixed_format, verify_checksums) {
+    std::string frame((const char*)ref_lz4s_data, sizeof(ref_lz4s_data));
+    std::string bad_block = frame, bad_content = frame;
+    bad_block[sizeof(ref_lz4s_data) - 12] ^= 1;    // block checksum
+    bad_content[sizeof(ref_lz4s_data) - 1] ^= 1;   // content checksum
+
+    // skipped by default
+    ASSERT_EQ( ref_raw_data, decompress_with<ext::bio::lz4_frame_decompressor>(bad_block) );
+    ASSERT_EQ( ref_raw_data, decompress_with<ext::bio::lz4_decompressor>(bad_content) );
+
+    ASSERT_THROW( decompress_with<lz4_verifying_frame_decompressor>(bad_block), std::runtime_error );
+    ASSERT_THROW( decompress_with<lz4_verifying_frame_decompressor>(bad_content), std::runtime_error );
+}
+
+void test_asio_comp_decomp(const ext::bio::lz4_params& params){
+    std::string part1 = random_string(RANDOM_DATA_SIZE);
+    std::string part2(3*1024*1024, 'x');
+    std::vector<boost::asio::const_buffer> message = {
+        boost::asio::buffer(part1), boost::asio::buffer(part2) };
+
+    ext::bio::lz4_asio_compressor c(params);
+    boost::asio::const_buffer compressed = c.compress(message);
+    std::string frame((const char*)compressed.data(), compressed.size());
+    // the same stream as through the filters
+    ASSERT_EQ( part1 + part2, decompress_string(frame) );
+
+    // received in pieces, decoded into two buffers at a time
+    ext::bio::lz4_asio_decompressor d;
+    std::string out(part1.size() + part2.size(), '\0');
+    size_t in_pos = 0, out_pos = 0;
+    bool done = false;
+    while( !done ){
+        size_t amt = std::min<size_t>(frame.size() - in_pos, 1000);
+        size_t room = std::min<size_t>(out.size() - out_pos, 150000);
+        std::array<boost::asio::mutable_buffer, 2> dst = {
+            boost::asio::buffer(&out[out_pos], room / 2),
+            boost::asio::buffer(&out[out_pos + room / 2], room - room / 2) };
+        ext::bio::lz4_asio_result r =
+            d.decompress(boost::asio::buffer(&frame[in_pos], amt), dst, in_pos + amt == frame.size());
+        in_pos += r.consumed;
+        out_pos += r.produced;
+        done = r.done;
+    }
+    ASSERT_EQ( frame.size(), in_pos );
+    ASSERT_EQ( part1 + part2, out );
+}
+
+TEST(lz4_asio, comp_decomp_legacy) {
+    test_asio_comp_decomp( ext::bio::lz4_params() );
+}
+
+TEST(lz4_asio, comp_decomp_frame) {
+    test_asio_comp_decomp( ext::bio::lz4_params(ext::bio::lz4::frame) );
+}
+
+TEST(lz4_asio, scatter_gather_reference_data) {
+    ext::bio::lz4_params params(ext::bio::lz4::frame, 1000);
+    params.block_size_id = 4;
+    params.block_checksum = true;
+    ext::bio::lz4_asio_compressor c(params);
+    // protocol header and compressed body, as handed to async_write
+    std::string rpc_header = "RPC1";
+    std::array<boost::asio::const_buffer, 2> packet = {
+        boost::asio::buffer(rpc_header), c.compress(boost::asio::buffer(ref_raw_data, 1000)) };
+    std::string sent(boost::asio::buffer_size(packet), '\0');
+    boost::asio::buffer_copy(boost::asio::buffer(&sent[0], sent.size()), packet);
+    ASSERT_EQ( rpc_header + std::string((const char*)ref_lz4s_data, sizeof(ref_lz4s_data)), sent );
+}
+
+TEST(lz4_asio, truncated_stream) {
+    ext::bio::lz4_asio_compressor c;
+    boost::asio::const_buffer compressed = c.compress(boost::asio::buffer(ref_raw_data, 1000));
+    ext::bio::lz4_asio_decompressor d;
+    std::vector<char> out(1000);
+    ASSERT_THROW( d.decompress(boost::asio::buffer(compressed.data(), compressed.size() - 1),
+                               boost::asio::buffer(out), true), std::runtime_error );
+}
+
+TEST(lz4_latency, histogram_percentiles) {
+    ext::bio::lz4::latency_histogram h;
+    ASSERT_EQ( 0u, h.percentile(99) );
+    for( uint64_t ns = 1; ns <= 1000; ++ns )
+        h.record( ns * 1000 );
+    ASSERT_EQ( 1000u, h.count() );
+    ASSERT_EQ( 1000000u, h.max() );
+    // within the bucket error
+    ASSERT_NEAR( 500000.0, (double)h.percentile(50), 500000 * 0.0625 );
+    ASSERT_NEAR( 990000.0, (double)h.percentile(99), 990000 * 0.0625 );
+    ASSERT_EQ( h.max(), h.percentile(100) );
+    h.record( 3 );
+    ASSERT_EQ( 3u, h.percentile(0) );
+}
+
+TEST(lz4_latency, filters_record_blocks) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(20*1024*1024, 'x');
+    ext::bio::lz4::latency_histogram comp, decomp;
+    std::stringbuf buf;
+    {
+        ext::bio::lz4_compressor c;
+        c.set_latency_histogram( &comp );
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( c );
+        bifo.push( out );
+        bifo << data;
+    }
+    // one per 8 MB legacy block
+    ASSERT_EQ( (data.size() + ext::bio::lz4::legacy_blocksize - 1) / ext::bio::lz4::legacy_blocksize,
+               comp.count() );
+
+    ext::bio::lz4_decompressor d;
+    d.set_latency_histogram( &decomp );
+    std::istream in( &buf );
+    bio::filtering_istream bifi;
+    bifi.push( d );
+    bifi.push( in );
+    std::stringbuf out_buf;
+    std::ostream out( &out_buf );
+    bio::copy( bifi, out );
+    ASSERT_EQ( data.size(), out_buf.str().size() );
+    ASSERT_EQ( comp.count(), decomp.count() );
+    ASSERT_GT( decomp.max(), 0u );
+}
+
+TEST(lz4_executor, round_robin_between_streams) {
+    ext::bio::lz4::executor ex(1);
+    std::atomic<int> a_done(0);
+    int a_done_when_b_ran = -1;
+    {
+        ext::bio::lz4::executor::stream a(ex, 100), b(ex);
+        for( int i = 0; i < 50; ++i )
+            a.submit([&a_done]{ std::this_thread::sleep_for(std::chrono::milliseconds(1)); ++a_done; });
+        b.submit([&]{ a_done_when_b_ran = a_done; });
+    }
+    ASSERT_EQ( 50, a_done );
+    // b did not wait for the whole backlog of a
+    ASSERT_GE( a_done_when_b_ran, 0 );
+    ASSERT_LT( a_done_when_b_ran, 5 );
+}
+
+TEST(lz4_executor, max_in_flight) {
+    ext::bio::lz4::executor ex(4);
+    std::atomic<int> running(0), max_running(0);
+    {
+        ext::bio::lz4::executor::stream s(ex, 2);
+        for( int i = 0; i < 20; ++i )
+            s.submit([&]{
+                int now = ++running;
+                int prev = max_running;
+                while( now > prev && !max_running.compare_exchange_weak(prev, now) )
+                    ;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                --running;
+            });
+    }
+    ASSERT_LE( max_running, 2 );
+}
+
+void test_parallel_comp_decomp(ext::bio::lz4_params params){
+    ext::bio::lz4::executor ex(3);
+    params.executor = &ex;
+    params.max_in_flight = 3;
+    // blocks of several streams are compressed at the same time
+    std::vector<std::string> data(4), compressed(4);
+    std::vector<std::thread> threads;
+    for( size_t i = 0; i < data.size(); ++i ){
+        data[i] = random_string(RANDOM_DATA_SIZE / (i + 1)) + std::string(30*1024*1024, 'a' + i);
+        threads.emplace_back([&, i]{
+            std::stringbuf buf;
+            {
+                std::ostream out( &buf );
+                bio::filtering_ostream bifo;
+                bifo.push( ext::bio::lz4_compressor(params) );
+                bifo.push( out );
+                bifo << data[i];
+            }
+            compressed[i] = buf.str();
+        });
+    }
+    for( std::thread& t : threads )
+        t.join();
+    for( size_t i = 0; i < data.size(); ++i )
+        ASSERT_EQ( data[i], decompress_string(compressed[i]) );
+}
+
+TEST(lz4_executor, parallel_comp_decomp_legacy) {
+    test_parallel_comp_decomp( ext::bio::lz4_params() );
+}
+
+TEST(lz4_executor, parallel_comp_decomp_frame) {
+    ext::bio::lz4_params params(ext::bio::lz4::frame);
+    params.block_size_id = 5;
+    params.block_checksum = true;
+    test_parallel_comp_decomp( params );
+}
+
+TEST(lz4_executor, parallel_same_as_sequential) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(20*1024*1024, 'x');
+    ext::bio::lz4_params params;
+    std::string sequential, parallel;
+    for( int i = 0; i < 2; ++i ){
+        params.executor = i ? &ext::bio::lz4::executor::shared() : 0;
+        std::stringbuf buf;
+        {
+            std::ostream out( &buf );
+            bio::filtering_ostream bifo;
+            bifo.push( ext::bio::lz4_compressor(params) );
+            bifo.push( out );
+            bifo << data;
+        }
+        (i ? parallel : sequential) = buf.str();
+    }
+    ASSERT_EQ( sequential, parallel );
+
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_multichar_compressor(params) );
+        bifo.push( out );
+        bifo << data;
+    }
+    ASSERT_EQ( sequential, buf.str() );
+}
+
+TEST(lz4_shuffle, same_as_scalar) {
+    std::string data = random_string(16 * 1000 + 13);
+    for( unsigned element_size : { 1u, 2u, 3u, 4u, 8u, 12u, 16u } ){
+        for( size_t size : { (size_t)0, (size_t)7, (size_t)16 * 16 + 5, (size_t)16 * 33 * element_size + 3, data.size() } ){
+            size_t count = size / element_size;
+            std::string expected(data, 0, size), shuffled(size, '\0'), unshuffled(size, '\0');
+            for( size_t i = 0; i < count; ++i )
+                for( unsigned b = 0; b < element_size; ++b )
+                    expected[b * count + i] = data[i * element_size + b];
+            ext::bio::lz4::shuffle( data.data(), &shuffled[0], size, element_size );
+            ASSERT_EQ( expected, shuffled ) << element_size << " " << size;
+            ext::bio::lz4::unshuffle( shuffled.data(), &unshuffled[0], size, element_size );
+            ASSERT_EQ( data.substr(0, size), unshuffled ) << element_size << " " << size;
+        }
+    }
+}
+
+// time series: slowly growing int32 counters
+std::string int32_series(size_t count){
+    std::string data(count * 4, '\0');
+    uint32_t value = 1000000;
+    for( size_t i = 0; i < count; ++i ){
+        value += rand() % 16;
+        memcpy(&data[i * 4], &value, 4);
+    }
+    return data;
+}
+
+std::string compress_string(const std::string& data, const ext::bio::lz4_shuffle_params* shuffle){
+    std::stringbuf buf;
+    {
+        std::ostream out( &buf );
+        bio::filtering_ostream bifo;
+        if( shuffle )
+            bifo.push( ext::bio::lz4_shuffler(*shuffle) );
+        bifo.push( ext::bio::lz4_compressor() );
+        bifo.push( out );
+        bifo << data;
+    }
+    return buf.str();
+}
+
+TEST(lz4_shuffle, comp_decomp) {
+    std::string data = int32_series(1000 * 1000 + 3) + "tail";
+    ext::bio::lz4_shuffle_params params(4, true);
+    params.block_size = 100 * 1000;
+    std::string compressed = compress_string(data, &params);
+    // shuffling and delta find matches where raw bytes have few
+    ASSERT_LT( compressed.size() * 2, compress_string(data, 0).size() );
+
+    bio::filtering_istream bifi;
+    bifi.push( ext::bio::lz4_unshuffler() );
+    bifi.push( ext::bio::lz4_decompressor() );
+    std::istringstream in( compressed );
+    bifi.push( in );
+    std::stringbuf out_buf;
+    std::ostream out( &out_buf );
+    bio::copy( bifi, out );
+    ASSERT_EQ( data, out_buf.str() );
+}
+
+TEST(lz4_shuffle, marker_selects_transform) {
+    std::string data = random_string(300 * 1000);
+    for( unsigned element_size : { 2u, 8u, 5u } ){
+        for( int delta = 0; delta < 2 && (delta == 0 || element_size != 5); ++delta ){
+            std::string shuffled;
+            {
+                bio::filtering_ostream bifo;
+                bifo.push( ext::bio::lz4_shuffler(ext::bio::lz4_shuffle_params(element_size, delta != 0)) );
+                bifo.push( bio::back_inserter(shuffled) );
+                bifo << data;
+            }
+            ASSERT_EQ( data.size() + ext::bio::lz4::shuffle_header_size, shuffled.size() );
+            std::string unshuffled;
+            {
+                bio::filtering_ostream bifo;
+                bifo.push( ext::bio::lz4_unshuffler() );
+                bifo.push( bio::back_inserter(unshuffled) );
+                bifo << shuffled;
+            }
+            ASSERT_EQ( data, unshuffled );
+        }
+    }
+    std::string not_shuffled;
+    ASSERT_THROW( {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_unshuffler() );
+        bifo.push( bio::back_inserter(not_shuffled) );
+        bifo << data;
+        bifo.reset();
+    }, std::runtime_error );
+}
+
+// feeds the decoder by in_chunk bytes, with room for out_chunk bytes each time
+template<typename Decompressor = ext::bio::lz4_decompressor>
+std::string decompress_in_place(const std::string& compressed, size_t in_chunk, size_t out_chunk){
+    Decompressor d;
+    d.set_in_place( true );
+    std::string s;
+    std::vector<char> out( out_chunk );
+    const char* src = compressed.data();
+    const char* const end = src + compressed.size();
+    for(;;){
+        const char* src_end = src + std::min<size_t>(in_chunk, end - src);
+        const bool flush = src_end == end;
+        char* dst = out.data();
+        const bool again = d.filter().filter( src, src_end, dst, dst + out.size(), flush );
+        s.append( out.data(), dst );
+        if( flush && !again && src == end )
+            break;
+    }
+    return s;
+}
+
+TEST(lz4_in_place, legacy) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(10*1024*1024, 'x') + "end";
+    std::string compressed = compress_string(data, 0);
+    ASSERT_EQ( data, decompress_in_place(compressed, 100000, 70000) );
+    ASSERT_EQ( data, decompress_in_place(compressed, compressed.size(), 300000) );
+    // whole blocks still go straight to a large enough output
+    ASSERT_EQ( data, decompress_in_place(compressed, 4097, ext::bio::lz4::legacy_blocksize) );
+}
+
+TEST(lz4_in_place, frame) {
+    // random data makes uncompressed blocks, moved down in place
+    std::string data = random_string(RANDOM_DATA_SIZE / 2) + std::string(RANDOM_DATA_SIZE, 'x');
+    for( unsigned int id=4; id<=7; id++ ){
+        ext::bio::lz4_params p(ext::bio::lz4::frame, data.size());
+        p.block_size_id = id;
+        p.block_checksum = id & 1;
+        std::string compressed;
+        {
+            bio::filtering_ostream bifo;
+            bifo.push( ext::bio::lz4_compressor(p) );
+            bifo.push( bio::back_inserter(compressed) );
+            bifo << data;
+        }
+        ASSERT_EQ( data, decompress_in_place(compressed, 33333, 12345) ) << id;
+    }
+}
+
+TEST(lz4_in_place, frame_checksums_barely_compressed) {
+    // each block just compresses: the whole in-place margin is needed
+    std::string data;
+    for( int i = 0; i < 8; ++i )
+        data += random_string(64*1024 - 600) + std::string(600, 'z');
+    ext::bio::lz4_params p(ext::bio::lz4::frame);
+    p.block_size_id = 4;
+    p.block_checksum = true;
+    std::string compressed;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(compressed) );
+        bifo << data;
+    }
+    uint32_t word;
+    memcpy( &word, compressed.data() + 7, 4 );
+    ASSERT_EQ( 0u, word & 0x80000000 );
+    ASSERT_GT( word, 64*1024u - 600 );
+    ASSERT_EQ( data, decompress_in_place<lz4_verifying_frame_decompressor>(compressed, 33333, 12345) );
+    ASSERT_EQ( data, decompress_in_place(compressed, 1000, 64*1024 - 1) );
+}
+
+TEST(lz4_in_place, one_shot) {
+    std::string data = random_string(1000) + std::string(100000, 'x') + random_string(1000);
+    std::string compressed = compress_string(data, 0);
+    // legacy stream: magic, block size, one block
+    const size_t block_size = compressed.size() - 8;
+    ASSERT_EQ( (uint32_t)block_size, *(const uint32_t*)&compressed[4] );
+    std::vector<char> buf( ext::bio::lz4::in_place_buffer_size(data.size(), block_size) );
+    memcpy( &buf[buf.size() - block_size], &compressed[8], block_size );
+    ASSERT_EQ( data.size(), ext::bio::lz4::decompress_in_place(buf.data(), buf.size(), block_size, data.size()) );
+    ASSERT_EQ( data, std::string(buf.data(), data.size()) );
+    ASSERT_THROW( ext::bio::lz4::decompress_in_place(buf.data(), buf.size() - 1, block_size, data.size()),
+                  std::runtime_error );
+}
+
+std::string transcode_string(const std::string& legacy, const ext::bio::lz4_transcode_params& p){
+    std::istringstream in( legacy );
+    std::ostringstream out;
+    ext::bio::lz4_transcode( in, out, p );
+    return out.str();
+}
+
+TEST(lz4_transcode, legacy_to_frame) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(20*1024*1024, 'x') + "end";
+    std::string legacy = compress_string(data, 0);
+    ext::bio::lz4::executor ex(3);
+    for( unsigned int id=4; id<=7; id+=3 ){
+        ext::bio::lz4_transcode_params p;
+        p.output.block_size_id = id;
+        p.output.block_checksum = true;
+        p.output.executor = &ex;
+        std::string frame = transcode_string(legacy + legacy, p);
+        ASSERT_EQ( ext::bio::lz4::lz4s_magic, *(const uint32_t*)frame.data() );
+        ASSERT_EQ( data + data, decompress_with<lz4_verifying_frame_decompressor>(frame) ) << id;
+    }
+    // not a legacy stream
+    std::string frame = transcode_string(legacy, ext::bio::lz4_transcode_params());
+    ASSERT_THROW( transcode_string(frame, ext::bio::lz4_transcode_params()), std::runtime_error );
+}
+
+TEST(lz4_transcode, gzip_input) {
+    std::string data = random_string(100000) + std::string(9*1024*1024, 'x');
+    std::string gzipped;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( bio::gzip_compressor() );
+        bifo.push( bio::back_inserter(gzipped) );
+        bifo << compress_string(data, 0);
+    }
+    std::string frame = transcode_string(gzipped, ext::bio::lz4_transcode_params(ext::bio::lz4_params(ext::bio::lz4::frame), true));
+    ASSERT_EQ( data, decompress_string(frame) );
+}
+
+std::string decompress_with_budget(const std::string& data, size_t budget, size_t* peak){
+    ext::bio::lz4_decompressor d( budget );
+    std::string s;
+    {
+        bio::filtering_istream bifi;
+        bifi.push( d );
+        bifi.push( boost::make_iterator_range(data) );
+        boost::iostreams::copy( bifi, boost::iostreams::back_inserter(s) );
+    }
+    *peak = d.memory_peak();
+    return s;
+}
+
+TEST(lz4_memory_budget, legacy) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(20*1024*1024, 'x');
+    std::string compressed = compress_string(data, 0);
+    const size_t block = ext::bio::lz4::legacy_blocksize;
+    size_t peak = 0;
+    // no limit: a compressed block, pending and staged decoded blocks
+    ASSERT_EQ( data, decompress_with_budget(compressed, 0, &peak) );
+    ASSERT_GT( peak, 2 * block );
+    // compressed and decoded block, and the input buffer
+    const size_t budget = 4 + LZ4_COMPRESSBOUND(block) + block + 2 * ext::bio::lz4::multichar_buffer_size;
+    ASSERT_EQ( data, decompress_with_budget(compressed, budget, &peak) );
+    ASSERT_LE( peak, budget );
+    // only room for one block buffer: decoded in place
+    const size_t in_place = block + block / 100 + ext::bio::lz4::multichar_buffer_size;
+    ASSERT_EQ( data, decompress_with_budget(compressed, in_place, &peak) );
+    ASSERT_LE( peak, in_place );
+    ASSERT_THROW( decompress_with_budget(compressed, block, &peak), std::runtime_error );
+    // not even the input buffer fits
+    ASSERT_THROW( ext::bio::lz4_decompressor(1000), std::invalid_argument );
+    ASSERT_THROW( ext::bio::lz4_multichar_decompressor(ext::bio::lz4::multichar_buffer_size, 1000),
+                  std::invalid_argument );
+}
+
+TEST(lz4_memory_budget, frame) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(RANDOM_DATA_SIZE, 'x');
+    ext::bio::lz4_params p(ext::bio::lz4::frame);
+    p.block_size_id = 5;
+    p.block_checksum = true;
+    std::string compressed;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(compressed) );
+        bifo << data;
+    }
+    const size_t budget = 600 * 1024;    // two 256 KB blocks and the input buffer
+    size_t peak = 0;
+    ASSERT_EQ( data, decompress_with_budget(compressed, budget, &peak) );
+    ASSERT_LE( peak, budget );
+    ASSERT_THROW( decompress_with_budget(compressed, 200 * 1024, &peak), std::runtime_error );
+}
+
+std::string auto_decompress(const std::string& data, ext::bio::lz4::codec* codec){
+    ext::bio::lz4_auto_decompressor d;
+    std::string s;
+    bio::filtering_istream bifi;
+    bifi.push( d );
+    bifi.push( boost::make_iterator_range(data) );
+    boost::iostreams::copy( bifi, boost::iostreams::back_inserter(s) );
+    *codec = d.codec();
+    return s;
+}
+
+TEST(lz4_auto, detects_codec) {
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(RANDOM_DATA_SIZE, 'x');
+    std::string gzipped;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( bio::gzip_compressor() );
+        bifo.push( bio::back_inserter(gzipped) );
+        bifo << data;
+    }
+    std::string frame;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(ext::bio::lz4_params(ext::bio::lz4::frame)) );
+        bifo.push( bio::back_inserter(frame) );
+        bifo << data;
+    }
+    ext::bio::lz4::codec codec;
+    ASSERT_EQ( data, auto_decompress(compress_string(data, 0), &codec) );
+    ASSERT_EQ( ext::bio::lz4::codec_lz4_legacy, codec );
+    ASSERT_EQ( data, auto_decompress(frame, &codec) );
+    ASSERT_EQ( ext::bio::lz4::codec_lz4_frame, codec );
+    ASSERT_EQ( data, auto_decompress(gzipped, &codec) );
+    ASSERT_EQ( ext::bio::lz4::codec_gzip, codec );
+    ASSERT_EQ( data, auto_decompress(data, &codec) );
+    ASSERT_EQ( ext::bio::lz4::codec_raw, codec );
+    for( const char* raw : { "", "a", "abc", "abcd" } ){
+        ASSERT_EQ( raw, auto_decompress(raw, &codec) );
+        ASSERT_EQ( ext::bio::lz4::codec_raw, codec );
+    }
+}
+
+TEST(lz4_zero_blocks, canonical_form) {
+    for( size_t size : { 31, 32, 33, 279, 280, 281, 535, 100000 } ){
+        std::string zeros( size, '\0' );
+        std::string compressed = compress_string(zeros, 0);
+        ASSERT_LE( compressed.size(), 8 + 12 + size / 255 ) << size;
+        // plain lz4 decodes it as well
+        const int block_size = *(const int32_t*)&compressed[4];
+        std::string decoded( size, 'x' );
+        ASSERT_EQ( (int)size, LZ4_decompress_safe(&compressed[8], &decoded[0], block_size, size) ) << size;
+        ASSERT_EQ( zeros, decoded );
+        ASSERT_EQ( zeros, decompress_string(compressed) );
+    }
+    std::string data = std::string(20*1024*1024, '\0') + "x" + std::string(100000, '\0');
+    ext::bio::lz4_params p(ext::bio::lz4::frame);
+    p.block_size_id = 4;
+    std::string frame;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(frame) );
+        bifo << data;
+    }
+    ASSERT_LT( frame.size(), data.size() / 200 );
+    ASSERT_EQ( data, decompress_with<lz4_verifying_frame_decompressor>(frame) );
+}
+
+TEST(lz4_zero_blocks, sparse_file_sink) {
+    std::string path = testing::TempDir() + "lz4_sparse.img";
+    const size_t mb = 1024 * 1024;
+    std::string data = random_string(5000) + std::string(16 * mb, '\0') + random_string(3 * 4096)
+                     + std::string(8 * mb + 17, '\0');
+    std::string compressed = compress_string(data, 0);
+    for( int pass = 0; pass < 2; ++pass ){
+        // pass 1 overwrites the file: old data under zeros is punched out
+        uint64_t skipped;
+        {
+            ext::bio::lz4_sparse_file_sink sink( path, pass ? BOOST_IOS::openmode() : BOOST_IOS::trunc );
+            bio::filtering_ostream bifo;
+            bifo.push( ext::bio::lz4_decompressor() );
+            bifo.push( sink );
+            bifo.write( compressed.data(), compressed.size() );
+            bifo.reset();
+            skipped = sink.skipped();
+        }
+        ASSERT_GT( skipped, 23 * mb ) << pass;
+        struct stat st;
+        ASSERT_EQ( 0, stat(path.c_str(), &st) );
+        ASSERT_EQ( data.size(), (size_t)st.st_size );
+        std::ifstream in( path.c_str(), std::ios::binary );
+        std::string s(( std::istreambuf_iterator<char>(in) ), std::istreambuf_iterator<char>());
+        ASSERT_EQ( data, s );
+    }
+    std::remove( path.c_str() );
+}
+
+// what `lz4fcli -d < x.lz4 >> file` does: the old data stays, the
+// stream goes after it
+TEST(lz4_zero_blocks, sparse_file_sink_appends) {
+    std::string path = testing::TempDir() + "lz4_sparse_append.img";
+    const std::string old = random_string(100000);
+    const std::string data = std::string(8192, '\0') + "hello\n" + std::string(3 * 4096, '\0');
+    {
+        std::ofstream out( path.c_str(), std::ios::binary | std::ios::trunc );
+        out << old;
+    }
+    const int fd = ::open( path.c_str(), O_WRONLY | O_APPEND );
+    ASSERT_LE( 0, fd );
+    ASSERT_EQ( 0, lseek(fd, 0, SEEK_SET) );
+    {
+        ext::bio::lz4_sparse_file_sink sink( fd, true );
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_decompressor() );
+        bifo.push( sink );
+        const std::string compressed = compress_string(data, 0);
+        bifo.write( compressed.data(), compressed.size() );
+    }
+    std::ifstream in( path.c_str(), std::ios::binary );
+    std::string s(( std::istreambuf_iterator<char>(in) ), std::istreambuf_iterator<char>());
+    ASSERT_EQ( old.size() + data.size(), s.size() );
+    ASSERT_EQ( old + data, s );
+    std::remove( path.c_str() );
+}
+
+std::string compress_frame(const std::string& data, unsigned int block_size_id){
+    ext::bio::lz4_params p( ext::bio::lz4::frame, data.size() );
+    p.block_size_id = block_size_id;
+    p.block_checksum = true;
+    std::string frame;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(frame) );
+        bifo << data;
+    }
+    return frame;
+}
+
+ext::bio::lz4_stream_info verify_string(const std::string& data){
+    std::istringstream in( data );
+    return ext::bio::lz4_verify( in );
+}
+
+std::string append_string(const std::string& head, const std::string& tail, ext::bio::lz4::stream_format f){
+    std::istringstream in( tail );
+    std::ostringstream out;
+    out << head;
+    ext::bio::lz4_append( in, out, f );
+    return out.str();
+}
+
+TEST(lz4_blocks, verify_and_append) {
+    std::string a = random_string(RANDOM_DATA_SIZE) + std::string(RANDOM_DATA_SIZE, 'a');
+    std::string b = "b" + random_string(1000);
+    std::string legacy_a = compress_string(a, 0), legacy_b = compress_string(b, 0);
+
+    ext::bio::lz4_stream_info info = verify_string(legacy_a);
+    ASSERT_EQ( ext::bio::lz4::legacy, info.format );
+    ASSERT_EQ( 1u, info.streams );
+    ASSERT_EQ( 3u, info.blocks );
+    ASSERT_EQ( legacy_a.size(), info.size );
+    ASSERT_LE( a.size(), info.max_decoded_size );
+
+    std::string legacy = append_string(legacy_a, legacy_b, ext::bio::lz4::legacy);
+    ASSERT_EQ( legacy_a.size() + legacy_b.size() - 4, legacy.size() );
+    ASSERT_EQ( 1u, verify_string(legacy).streams );
+    ASSERT_EQ( a + b, decompress_with<ext::bio::lz4_legacy_decompressor>(legacy) );
+
+    std::string frame_a = compress_frame(a, 4), frame_b = compress_frame(b, 5);
+    info = verify_string(frame_a);
+    ASSERT_EQ( ext::bio::lz4::frame, info.format );
+    ASSERT_EQ( (a.size() + 65535) / 65536, info.blocks );
+    std::string frame = append_string(frame_a, frame_b, ext::bio::lz4::frame);
+    ASSERT_EQ( 2u, verify_string(frame).streams );
+    ASSERT_EQ( a + b, decompress_with<lz4_verifying_frame_decompressor>(frame) );
+    // legacy after a frame is read by lz4_decompressor, a frame after legacy is not
+    ASSERT_EQ( a + b + b, decompress_string(append_string(frame, legacy_b, ext::bio::lz4::frame)) );
+    ASSERT_THROW( append_string(legacy_a, frame_b, ext::bio::lz4::legacy), std::runtime_error );
+
+    // broken streams
+    ASSERT_THROW( verify_string(legacy.substr(0, legacy.size() - 1)), std::runtime_error );
+    ASSERT_THROW( verify_string(frame.substr(0, frame.size() - 4)), std::runtime_error );
+    std::string bad = frame;
+    bad[frame_a.size() / 2] ^= 1;
+    ASSERT_THROW( verify_string(bad), std::runtime_error );
+    ASSERT_THROW( append_string("", "not lz4", ext::bio::lz4::frame), std::runtime_error );
+}
+
+std::string read_file(const std::string& path){
+    std::ifstream in( path.c_str(), std::ios::binary );
+    return std::string(( std::istreambuf_iterator<char>(in) ), std::istreambuf_iterator<char>());
+}
+
+TEST(lz4_blocks, split) {
+    std::string path = testing::TempDir() + "lz4_split.lz4";
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(3 * RANDOM_DATA_SIZE, 's') + "end";
+    for( int frame = 0; frame < 2; ++frame ){
+        {
+            std::ofstream out( path.c_str(), std::ios::binary | std::ios::trunc );
+            out << (frame ? compress_frame(data, 5) : compress_string(data, 0));
+        }
+        std::vector<std::string> names = ext::bio::lz4_split( path, 3 );
+        ASSERT_EQ( 3u, names.size() ) << frame;
+        std::string joined;
+        for( size_t i = 0; i < names.size(); ++i ){
+            std::string part = read_file(names[i]);
+            ASSERT_EQ( 1u, verify_string(part).streams ) << frame;
+            joined += frame ? decompress_with<lz4_verifying_frame_decompressor>(part) : decompress_string(part);
+            std::remove( names[i].c_str() );
+        }
+        ASSERT_EQ( data, joined ) << frame;
+        // more parts than blocks
+        ASSERT_EQ( frame ? data.size() / (256 * 1024) + 1 : 6u, ext::bio::lz4_split( path, 1000 ).size() );
+    }
+    std::remove( path.c_str() );
+}
+
+std::string read_in_chunks(const std::string& compressed, size_t chunk, size_t direct_min, size_t* peak){
+    std::stringbuf buf( compressed );
+    std::istream in( &buf );
+    ext::bio::lz4_multichar_decompressor d;
+    d.set_direct_min( direct_min );
+    std::string s;
+    std::vector<char> out_buf( chunk );
+    std::streamsize n;
+    while( (n = d.read(in, &out_buf[0], out_buf.size())) > 0 ){
+        s.append( &out_buf[0], n );
+    }
+    if( peak )
+        *peak = d.memory_peak();
+    return s;
+}
+
+TEST(lz4_direct, short_blocks_skip_staging) {
+    std::string data = random_string(100000) + std::string(50000, 'x');
+    ext::bio::lz4_params p( ext::bio::lz4::frame );
+    p.block_size_id = 7;    // 4 MB
+    std::string frame;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(frame) );
+        bifo << data;
+    }
+    for( const std::string& compressed : { frame, compress_string(data, 0) } ){
+        size_t peak, staged_peak;
+        ASSERT_EQ( data, read_in_chunks(compressed, 256 * 1024, ext::bio::lz4::direct_min_size, &peak) );
+        ASSERT_EQ( data, read_in_chunks(compressed, 256 * 1024, 1024 * 1024, &staged_peak) );
+        // no block sized output buffer
+        ASSERT_LT( peak, 512u * 1024 );
+        ASSERT_GT( staged_peak, 4u * 1024 * 1024 );
+    }
+}
+
+TEST(lz4_direct, wrong_guess_is_staged) {
+    // the ratio of the random block says the last block fits, it does not
+    std::string data = random_string(8 * 1024 * 1024) + std::string(300000, 'x') + random_string(1000);
+    std::string legacy = compress_string(data, 0);
+    ASSERT_EQ( data, read_in_chunks(legacy, 256 * 1024, ext::bio::lz4::direct_min_size, 0) );
+    ASSERT_EQ( data, read_in_chunks(legacy, 64 * 1024, 0, 0) );
+}
+
+void write_log(const std::string& path, const ext::bio::lz4_log_params& p, int threads, int records){
+    ext::bio::lz4_log_writer log( path, p );
+    std::vector<std::thread> writers;
+    for( int t = 0; t < threads; ++t ){
+        writers.push_back( std::thread([&log, t, records]{
+            for( int i = 0; i < records; ++i ){
+                std::ostringstream r;
+                r << t << ' ' << i << ' ' << std::string(i % 50, 'r') << '\n';
+                log.write( r.str().data(), r.str().size() );
+            }
+        }) );
+    }
+    for( std::thread& w : writers )
+        w.join();
+    ASSERT_EQ( 0u, log.dropped() );
+}
+
+TEST(lz4_log, many_writers) {
+    std::string path = testing::TempDir() + "lz4_log.lz4";
+    const int threads = 4, records = 20000;
+    for( int frame = 0; frame < 2; ++frame ){
+        ext::bio::lz4_log_params p( frame ? ext::bio::lz4_params(ext::bio::lz4::frame) : ext::bio::lz4_params(),
+                                    64 * 1024 );
+        p.output.block_size_id = 4;
+        p.fsync_blocks = 8;
+        std::remove( path.c_str() );
+        // each opening appends a stream, read as one
+        write_log( path, p, threads, records );
+        write_log( path, p, threads, records );
+
+        std::istringstream in( decompress_string(read_file(path)) );
+        std::vector<int> next( threads, 0 );
+        int t, i;
+        std::string pad;
+        for( int k = 0; k < 2 * threads * records; ++k ){
+            ASSERT_TRUE( in >> t >> i );
+            if( i % 50 )
+                in >> pad;
+            if( next[t] == records )
+                next[t] = 0;  // the second stream
+            ASSERT_EQ( next[t]++, i ) << frame;
+        }
+        ASSERT_FALSE( in >> t );
+    }
+    std::remove( path.c_str() );
+}
+
+TEST(lz4_log, flush_and_drop) {
+    int fds[2];
+    ASSERT_EQ( 0, pipe(fds) );
+    ext::bio::lz4_log_params p( ext::bio::lz4_params(), 64 * 1024 );
+    p.buffers = 2;
+    p.drop_when_full = true;
+    p.max_age_ms = 0;
+    ext::bio::lz4_log_writer log( fds[1], p, true );
+
+    std::string compressed;
+    std::thread reader;
+    std::string accepted = "first record";
+    log.write( accepted.data(), accepted.size() );
+    log.flush();
+    {
+        char buf[100];
+        ssize_t n = ::read( fds[0], buf, sizeof(buf) );
+        ASSERT_LT( 0, n );
+        compressed.assign( buf, n );
+        ASSERT_EQ( accepted, decompress_string(compressed) );
+    }
+    // nobody reads the pipe: the buffers fill up
+    int k = 0;
+    for( ; k < 10000; ++k ){
+        std::string r = random_string(1000);
+        if( !log.write(r.data(), r.size()) )
+            break;
+        accepted += r;
+    }
+    ASSERT_LT( k, 10000 );
+    ASSERT_EQ( 1u, log.dropped() );
+
+    reader = std::thread([&]{
+        char buf[65536];
+        ssize_t n;
+        while( (n = ::read(fds[0], buf, sizeof(buf))) > 0 )
+            compressed.append( buf, n );
+    });
+    log.close();
+    reader.join();
+    ::close( fds[0] );
+    ASSERT_EQ( accepted, decompress_string(compressed) );
+}
+
+// writers of records of half a buffer or more pile up on full buffers
+// while the output is not read
+TEST(lz4_log, writers_on_full_buffers) {
+    int fds[2];
+    ASSERT_EQ( 0, pipe(fds) );
+    ext::bio::lz4_log_params p( ext::bio::lz4_params(), 64 * 1024 );
+    p.buffers = 2;
+    p.max_age_ms = 0;
+    const int threads = 8, records = 40;
+    std::string compressed;
+    std::thread reader;
+    {
+        ext::bio::lz4_log_writer log( fds[1], p, true );
+        std::vector<std::thread> writers;
+        for( int t = 0; t < threads; ++t ){
+            writers.push_back( std::thread([&log, t]{
+                for( int i = 0; i < records; ++i ){
+                    std::string r = std::to_string(t) + ' ' + std::to_string(i) + ' ' +
+                                    std::string(32 * 1024 + i * 797 % (32 * 1024 - 16), 'a' + t) + '\n';
+                    log.write( r.data(), r.size() );
+                }
+            }) );
+        }
+        std::this_thread::sleep_for( std::chrono::milliseconds(100) );
+        reader = std::thread([&]{
+            char buf[65536];
+            ssize_t n;
+            while( (n = ::read(fds[0], buf, sizeof(buf))) > 0 )
+                compressed.append( buf, n );
+        });
+        for( std::thread& w : writers )
+            w.join();
+        log.close();
+    }
+    reader.join();
+    ::close( fds[0] );
+
+    std::istringstream in( decompress_string(compressed) );
+    std::vector<int> next( threads, 0 );
+    int t, i;
+    std::string pad;
+    for( int k = 0; k < threads * records; ++k ){
+        ASSERT_TRUE( in >> t >> i >> pad );
+        ASSERT_EQ( next[t]++, i );
+        ASSERT_EQ( std::string(32 * 1024 + i * 797 % (32 * 1024 - 16), 'a' + t), pad );
+    }
+    ASSERT_FALSE( in >> t );
+}
+
+TEST(lz4_buffer, random_access) {
+    std::string data = random_string(300000);
+    for( int i = 0; i < 40; ++i )
+        data += "record " + std::to_string(i) + " " + std::string(100000, 'a' + i % 26);
+    ext::bio::lz4_buffer b;
+    for( size_t pos = 0; pos < data.size(); pos += 77777 )
+        b.append( &data[pos], std::min<size_t>(77777, data.size() - pos) );
+    ASSERT_EQ( data.size(), b.size() );
+    ASSERT_LT( b.compressed_size(), data.size() / 3 );
+
+    srand(45);
+    std::vector<char> out( 200000 );
+    for( int i = 0; i < 200; ++i ){
+        size_t offset = rand() % data.size(), n = rand() % out.size();
+        size_t got = b.read( offset, &out[0], n );
+        ASSERT_EQ( std::min(n, data.size() - offset), got );
+        ASSERT_EQ( data.substr(offset, got), std::string(&out[0], got) ) << offset;
+    }
+    ASSERT_EQ( 0u, b.read(data.size(), &out[0], 1) );
+    ASSERT_EQ( data, std::string(b.begin(), b.end()) );
+    ASSERT_EQ( data.substr(data.size() - 100000), std::string(b.end() - 100000, b.end()) );
+    ASSERT_EQ( data[123456], b.begin()[123456] );
+}
+
+TEST(lz4_buffer, write_as_stream) {
+    std::string data = random_string(200000) + std::string(300000, 'w') + "tail";
+    for( int frame = 0; frame < 2; ++frame ){
+        ext::bio::lz4_buffer_params p;
+        p.format = frame ? ext::bio::lz4::frame : ext::bio::lz4::legacy;
+        p.block_checksum = true;
+        ext::bio::lz4_buffer b( p );
+        b.append( data.data(), data.size() );
+        std::ostringstream out;
+        b.write( out );
+        ASSERT_EQ( data, frame ? decompress_with<lz4_verifying_frame_decompressor>(out.str())
+                               : decompress_string(out.str()) );
+        // the sealed blocks went out as they were
+        ASSERT_EQ( (data.size() + b.block_size() - 1) / b.block_size(), verify_string(out.str()).blocks );
+    }
+}
+
+// records made of a few incompressible messages, which an independent
+// block has to spell out again
+std::string log_lines(size_t size){
+    std::vector<std::string> messages;
+    for( int i = 0; i < 30; ++i )
+        messages.push_back( random_string(1000) );
+    std::string s;
+    for( unsigned i = 0; s.size() < size; ++i )
+        s += "2026-10-18 seq=" + std::to_string(i) + " " + messages[i * 7 % messages.size()] + "\n";
+    return s;
+}
+
+TEST(lz4_buffer, same_image_as_compressor) {
+    std::string data = random_string(150000) + std::string(100000, 0) + log_lines(200000);
+    for( int frame = 0; frame < 2; ++frame ){
+        ext::bio::lz4_buffer_params p;
+        p.format = frame ? ext::bio::lz4::frame : ext::bio::lz4::legacy;
+        p.block_checksum = true;
+        ext::bio::lz4_buffer b( p );
+        b.append( data.data(), data.size() );
+        std::ostringstream out;
+        b.write( out );
+        ASSERT_EQ( data, decompress_with<ext::bio::lz4_decompressor>(out.str()) );
+        if( !frame )
+            continue;
+        ext::bio::lz4_params c( ext::bio::lz4::frame, data.size() );
+        c.block_size_id = p.block_size_id;
+        c.block_checksum = true;
+        std::string compressed;
+        {
+            bio::filtering_ostream bifo;
+            bifo.push( ext::bio::lz4_compressor(c) );
+            bifo.push( bio::back_inserter(compressed) );
+            bifo << data;
+        }
+        ASSERT_EQ( compressed, out.str() );
+    }
+}
+
+std::string compress_linked(const std::string& data, bool linked, ext::bio::lz4::executor* executor){
+    ext::bio::lz4_params p( ext::bio::lz4::frame );
+    p.block_size_id = 4;
+    p.block_checksum = true;
+    p.linked_blocks = linked;
+    p.executor = executor;
+    std::string frame;
+    {
+        bio::filtering_ostream bifo;
+        bifo.push( ext::bio::lz4_compressor(p) );
+        bifo.push( bio::back_inserter(frame) );
+        bifo << data;
+    }
+    return frame;
+}
+
+// decoded by the lz4 library's own frame decoder
+std::string lz4f_decompress(const std::string& frame){
+    LZ4F_dctx* ctx;
+    if( LZ4F_isError(LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION)) )
+        throw std::runtime_error("LZ4F context");
+    std::string s;
+    std::vector<char> buf( 1024*1024 );
+    for( size_t pos = 0; pos < frame.size(); ){
+        size_t dst_size = buf.size(), src_size = frame.size() - pos;
+        size_t r = LZ4F_decompress(ctx, &buf[0], &dst_size, frame.data() + pos, &src_size, 0);
+        if( LZ4F_isError(r) ){
+            LZ4F_freeDecompressionContext(ctx);
+            throw std::runtime_error(LZ4F_getErrorName(r));
+        }
+        s.append( &buf[0], dst_size );
+        pos += src_size;
+        if( r == 0 ) break;
+    }
+    LZ4F_freeDecompressionContext(ctx);
+    return s;
+}
+
+TEST(lz4_linked, parallel_same_as_sequential) {
+    std::string data = log_lines(3*1024*1024) + std::string(200000, 0) + random_string(100000) + log_lines(500000);
+    std::string independent = compress_linked(data, false, 0);
+    std::string sequential = compress_linked(data, true, 0);
+    ext::bio::lz4::executor ex(3);
+    ASSERT_EQ( sequential, compress_linked(data, true, &ex) );
+    // every 64 KB block starts with a full window
+    ASSERT_LT( sequential.size(), independent.size() / 2 );
+    ASSERT_EQ( 0, sequential[4] & (1 << 5) );
+    ASSERT_EQ( data, lz4f_decompress(sequential) );
+    ASSERT_EQ( lz4f_decompress(independent), lz4f_decompress(sequential) );
+}
+
+TEST(lz4_linked, decode_paths) {
+    std::string data = log_lines(1024*1024) + std::string(100000, 0) + log_lines(300000);
+    std::string frame = compress_linked(data, true, 0);
+    ASSERT_EQ( data, decompress_with<lz4_verifying_frame_decompressor>(frame) );
+    // straight into the output, through m_out_buf, and in place
+    ASSERT_EQ( data, read_in_chunks(frame, 70000, 64*1024, 0) );
+    ASSERT_EQ( data, read_in_chunks(frame, 5000, 64*1024, 0) );
+    ASSERT_EQ( data, decompress_in_place(frame, 3000, 7000) );
+    size_t peak = 0;
+    ASSERT_EQ( data, decompress_with_budget(frame, 300 * 1024, &peak) );
+    ASSERT_LE( peak, 300 * 1024u );
+    // a part would start without the data its blocks refer to
+    std::string path = "lz4_linked_split.lz4";
+    std::ofstream( path.c_str(), std::ios::binary ) << frame;
+    ASSERT_THROW( ext::bio::lz4_split(path, 2), std::runtime_error );
+    std::remove( path.c_str() );
+}
+
+TEST(lz4_checkpoint, resume_file_source) {
+    std::string a = log_lines(1024*1024) + random_string(100000), b = log_lines(300000);
+    std::string path = "lz4_checkpoint.lz4";
+    std::ofstream( path.c_str(), std::ios::binary ) << compress_linked(a, true, 0) << compress_string(b, 0);
+    const std::string data = a + b;
+
+    // checkpoints as they come, kept as bytes
+    std::vector<std::string> saved;
+    std::string s;
+    {
+        ext::bio::lz4_file_source src( path );
+        std::vector<char> buf( 100000 );
+        std::streamsize n;
+        while( (n = src.read(&buf[0], buf.size())) > 0 ){
+            s.append( &buf[0], n );
+            ext::bio::lz4_checkpoint cp;
+            if( !src.checkpoint(cp) )
+                continue;
+            ASSERT_LE( cp.decoded_offset, s.size() );
+            std::ostringstream out;
+            ext::bio::save_checkpoint( out, cp );
+            if( saved.empty() || saved.back() != out.str() )
+                saved.push_back( out.str() );
+        }
+    }
+    ASSERT_EQ( data, s );
+    ASSERT_GT( saved.size(), 10u );
+
+    bool linked = false, legacy = false;
+    for( size_t i = 0; i < saved.size(); ++i ){
+        std::istringstream in( saved[i] );
+        ext::bio::lz4_checkpoint cp = ext::bio::load_checkpoint( in );
+        linked = linked || !cp.dict.empty();
+        legacy = legacy || cp.header.size() == 4;
+        ext::bio::lz4_file_source src( path );
+        src.restore( cp );
+        std::string rest;
+        // a short read first: the rest of the block stays staged
+        std::vector<char> buf( 4096 );
+        std::streamsize n;
+        while( (n = src.read(&buf[0], buf.size())) > 0 ){
+            rest.append( &buf[0], n );
+            buf.resize( 300000 );
+        }
+        ASSERT_EQ( data.substr(cp.decoded_offset), rest ) << i;
+    }
+    ASSERT_TRUE( linked );
+    ASSERT_TRUE( legacy );
+    std::remove( path.c_str() );
+}
+
+// the rest of a verified frame from cp on
+std::string read_restored(const ext::bio::lz4_checkpoint& cp, const std::string& tail){
+    lz4_verifying_frame_decompressor d;
+    d.restore( cp );
+    std::stringbuf buf( tail );
+    std::istream in( &buf );
+    std::string s;
+    bio::filtering_istream bifi;
+    bifi.push( d );
+    bifi.push( in );
+    bifi.exceptions( std::ifstream::badbit );
+    boost::iostreams::copy( bifi, boost::iostreams::back_inserter(s) );
+    return s;
+}
+
+TEST(lz4_checkpoint, checksums_carry_over) {
+    std::string data = log_lines(2*1024*1024);
+    std::string frame = compress_linked(data, true, 0);
+    lz4_verifying_frame_decompressor d;
+    std::string out( data.size(), 0 );
+    const char* src = frame.data();
+    char* dst = &out[0];
+    // stop half way through the output
+    d.filter().filter( src, src + frame.size(), dst, dst + data.size() / 2, false );
+    ext::bio::lz4_checkpoint cp;
+    ASSERT_TRUE( d.checkpoint(cp) );
+    ASSERT_GT( cp.decoded_offset, 0u );
+    ASSERT_EQ( data.substr(0, cp.decoded_offset), out.substr(0, cp.decoded_offset) );
+
+    std::string tail = frame.substr( cp.compressed_offset );
+    ASSERT_EQ( data.substr(cp.decoded_offset), read_restored(cp, tail) );
+    tail[tail.size() - 1] ^= 1;  // content checksum
+    ASSERT_THROW( read_restored(cp, tail), std::runtime_error );
+}
+
+// hands the decoder what arrived, with room for 20000 bytes each call,
+// until it has nothing more to output
+void feed(ext::bio::lz4_decompressor& d, const char*& src, const char* end, std::string& s, bool flush = false){
+    std::vector<char> buf( 20000 );
+    for(;;){
+        char* dst = &buf[0];
+        const bool again = d.filter().filter( src, end, dst, dst + buf.size(), flush );
+        s.append( &buf[0], dst );
+        if( src == end && (dst == &buf[0] || (flush && !again)) )
+            break;
+    }
+}
+
+TEST(lz4_trim, idle_streams_share_pool) {
+    ext::bio::lz4_buffer_pool pool;
+    const int streams = 6;
+    std::vector<std::string> data, frames, out( streams );
+    std::vector<ext::bio::lz4_decompressor> d;
+    std::vector<const char*> pos;
+    for( int k = 0; k < streams; ++k ){
+        data.push_back( log_lines(200000 + k * 50000) + random_string(70000) );
+        frames.push_back( compress_linked(data.back(), k % 2, 0) );
+        d.push_back( ext::bio::lz4_decompressor(0, &pool) );
+        pos.push_back( frames.back().data() );
+    }
+    // no 8 MB input buffer
+    ASSERT_LT( d[0].memory_peak(), 100*1024u );
+    ASSERT_GT( ext::bio::lz4_decompressor().memory_peak(), 8*1024*1024u );
+
+    // a block to each in turn: all wait between two blocks in the end
+    for( int k = 0; k < streams; ++k )
+        feed( d[k], pos[k], pos[k] + 7, out[k] );   // header
+    for( bool more = true; more; ){
+        more = false;
+        for( int k = 0; k < streams; ++k ){
+            uint32_t word;
+            memcpy( &word, pos[k], 4 );
+            if( word == 0 )
+                continue;
+            feed( d[k], pos[k], pos[k] + 4 + (word & 0x7fffffff) + 4, out[k] );
+            ASSERT_TRUE( d[k].filter().trimmed() ) << k;
+            more = true;
+        }
+        ASSERT_GT( pool.size(), 0u );
+    }
+    for( int k = 0; k < streams; ++k ){
+        const char* end = frames[k].data() + frames[k].size();
+        feed( d[k], pos[k], end, out[k], true );
+        ASSERT_EQ( data[k], out[k] ) << k;
+    }
+
+    // half a block is staged
+    std::string s;
+    const char* src = frames[0].data();
+    ext::bio::lz4_decompressor e( 0, &pool );
+    e.set_auto_trim( false );
+    feed( e, src, src + 7 + 1000, s );
+    ASSERT_FALSE( e.trim() );
+    uint32_t word;
+    memcpy( &word, frames[0].data() + 7, 4 );
+    feed( e, src, frames[0].data() + 7 + 4 + (word & 0x7fffffff) + 4, s );
+    ASSERT_FALSE( e.filter().trimmed() );
+    ASSERT_TRUE( e.trim() );
+    feed( e, src, frames[0].data() + frames[0].size(), s, true );
+    ASSERT_EQ( data[0], s );
+}
+
+TEST(lz4_trim, pool_and_chains) {
+    ext::bio::lz4_buffer_pool pool( 1024*1024 );
+    ext::bio::lz4_buffer_pool::buffer b = pool.take( 100000 );
+    ASSERT_GE( b.capacity(), 100000u );
+    const size_t capacity = b.capacity();
+    pool.give( b );
+    ASSERT_EQ( 0u, b.capacity() );
+    ASSERT_EQ( capacity, pool.size() );
+    b = pool.take( 50 );
+    ASSERT_EQ( capacity, b.capacity() );
+    ASSERT_EQ( 0u, pool.size() );
+    // beyond max_bytes buffers are freed
+    b.reserve( 2*1024*1024 );
+    pool.give( b );
+    ASSERT_EQ( 0u, pool.size() );
+
+    // legacy blocks are larger than the input buffer
+    std::string data = random_string(RANDOM_DATA_SIZE) + std::string(9*1024*1024, 'x') + log_lines(500000);
+    std::string compressed = compress_string(data, 0);
+    for( int i = 0; i < 2; ++i ){
+        std::string s;
+        bio::filtering_istream bifi;
+        bifi.push( ext::bio::lz4_decompressor(0, &pool) );
+        bifi.push( bio::array_source(compressed.data(), compressed.size()) );
+        boost::iostreams::copy( bifi, boost::iostreams::back_inserter(s) );
+        ASSERT_EQ( data, s );
+    }
+}
+
+// written in pieces of write_size bytes
+std::string compress_chunked(const std::string& data, const ext::bio::lz4_params& p, size_t write_size){
+    std::string compressed;
+    bio::filtering_ostream bifo;
+    bifo.push( ext::bio::lz4_compressor(p) );
+    bifo.push( bio::back_inserter(compressed) );
+    for( size_t pos = 0; pos < data.size(); pos += write_size )
+        bifo.write( data.data() + pos, std::min(write_size, data.size() - pos) );
+    bifo.reset();
+    return compressed;
+}
+
+// the blocks of a frame without block checksums, as written
+std::vector<std::string> frame_blocks(const std::string& frame){
+    std::vector<std::string> blocks;
+    for( size_t pos = 7;; ){
+        uint32_t word;
+        memcpy( &word, frame.data() + pos, 4 );
+        if( word == 0 )
+            return blocks;
+        blocks.push_back( frame.substr(pos, 4 + (word & 0x7fffffff)) );
+        pos += 4 + (word & 0x7fffffff);
+    }
+}
+
+TEST(lz4_chunked, edits_keep_other_blocks) {
+    std::string data = log_lines(2*1024*1024) + random_string(300000) + log_lines(500000);
+    std::string edited = data;
+    edited.insert( 100000, "x" );
+    edited.erase( 1500000, 1000 );
+    ext::bio::lz4_params p( ext::bio::lz4::frame );
+    p.block_size_id = 4;
+    p.chunk_avg_size = 16*1024;
+
+    std::vector<std::string> a = frame_blocks( compress_chunked(data, p, 100000) );
+    std::vector<std::string> b = frame_blocks( compress_chunked(edited, p, 100000) );
+    std::set<std::string> before( a.begin(), a.end() );
+    size_t same = 0;
+    for( size_t i = 0; i < b.size(); ++i )
+        same += before.count( b[i] );
+    ASSERT_GT( a.size(), 100u );
+    ASSERT_GE( same, b.size() - 6 );
+    for( size_t i = 0; i < a.size(); ++i )
+        ASSERT_LE( a[i].size(), 4 + 64*1024u );
+
+    // fixed size blocks all move after the insertion
+    p.chunk_avg_size = 0;
+    a = frame_blocks( compress_chunked(data, p, 100000) );
+    b = frame_blocks( compress_chunked(edited, p, 100000) );
+    before = std::set<std::string>( a.begin(), a.end() );
+    same = 0;
+    for( size_t i = 0; i < b.size(); ++i )
+        same += before.count( b[i] );
+    ASSERT_LE( same, 3u );
+}
+
+TEST(lz4_chunked, same_output_whatever_the_writes) {
+    std::string data = log_lines(3*1024*1024) + std::string(500000, 0) + random_string(200000);
+    ext::bio::lz4::executor ex( 3 );
+    for( int lz4s = 0; lz4s < 2; ++lz4s ){
+        ext::bio::lz4_params p( lz4s ? ext::bio::lz4::frame : ext::bio::lz4::legacy );
+        p.block_size_id = 5;
+        p.chunk_avg_size = 64*1024;
+        p.chunk_min_size = 1000;
+        const std::string compressed = compress_chunked( data, p, data.size() );
+        ASSERT_EQ( compressed, compress_chunked(data, p, 777) ) << lz4s;
+        p.executor = &ex;
+        ASSERT_EQ( compressed, compress_chunked(data, p, 100000) ) << lz4s;
+        ASSERT_EQ( data, decompress_with<ext::bio::lz4_decompressor>(compressed) ) << lz4s;
+        if( lz4s ){
+            ASSERT_EQ( data, lz4f_decompress(compressed) );
+            p.linked_blocks = true;
+            ASSERT_EQ( data, lz4f_decompress(compress_chunked(data, p, 100000)) );
+        }
+    }
+
+    ext::bio::lz4_params bad( ext::bio::lz4::frame );
+    bad.block_size_id = 4;
+    bad.chunk_avg_size = 32*1024;
+    bad.chunk_max_size = 128*1024;  // more than a block
+    ASSERT_THROW( compress_chunked(data, bad, 1000), std::runtime_error );
+    bad.chunk_max_size = 0;
+    bad.max_buffered = 4096;
+    ASSERT_THROW( compress_chunked(data, bad, 1000), std::runtime_error );
+}
+
 // no LZ4S format for now
 #if 0
 TEST(lz4s, header_size) {